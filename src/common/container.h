@@ -23,6 +23,7 @@
 #include <strings.h>
 #include <string.h>
 #include <assert.h>
+#include <atomic>
 #include <initializer_list>
 
 // Fixed array of POD types (that can be zeroed with bzero()).
@@ -124,6 +125,51 @@ private:
   T buffer_[CAPACITY];
 };
 
+// A fixed size, compile-time allocated queue to pass elements from exactly
+// one producer thread to exactly one consumer thread without locking.
+// Holds at most CAPACITY - 1 elements.
+template <typename T, int CAPACITY>
+class SPSCRingQueue {
+public:
+  SPSCRingQueue() : write_pos_(0), read_pos_(0) {}
+
+  // Producer: copy element into queue. Returns false if queue is full.
+  bool push(const T &value) {
+    const unsigned pos = write_pos_.load(std::memory_order_relaxed);
+    const unsigned next = (pos + 1) % CAPACITY;
+    if (next == read_pos_.load(std::memory_order_acquire))
+      return false;
+    buffer_[pos] = value;
+    write_pos_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer: copy oldest element to "value" and remove it from queue.
+  // Returns false if queue is empty.
+  bool pop(T *value) {
+    const unsigned pos = read_pos_.load(std::memory_order_relaxed);
+    if (pos == write_pos_.load(std::memory_order_acquire))
+      return false;
+    *value = buffer_[pos];
+    read_pos_.store((pos + 1) % CAPACITY, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return read_pos_.load(std::memory_order_acquire)
+      == write_pos_.load(std::memory_order_acquire);
+  }
+
+  bool full() const {
+    return (write_pos_.load(std::memory_order_acquire) + 1) % CAPACITY
+      == read_pos_.load(std::memory_order_acquire);
+  }
+
+private:
+  std::atomic<unsigned> write_pos_;
+  std::atomic<unsigned> read_pos_;
+  T buffer_[CAPACITY];
+};
 
 // This class provides a way to iterate over enumeration values. Assumes enum
 // values to be contiguous.
@@ -79,6 +79,11 @@ public:
   HomingState GetHomeStatus();
   bool GetMotorsEnabled();
   void GetCurrentPosition(AxesRegister *pos);
+  void SetSpeedOverride(float factor);
+  float GetSpeedOverride() { return speed_override_; }
+  bool GetQueueStats(MotionQueueStats *stats) {
+    return planner_->GetQueueStats(stats);
+  }
 
   // -- GCodeParser::Events interface implementation --
   void gcode_start(GCodeParser *parser) final;
@@ -151,6 +156,7 @@ private:
   std::string coordinate_display_origin_name_;
   float current_feedrate_mm_per_sec_;    // Set via Fxxx and remembered
   float prog_speed_factor_;              // Speed factor set by program (M220)
+  float speed_override_;                 // Real-time speed override factor.
   time_t next_auto_disable_motor_;
   time_t next_auto_disable_fan_;
   bool pause_enabled_;                  // Enabled via M120, disabled via M121
@@ -174,6 +180,7 @@ GCodeMachineControl::Impl::Impl(const MachineControlConfig &config,
     g0_feedrate_mm_per_sec_(-1),
     current_feedrate_mm_per_sec_(-1),
     prog_speed_factor_(1),
+    speed_override_(1),
     homing_state_(GCodeMachineControl::HomingState::NEVER_HOMED) {
     pause_enabled_ = cfg_.enable_pause;
     next_auto_disable_motor_ = -1;
@@ -215,6 +222,11 @@ bool GCodeMachineControl::Impl::Init() {
                 cfg_.acceleration[axis], gcodep_axis2letter(axis));
       return false;
     }
+    if (cfg_.jerk[axis] < 0) {
+      Log_error("Invalid negative jerk %.1f for axis %c\n",
+                cfg_.jerk[axis], gcodep_axis2letter(axis));
+      return false;
+    }
   }
 
   for (const GCodeParserAxis axis : AllAxes()) {
@@ -267,6 +279,13 @@ bool GCodeMachineControl::Impl::Init() {
     axis_clamped_ |= (1 << clamped_axis);
   }
 
+  if (cfg_.lookahead_segments < 1
+      || cfg_.lookahead_segments > PLANNER_MAX_LOOKAHEAD) {
+    Log_error("lookahead-segments: needs to be in range 1..%d (got %d)",
+              PLANNER_MAX_LOOKAHEAD, cfg_.lookahead_segments);
+    ++error_count;
+  }
+
   // Now let's see what motors are mapped to any useful output.
   Log_debug("-- Config --\n");
   for (const GCodeParserAxis axis : AllAxes()) {
@@ -639,6 +658,12 @@ void GCodeMachineControl::Impl::GetCurrentPosition(AxesRegister *pos) {
   }
 }
 
+void GCodeMachineControl::Impl::SetSpeedOverride(float factor) {
+  if (factor <= 0) return;
+  speed_override_ = factor;
+  planner_->SetSpeedFactor(factor);
+}
+
 void GCodeMachineControl::Impl::mprint_current_position() {
   AxesRegister current_pos;
   planner_->GetCurrentPosition(&current_pos);
@@ -1061,6 +1086,18 @@ void GCodeMachineControl::GetCurrentPosition(AxesRegister *pos) {
   impl_->GetCurrentPosition(pos);
 }
 
+void GCodeMachineControl::SetSpeedOverride(float factor) {
+  impl_->SetSpeedOverride(factor);
+}
+
+float GCodeMachineControl::GetSpeedOverride() {
+  return impl_->GetSpeedOverride();
+}
+
+bool GCodeMachineControl::GetQueueStats(MotionQueueStats *stats) {
+  return impl_->GetQueueStats(stats);
+}
+
 GCodeParser::EventReceiver *GCodeMachineControl::ParseEventReceiver() {
   return impl_;
 }
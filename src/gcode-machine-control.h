@@ -26,6 +26,7 @@
 #include <string>
 
 class MotorOperations;
+struct MotionQueueStats;
 class ConfigParser;
 class Spindle;
 typedef AxesRegister FloatAxisConfig;
@@ -46,12 +47,18 @@ struct MachineControlConfig {
 
   FloatAxisConfig max_feedrate;   // Max feedrate for axis (mm/s)
   FloatAxisConfig acceleration;   // Max acceleration for axis (mm/s^2)
+  FloatAxisConfig jerk;           // Max jerk for axis (mm/s^3). 0: trapezoid
 
   FloatAxisConfig max_probe_feedrate; // Max probe feedrate for axis (mm/s)
 
   float speed_factor;         // Multiply feed with. Should be 1.0 by default.
   float threshold_angle;      // Threshold angle to ignore speed changes
   float speed_tune_angle;     // Angle added to the angle between vectors for speed tuning
+  float junction_deviation;   // Cornering by junction deviation (mm) instead
+                              // of threshold_angle if > 0.
+  int lookahead_segments;     // Segments after a move the planner looks at.
+  float chord_tolerance;      // Merge segments deviating less than this (mm)
+  bool threaded_planning;     // Plan and send moves in separate thread.
 
   std::string home_order;        // Order in which axes are homed.
 
@@ -124,6 +131,20 @@ class GCodeMachineControl {
   // Can only be called in the same thread that also handles gcode updates.
   void GetCurrentPosition(AxesRegister *pos);
 
+  // Set a real-time speed override factor (1.0 = 100%). Other than the
+  // speed factor set by the program with M220, this also applies to the
+  // moves that are already planned or queued. Values <= 0 are ignored.
+  // Can only be called in the same thread that also handles gcode updates.
+  void SetSpeedOverride(float factor);
+
+  // Return the current speed override factor.
+  float GetSpeedOverride();
+
+  // Get statistics of the motion queue, such as underruns.
+  // Returns false if not available.
+  // Can only be called in the same thread that also handles gcode updates.
+  bool GetQueueStats(MotionQueueStats *stats);
+
  private:
   class Impl;
 
@@ -86,40 +86,48 @@ bool GCodeParser::Config::SaveParams() const {
   }
 
   int pcount = 0;
-  // We have to go through the list twice. The numeric parameters need to be
-  // stored in numerical order, followed by all the alphanumeric fields.
-  //
-  // Given that we are using a string-key in the map, the numeric fields are
-  // sorted alphanumerically, which is not the same as numerically. So we
-  // simply copy them to a temporary structure that sorts them numerically.
-  std::map<int, float> numeric_params;
-  for (const auto name_value : *parameters) {
-    if (name_value.first.empty()) continue;   // Should not happen.
-    if (!isdigit(name_value.first[0]))
-      break;   // last one with digit.
-    numeric_params[atoi(name_value.first.c_str())] = name_value.second;
+  // First the numeric parameters in numerical order, followed by all the
+  // alphanumeric fields.
+  for (int i = 1; i < ParameterStore::kNumericParameters; ++i) {
+    // Parameter zero is never written. It should always be zero.
+    const float value = parameters->Get(i);
+    if (value != 0) {
+      fprintf(fp, "%i\t%f\n", i, value);
+      ++pcount;
+    }
   }
 
-  for (const auto num_value : numeric_params) {
-    if (num_value.first == 0)
-      continue;  // Never write this parameter. It should always be zero
+  // Numbers beyond the range or with leading zeros can only come from the
+  // loaded file; keep them as they are. Shorter numbers first, so that they
+  // are sorted numerically.
+  std::map<std::pair<size_t, std::string>, float> numeric_params;
+  for (const auto &name_handle : parameters->named_parameters()) {
+    const std::string &name = name_handle.first;
+    if (!isdigit(name[0])) continue;
+    numeric_params[std::make_pair(name.length(), name)]
+      = parameters->Get(name_handle.second);
+  }
+  for (const auto &num_value : numeric_params) {
     if (num_value.second != 0) {
-      fprintf(fp, "%i\t%f\n", num_value.first, num_value.second);
+      fprintf(fp, "%s\t%f\n", num_value.first.second.c_str(),
+              num_value.second);
       ++pcount;
     }
   }
 
   // Now, all the non-numeric parmeters
   int start_alpha = pcount;
-  for (const auto name_value : *parameters) {
-    if (name_value.first.empty()) continue;      // Should not happen.
-    if (isdigit(name_value.first[0])) continue;  // Numeric: already written
-    if (name_value.first[0] != '_') continue;    // Only write global parameters
-    if (name_value.second == 0) continue;        // Don't write boring zeroes.
+  for (const auto &name_handle : parameters->named_parameters()) {
+    const std::string &name = name_handle.first;
+    const float value = parameters->Get(name_handle.second);
+    if (name.empty()) continue;           // Should not happen.
+    if (isdigit(name[0])) continue;       // Numeric: already written
+    if (name[0] != '_') continue;         // Only write global parameters
+    if (value == 0) continue;             // Don't write boring zeroes.
     if (pcount == start_alpha) {
       fprintf(fp, "\n# Alphanumeric global parameters\n");
     }
-    fprintf(fp, "%s\t%f\n", name_value.first.c_str(), name_value.second);
+    fprintf(fp, "%s\t%f\n", name.c_str(), value);
     ++pcount;
   }
   Log_debug("Saving %d parameters to %s", pcount, paramfile.c_str());
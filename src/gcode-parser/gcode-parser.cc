@@ -28,17 +28,24 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <float.h>
 #include <math.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <unordered_map>
+#include <vector>
+
 #include "common/logging.h"
 #include "common/string-util.h"
 
@@ -99,6 +106,8 @@ public:
 
   void ParseBlock(GCodeParser *owner, const char *line, FILE *err_stream);
   int ParseStream(GCodeParser *owner, int input_fd, FILE *err_stream);
+  bool ParseMappedFile(GCodeParser *owner, int fd, off_t offset,
+                       FILE *err_stream);
   const char *gcodep_parse_pair_with_linenumber(int line_num,
                                                 const char *line,
                                                 char *letter,
@@ -204,19 +213,114 @@ private:
     return 4;
   }
 
+  // -- Expressions and blocks are recorded while they are parsed, so that
+  // expressions used again and WHILE loops don't have to parse the text every
+  // time. The parsing functions take an optional "record" to which they
+  // append the operations they execute; parameter names become handles.
+  typedef ParameterStore::Handle ParamHandle;
+
+  // An expression recorded as program for a little stack machine. The
+  // operations are in the order gcodep_expression() executed them.
+  struct ExprOp {
+    enum Type {
+      PUSH_VALUE,           // push "value"
+      PUSH_PARAM,           // push parameter "param"
+      PUSH_INDIRECT_PARAM,  // replace top with parameter of that number
+      UNARY,                // top = op(top)
+      ATAN2,                // pop two; push atan of their ratio
+      BINARY                // pop two; push result of op
+    };
+    Type type;
+    Operation op;
+    float value;
+    ParamHandle param;
+  };
+  typedef std::vector<ExprOp> Expression;
+
+  void record_op(Expression *record, ExprOp::Type type,
+                 Operation op = NO_OPERATION, float value = 0.0f) {
+    if (record == NULL) return;
+    ExprOp e = {};
+    e.type = type;
+    e.op = op;
+    e.value = value;
+    record->push_back(e);
+  }
+
+  // Reference to a parameter. If "index" is not empty, it is the numeric
+  // parameter the index expression evaluates to, otherwise "handle".
+  struct ParamRef {
+    ParamHandle handle;
+    Expression index;
+  };
+
+  // A parameter number that is a plain number is not recorded as index
+  // expression, the parameter is accessed by handle directly.
+  static bool is_constant(const Expression &index) {
+    return index.size() == 1 && index[0].type == ExprOp::PUSH_VALUE;
+  }
+
+  // Parameter assignment as parsed by gcodep_set_parameter()
+  struct CompiledAssignment {
+    enum Kind { INCREMENT, DECREMENT, ASSIGN };
+    int from;               // position of the '#'
+    Kind kind;
+    ParamRef param;
+    Operation op;           // compound assignment such as '+='
+    Expression value;       // the condition for ternary assignment.
+    bool ternary;
+    Expression if_true;
+    Expression if_false;
+  };
+
+  // What gcodep_parse_pair() did when called at position "from" of the
+  // block. Positions are offsets into the text of the block.
+  struct CompiledPair {
+    int from;
+    bool complete;          // false if it can only be parsed as text.
+    std::vector<CompiledAssignment> assignments;  // executed first.
+    char letter;            // 0 if the line ends after the assignments.
+    int letter_from;
+    Expression value;
+    int rest;
+  };
+
+  // A block of a WHILE loop with all pairs recorded so far.
+  struct CompiledBlock {
+    std::string text;
+    std::vector<CompiledPair> pairs;
+  };
+
+  // Bracketed expressions by their text. They are recorded the second time
+  // they are seen, so that the many expressions only used once don't pay for
+  // it.
+  struct CachedExpression {
+    bool compiled;          // "expr" is recorded from the whole expression.
+    Expression expr;
+  };
+  typedef std::unordered_map<std::string, CachedExpression> ExpressionCache;
+
+  // Calculate the operation in place. Returns NULL or the error message.
+  static const char *calculate_unary(Operation op, float *value);
+  static const char *calculate_binary(float *left, Operation op, float right);
+
   bool execute_unary(float *value, Operation op);
-  const char *gcodep_atan(const char *line, float *value);
+  const char *gcodep_atan(const char *line, float *value, Expression *record);
   const char *gcodep_operation_unary(const char *line, Operation *op);
-  const char *gcodep_unary(const char *line, float *value);
+  const char *gcodep_unary(const char *line, float *value, Expression *record);
 
   bool execute_binary(float *left, Operation op, float *right);
   const char *gcodep_operation(const char *line, Operation *op);
 
-  const char *gcodep_expression(const char *line, float *value);
+  const char *gcodep_expression(const char *line, float *value,
+                                Expression *record = NULL);
+  const char *gcodep_cached_expression(const char *line, float *value);
 
-  const char *gcodep_value(const char *line, float *value);
+  const char *gcodep_value(const char *line, float *value,
+                           Expression *record = NULL);
 
-  const char *gcodep_set_parameter(const char *line);
+  const char *gcodep_set_parameter(const char *line,
+                                   CompiledAssignment *record = NULL);
 
   void gcodep_conditional(const char *line);
 
@@ -224,6 +328,18 @@ private:
   void gcodep_while_do(const char *line);
   void gcodep_while_start(const char *line);
 
+  const char *gcodep_parse_pair(int line_num, const char *line,
+                                char *letter, float *value,
+                                FILE *err_stream, CompiledPair *record);
+
+  // Evaluating recorded operations doesn't report errors, but returns false
+  // so that the caller can parse the text, which then reports them.
+  bool evaluate_expression(const Expression &expr, float *value);
+  bool resolve_param(const ParamRef &param, ParamHandle *handle);
+  bool execute_assignment(const CompiledAssignment &assignment);
+  const char *replay_pair(const CompiledPair &pair, int line_num,
+                          char *letter, float *value, FILE *err_stream);
+
   const char *gparse_pair(const char *line, char *letter, float *value) {
     return gcodep_parse_pair_with_linenumber(line_number_, line,
                                              letter, value, err_msg_);
@@ -254,40 +370,32 @@ private:
   const char *set_param(char param_letter, EventValueSetter setter,
                         float factor, const char *line);
 
-  const char *gcodep_parameter(const char *line, float *value);
+  const char *gcodep_parameter(const char *line, float *value,
+                               Expression *record);
 
   // Read name of parameter (after #) which is either a number or a
-  // non-alphanumeric character.
-  const char *read_param_name(const char *line, std::string *result);
+  // non-alphanumeric character. The expression of the number is recorded
+  // to "index_record".
+  const char *read_param_name(const char *line,
+                              ParameterStore::Handle *result,
+                              Expression *index_record);
 
-  // Read parameter. Do range check.
-  bool read_parameter(StringPiece param_name, float *result) const {
-    if (config_.parameters == NULL)
-      return false;
-    param_name = TrimWhitespace(param_name);
-    Config::ParamMap::const_iterator found
-      = config_.parameters->find(ToLower(param_name));
-    if (found != config_.parameters->end()) {
-      *result = found->second;
-      return true;
-    } else {
-      *result = 0;
-      return false;
-    }
+  // Read parameter. Without parameters in the config, all are zero.
+  float read_parameter(ParameterStore::Handle param) const {
+    return config_.parameters ? parameters_->Get(param) : 0.0f;
   }
 
-  // Read parameter. Do range check.
-  bool store_parameter(StringPiece param_name, float value) {
+  // Store parameter. Do range check.
+  bool store_parameter(ParameterStore::Handle param, float value) {
     if (config_.parameters == NULL)
       return false;
-    param_name = TrimWhitespace(param_name);
     // zero parameter can never be written.
-    if (param_name == "0" || atoi(param_name.ToString().c_str()) >= 5400) {
+    if (!parameters_->IsWritable(param)) {
       gprintf(GLOG_SEMANTIC_ERR, "writing unsupported parameter number (%s)\n",
-              param_name.ToString().c_str());
+              parameters_->GetName(param).c_str());
       return false;
     }
-    (*config_.parameters)[ToLower(param_name)] = value;
+    parameters_->Set(param, value);
     return true;
   }
 
@@ -306,6 +414,10 @@ private:
 
   GCodeParser::EventReceiver *const callbacks_;
   GCodeParser::Config config_;
+  // If the config has no parameters, we still need to resolve names to
+  // handles, but never read or write values.
+  ParameterStore own_parameters_;
+  ParameterStore *const parameters_;
 
   SimpleLexer<Operation> op_parse_;
 
@@ -368,6 +480,10 @@ private:
   bool do_while_;
   std::string while_condition_;
   std::string while_loop_;
+  CompiledBlock *replay_;         // Block of the loop body being executed.
+  std::vector<float> eval_stack_;
+  ExpressionCache expression_cache_;
+  std::string expression_key_;    // Reused to look up expression_cache_.
 
   unsigned int debug_level_;  // OR-ed bits from DebugLevel enum
   bool allow_m111_;
@@ -382,6 +498,7 @@ const AxesRegister GCodeParser::Impl::kZeroOffset;
 GCodeParser::Impl::Impl(const GCodeParser::Config &parse_config,
                         GCodeParser::EventReceiver *parse_events)
   : callbacks_(parse_events), config_(parse_config),
+    parameters_(config_.parameters ? config_.parameters : &own_parameters_),
     program_in_progress_(false),
     err_msg_(NULL), modal_g0_g1_(0),
     line_number_(0),
@@ -401,7 +518,7 @@ GCodeParser::Impl::Impl(const GCodeParser::Config &parse_config,
     current_origin_(&machine_origin_),
     current_global_offset_(&kZeroOffset),
     arc_normal_(AXIS_Z),
-    while_err_stream_(NULL), do_while_(false),
+    while_err_stream_(NULL), do_while_(false), replay_(NULL),
     debug_level_(DEBUG_NONE),
     error_count_(0)
 {
@@ -488,34 +605,193 @@ static const char *skip_white(const char *line) {
   return line;
 }
 
+// Powers of ten that are exact in a float (5^10 < 2^24).
+static const float kExactPowersOfTen[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+namespace {
+// Unsigned integer wide enough to exactly convert numbers of up to
+// kMaxNumberLen digits in ParseGcodeNumber(). Least significant word first.
+class WideUnsigned {
+public:
+  explicit WideUnsigned(uint32_t value) : words_() { words_[0] = value; }
+
+  // this = this * factor + addend
+  void MultiplyAdd(uint32_t factor, uint32_t addend) {
+    uint64_t carry = addend;
+    for (uint32_t &w : words_) {
+      carry += (uint64_t) w * factor;
+      w = (uint32_t) carry;
+      carry >>= 32;
+    }
+  }
+
+  void ShiftLeft(int bits) {
+    for (/**/; bits >= 32; bits -= 32) {
+      for (int i = kWords - 1; i > 0; --i) words_[i] = words_[i - 1];
+      words_[0] = 0;
+    }
+    if (bits == 0) return;
+    for (int i = kWords - 1; i > 0; --i)
+      words_[i] = (words_[i] << bits) | (words_[i - 1] >> (32 - bits));
+    words_[0] <<= bits;
+  }
+
+  void ShiftRightOne() {
+    for (int i = 0; i < kWords - 1; ++i)
+      words_[i] = (words_[i] >> 1) | (words_[i + 1] << 31);
+    words_[kWords - 1] >>= 1;
+  }
+
+  int BitLength() const {
+    for (int i = kWords - 1; i >= 0; --i) {
+      for (int bit = 31; bit >= 0; --bit) {
+        if (words_[i] & (1u << bit)) return 32 * i + bit + 1;
+      }
+    }
+    return 0;
+  }
+
+  bool IsZero() const { return BitLength() == 0; }
+
+  bool AtLeast(const WideUnsigned &other) const {
+    for (int i = kWords - 1; i >= 0; --i) {
+      if (words_[i] != other.words_[i]) return words_[i] > other.words_[i];
+    }
+    return true;
+  }
+
+  // this = this - other; needs AtLeast(other).
+  void Subtract(const WideUnsigned &other) {
+    uint32_t borrow = 0;
+    for (int i = 0; i < kWords; ++i) {
+      const uint64_t sub = (uint64_t) other.words_[i] + borrow;
+      borrow = words_[i] < sub;
+      words_[i] = (uint32_t) (words_[i] - sub);
+    }
+  }
+
+private:
+  static const int kWords = 5;   // Up to 10^39 * 2^25: 155 bits.
+  uint32_t words_[kWords];
+};
+}  // namespace
+
+// Returns "digits" / 10^"fraction_digits", correctly rounded to the nearest
+// float like strtof() does.
+static float DecimalToFloat(WideUnsigned digits, int fraction_digits) {
+  if (digits.IsZero())
+    return 0.0f;
+  WideUnsigned divisor(1);
+  for (int i = 0; i < fraction_digits; ++i) {
+    divisor.MultiplyAdd(10, 0);
+  }
+
+  // Scale, so that the quotient has 25 or 26 bits: the 24 bits of a float
+  // mantissa and at least one bit to round.
+  const int shift = 25 - (digits.BitLength() - divisor.BitLength());
+  if (shift > 0)
+    digits.ShiftLeft(shift);
+  else
+    divisor.ShiftLeft(-shift);
+
+  uint32_t quotient = 0;
+  divisor.ShiftLeft(25);
+  for (int bit = 25; bit >= 0; --bit) {
+    if (digits.AtLeast(divisor)) {
+      digits.Subtract(divisor);
+      quotient |= 1u << bit;
+    }
+    divisor.ShiftRightOne();
+  }
+  const bool inexact = !digits.IsZero();   // Remainder beyond the quotient.
+
+  int quotient_bits = 25;
+  if (quotient >= (1u << 25)) quotient_bits = 26;
+
+  // Round to nearest, ties to even. Numbers below FLT_MIN have fewer bits.
+  int mantissa_bits = 24;
+  const int exponent = quotient_bits - 1 - shift;
+  if (exponent < FLT_MIN_EXP - 1)
+    mantissa_bits -= (FLT_MIN_EXP - 1) - exponent;
+  const int drop = quotient_bits - mantissa_bits;  // Always >= 1 here.
+  uint32_t result = quotient >> drop;
+  const uint32_t rest = quotient & ((1u << drop) - 1);
+  const uint32_t half = 1u << (drop - 1);
+  if (rest > half || (rest == half && (inexact || (result & 1))))
+    ++result;
+  return ldexpf(result, drop - shift);  // Exact, or overflows to infinity.
+}
+
 // Parse number from "line" and store in "value". Returns the position in the
 // string after the value had been parsed; if there was an error parsing,
 // returns the beginning of the line.
+//
+// Numbers are an optional sign, digits and at most one decimal point, with at
+// least one digit; no exponent, as 'E' is a G-code letter. We convert while
+// scanning. If the digits as integer and the power of ten to divide by are
+// both exact in a float, the single division is correctly rounded, just as
+// strtof(): typical G-code numbers don't have more than seven or eight
+// digits. Longer ones are converted exactly with DecimalToFloat(). Both don't
+// depend on the locale, unlike strtof().
 static const char *ParseGcodeNumber(const char *line, float *value) {
   line = skip_white(line);
-  // We need to copy the number into a temporary buffer as strtof() does
-  // not accept an end-limiter.
-  char buffer[40];
+  const int kMaxNumberLen = 39;  // Longer numbers are cut off.
+  const uint32_t kMaxExactInteger = 1 << 24;
+  const int kMaxExactFractionDigits = 10;
+
   const char *src = line;
-  char *dst = buffer;
-  const char *end = buffer + sizeof(buffer) - 1;
-  const char *extra_allowed = "+-.";
+  const bool negative = (*src == '-');
+  if (*src == '+' || *src == '-') ++src;
+  const char *const number_start = src;
+  uint32_t digits = 0;
+  int fraction_digits = 0;
+  bool have_digit = false;
   bool have_point = false;
-  while (*src && (isdigit(*src) || index(extra_allowed, *src)) && dst < end) {
-    // the sign is only allowed in the first character of the buffer
-    if ((*src == '+' || *src == '-') && dst != buffer) break;
-    // only allow one decimal point
-    if (*src == '.') {
-      if (have_point) break;
-      else have_point = true;
+  bool exact = true;
+  for (/**/; src - line < kMaxNumberLen; ++src) {
+    const char c = *src;
+    if (c >= '0' && c <= '9') {
+      have_digit = true;
+      if (digits <= (kMaxExactInteger - 9) / 10) {
+        digits = 10 * digits + (c - '0');
+        if (have_point) ++fraction_digits;
+      } else {
+        exact = false;
+      }
+    } else if (c == '.' && !have_point) {
+      have_point = true;
+    } else {
+      break;
     }
-    *dst++ = *src++;
   }
-  *dst = '\0';
-  char *parsed_end;
-  *value = strtof(buffer, &parsed_end);
+  if (!have_digit)
+    return line;
 
-  return (parsed_end == dst) ? src : line;
+  float result;
+#if FLT_EVAL_METHOD == 0
+  if (exact && fraction_digits <= kMaxExactFractionDigits) {
+    result = digits / kExactPowersOfTen[fraction_digits];
+  } else
+#endif
+  {
+    // Once more, with all the digits.
+    WideUnsigned all_digits(0);
+    fraction_digits = 0;
+    have_point = false;
+    for (const char *c = number_start; c < src; ++c) {
+      if (*c == '.') {
+        have_point = true;
+      } else {
+        all_digits.MultiplyAdd(10, *c - '0');
+        if (have_point) ++fraction_digits;
+      }
+    }
+    result = DecimalToFloat(all_digits, fraction_digits);
+  }
+  *value = negative ? -result : result;
+  return src;
 }
 
 // Parameter/variable names can be simple integers (traditional NIST), or
@@ -523,7 +799,8 @@ static const char *ParseGcodeNumber(const char *line, float *value) {
 // Returns the remainder of the line or NULL if parameter name could not
 // be parsed.
 const char* GCodeParser::Impl::read_param_name(const char *line,
-                                               std::string *result) {
+                                               ParamHandle *result,
+                                               Expression *index_record) {
   line = skip_white(line);
   if (*line == '\0') {
     gprintf(GLOG_SYNTAX_ERR, "expected value after '#'\n");
@@ -535,6 +812,7 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
     ++line;
 
   const bool numeric_parameter = *line == '#' || isdigit(*line);
+  std::string name;  // Alphanumeric name.
   if (numeric_parameter && bracketed) {
     gprintf(GLOG_SYNTAX_ERR, "The #<> bracket syntax is only allowed for "
             "the alphanumeric parameters (at %s)", line);
@@ -544,16 +822,15 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
   // if (!numeric_parameter && strict_nist) warn("using extension");
   if (numeric_parameter) {
     float index;
-    const char *endptr = gcodep_value(line, &index);
+    const char *endptr = gcodep_value(line, &index, index_record);
     if (endptr == NULL) {
       gprintf(GLOG_SYNTAX_ERR,
               "'#' is not followed by a number but '%s'\n", line);
       return NULL;
     }
     line = endptr;
-    *result = StringPrintf("%d", (int) index);
+    *result = parameters_->GetNumericHandle((int) index);
   } else {
-    result->clear();
     // Allowing alpha-numeric parameters.
     while (*line
            && ((*line >= '0' && *line <= '9')
@@ -562,52 +839,62 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
                || *line == '_'
                || (bracketed && isspace(*line)))) {
       if (!isspace(*line)) {
-        result->append(1, *line);
+        name.append(1, *line);
       }
       ++line;
     }
+    if (!name.empty())
+      *result = parameters_->GetHandle(name);
   }
 
   if (bracketed) {
     if (*line != '>') {
       gprintf(GLOG_SYNTAX_ERR, "Missed closing bracket for parameter <%s>\n",
-              result->c_str());
+              name.c_str());
       return NULL;
     }
     ++line;
   }
 
-  return result->empty() ? NULL : skip_white(line);
+  return (!numeric_parameter && name.empty()) ? NULL : skip_white(line);
 }
 
-const char *GCodeParser::Impl::gcodep_parameter(const char *line, float *value) {
-  std::string param_name;
-  line = read_param_name(line, &param_name);
+const char *GCodeParser::Impl::gcodep_parameter(const char *line, float *value,
+                                                Expression *record) {
+  ParamHandle param;
+  Expression index;
+  line = read_param_name(line, &param, record ? &index : NULL);
   if (line == NULL) return NULL;
 
-  read_parameter(param_name, value);
+  *value = read_parameter(param);
+
+  if (record != NULL) {
+    if (index.empty() || is_constant(index)) {
+      record_op(record, ExprOp::PUSH_PARAM);
+      record->back().param = param;
+    } else {
+      record->insert(record->end(), index.begin(), index.end());
+      record_op(record, ExprOp::PUSH_INDIRECT_PARAM);
+    }
+  }
 
   return line;  // We parsed something; return whatever is remaining.
 }
 
-bool GCodeParser::Impl::execute_unary(float *value, Operation op) {
+const char *GCodeParser::Impl::calculate_unary(Operation op, float *value) {
   float val;
   switch (op) {
   case ABS:
     val = fabsf(*value);
     break;
   case ACOS:
-    if (*value < -1.0f || *value > 1.0f) {
-      gprintf(GLOG_SYNTAX_ERR, "ACOS argument out of range\n");
-      return false;
-    }
+    if (*value < -1.0f || *value > 1.0f)
+      return "ACOS argument out of range";
     val = (acosf(*value) * 180.0f) / M_PI;
     break;
   case ASIN:
-    if (*value < -1.0f || *value > 1.0f) {
-      gprintf(GLOG_SYNTAX_ERR, "ASIN argument out of range\n");
-      return false;
-    }
+    if (*value < -1.0f || *value > 1.0f)
+      return "ASIN argument out of range";
     val = (asinf(*value) * 180.0f) / M_PI;
     break;
   case COS:
@@ -623,10 +910,8 @@ bool GCodeParser::Impl::execute_unary(float *value, Operation op) {
     val = ceilf(*value);
     break;
   case LN:
-    if (*value <= 0.0f) {
-      gprintf(GLOG_SYNTAX_ERR, "Zero or negative argument to LN\n");
-      return false;
-    }
+    if (*value <= 0.0f)
+      return "Zero or negative argument to LN";
     val = logf(*value);
     break;
   case ROUND:
@@ -636,17 +921,25 @@ bool GCodeParser::Impl::execute_unary(float *value, Operation op) {
     val = sinf((*value * M_PI) / 180.0f);
     break;
   case SQRT:
-    if (*value < 0.0f) {
-      gprintf(GLOG_SYNTAX_ERR, "Negative argument to SQRT\n");
-      return false;
-    }
+    if (*value < 0.0f)
+      return "Negative argument to SQRT";
     val = sqrtf(*value);
     break;
   case TAN:
     val = tanf((*value * M_PI) / 180.0f);
     break;
   default:
-    gprintf(GLOG_SYNTAX_ERR, "Attempt to execute unknown unary operation\n");
+    return "Attempt to execute unknown unary operation";
+  }
+  *value = val;
+  return NULL;
+}
+
+bool GCodeParser::Impl::execute_unary(float *value, Operation op) {
+  float val = *value;
+  const char *error = calculate_unary(op, &val);
+  if (error != NULL) {
+    gprintf(GLOG_SYNTAX_ERR, "%s\n", error);
     return false;
   }
   gprintf(GLOG_EXPRESSION, "%s[%f] -> %f\n", op_parse_.AsString(op),
@@ -655,7 +948,8 @@ bool GCodeParser::Impl::execute_unary(float *value, Operation op) {
   return true;
 }
 
-const char *GCodeParser::Impl::gcodep_atan(const char *line, float *value) {
+const char *GCodeParser::Impl::gcodep_atan(const char *line, float *value,
+                                           Expression *record) {
   if (*line != '/') {
     gprintf(GLOG_SYNTAX_ERR, "expected '/' after ATAN got '%s'\n", line);
     return NULL;
@@ -670,7 +964,7 @@ const char *GCodeParser::Impl::gcodep_atan(const char *line, float *value) {
 
   float value2;
   const char *endptr;
-  endptr = gcodep_expression(line, &value2);
+  endptr = gcodep_expression(line, &value2, record);
   if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
     return NULL;
@@ -681,6 +975,7 @@ const char *GCodeParser::Impl::gcodep_atan(const char *line, float *value) {
   gprintf(GLOG_EXPRESSION, "%s[%f]/[%f] -> %f\n",
           op_parse_.AsString(ATAN), *value, value2, val);
   *value = val;
+  record_op(record, ExprOp::ATAN2);
   return line;
 }
 
@@ -695,7 +990,8 @@ const char *GCodeParser::Impl::gcodep_operation_unary(const char *line,
   }
 }
 
-const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value) {
+const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value,
+                                            Expression *record) {
   Operation op;
   const char *endptr;
 
@@ -711,7 +1007,7 @@ const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value) {
   }
   line = skip_white(line + 1);
 
-  endptr = gcodep_expression(line, value);
+  endptr = gcodep_expression(line, value, record);
   if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
     return NULL;
@@ -719,7 +1015,7 @@ const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value) {
   line = skip_white(endptr);
 
   if (op == ATAN) {
-    endptr = gcodep_atan(line, value);
+    endptr = gcodep_atan(line, value, record);
     if (endptr == NULL) {
       gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
       return NULL;
@@ -730,73 +1026,81 @@ const char *GCodeParser::Impl::gcodep_unary(const char *line, float *value) {
       gprintf(GLOG_SYNTAX_ERR, "unary operation failed\n");
       return NULL;
     }
+    record_op(record, ExprOp::UNARY, op);
   }
 
   return line;
 }
 
-bool GCodeParser::Impl::execute_binary(float *left, Operation op, float *right) {
+const char *GCodeParser::Impl::calculate_binary(float *left, Operation op,
+                                                 float right) {
   float val = *left;
   switch (op) {
   case POWER:
-    if (*left < 0.0f && floor(*right) != *right) {
-      gprintf(GLOG_SYNTAX_ERR, "Attempt to raise negative to non-integer power\n");
-      return false;
-    }
-    val = powf(*left, *right);
+    if (*left < 0.0f && floor(right) != right)
+      return "Attempt to raise negative to non-integer power";
+    val = powf(*left, right);
     break;
   case DIVIDED_BY:
-    if (*right == 0.0f) {
-      gprintf(GLOG_SYNTAX_ERR, "Attempt to divide by zero\n");
-      return false;
-    }
-    val = *left / *right;
+    if (right == 0.0f)
+      return "Attempt to divide by zero";
+    val = *left / right;
     break;
   case MODULO:
-    val = fmodf(*left, *right);
+    val = fmodf(*left, right);
     // always calculates a positive answer
     if (val < 0.0f)
-      val += fabsf(*right);
+      val += fabsf(right);
     break;
   case TIMES:
-    val = *left * *right;
+    val = *left * right;
     break;
   case AND2:
-    val = (*left == 0.0f || *right == 0.0f) ? 0.0f : 1.0f;
+    val = (*left == 0.0f || right == 0.0f) ? 0.0f : 1.0f;
     break;
   case EXCLUSIVE_OR:
-    val = (((*left == 0.0f) && (*right != 0.0f)) ||
-           ((*left != 0.0f) && (*right == 0.0f))) ? 1.0f : 0.0f;
+    val = (((*left == 0.0f) && (right != 0.0f)) ||
+           ((*left != 0.0f) && (right == 0.0f))) ? 1.0f : 0.0f;
     break;
   case MINUS:
-    val = *left - *right;
+    val = *left - right;
     break;
   case NON_EXCLUSIVE_OR:
-    val = ((*left != 0.0f) || (*right != 0.0f)) ? 1.0f : 0.0f;
+    val = ((*left != 0.0f) || (right != 0.0f)) ? 1.0f : 0.0f;
     break;
   case PLUS:
-    val = *left + *right;
+    val = *left + right;
     break;
   case EQ:
-    val = (*left == *right) ? 1.0f : 0.0f;
+    val = (*left == right) ? 1.0f : 0.0f;
     break;
   case NE:
-    val = (*left != *right) ? 1.0f : 0.0f;
+    val = (*left != right) ? 1.0f : 0.0f;
     break;
   case GT:
-    val = (*left > *right) ? 1.0f : 0.0f;
+    val = (*left > right) ? 1.0f : 0.0f;
     break;
   case GE:
-    val = (*left >= *right) ? 1.0f : 0.0f;
+    val = (*left >= right) ? 1.0f : 0.0f;
     break;
   case LT:
-    val = (*left < *right) ? 1.0f : 0.0f;
+    val = (*left < right) ? 1.0f : 0.0f;
     break;
   case LE:
-    val = (*left <= *right) ? 1.0f : 0.0f;
+    val = (*left <= right) ? 1.0f : 0.0f;
     break;
   default:
-    gprintf(GLOG_SYNTAX_ERR, "Attempt to execute unknown binary operation\n");
+    return "Attempt to execute unknown binary operation";
+  }
+  *left = val;
+  return NULL;
+}
+
+bool GCodeParser::Impl::execute_binary(float *left, Operation op, float *right) {
+  float val = *left;
+  const char *error = calculate_binary(&val, op, *right);
+  if (error != NULL) {
+    gprintf(GLOG_SYNTAX_ERR, "%s\n", error);
     return false;
   }
   gprintf(GLOG_EXPRESSION, "[%f %s %f] -> %f\n",
@@ -819,7 +1123,8 @@ const char *GCodeParser::Impl::gcodep_operation(const char *line,
 // the expression stack needs to be at least one greater than the max precedence
 #define MAX_STACK   6
 
-const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value) {
+const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value,
+                                                 Expression *record) {
   float vals[MAX_STACK];
   Operation ops[MAX_STACK];
   int stack = 0;
@@ -827,7 +1132,7 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
   line = skip_white(line);
 
   for (ops[0] = NO_OPERATION; ops[0] != RIGHT_BRACKET; ) {
-    endptr = gcodep_value(line, &vals[stack]);
+    endptr = gcodep_value(line, &vals[stack], record);
     if (endptr == NULL) {
       if (*line == '-') {
         line = skip_white(line+1);
@@ -837,6 +1142,7 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
         }
         // make [-expression] work like [-1 * expression]
         vals[stack] = -1.0f;
+        record_op(record, ExprOp::PUSH_VALUE, NO_OPERATION, -1.0f);
         ops[stack] = TIMES;
         stack++;
         continue;
@@ -871,6 +1177,7 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
       for ( ; precedence(ops[stack]) <= precedence(ops[stack - 1]); ) {
         if (!execute_binary(&vals[stack - 1], ops[stack - 1], &vals[stack]))
           return NULL;
+        record_op(record, ExprOp::BINARY, ops[stack - 1]);
 
         ops[stack - 1] = ops[stack];
         if (stack > 1 && precedence(ops[stack - 1]) <= precedence(ops[stack - 2]))
@@ -885,10 +1192,55 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
   return line;
 }
 
+// Programs tend to use the same expressions over and over again, so we don't
+// want to parse them each time. Keep the recorded form of a limited number
+// of different expressions.
+static const size_t kMaxCachedExpressions = 1024;
+
+// Same as gcodep_expression(), but evaluates the recorded expression from
+// the cache if the expression was seen before.
+const char *GCodeParser::Impl::gcodep_cached_expression(const char *line,
+                                                        float *value) {
+  const char *end = line;
+  int depth = 1;
+  for (/**/; *end && depth > 0; ++end) {
+    if (*end == '[') ++depth;
+    else if (*end == ']') --depth;
+  }
+  if (depth > 0)
+    return gcodep_expression(line, value);  // Not terminated; report error.
+
+  expression_key_.assign(line, end - line);
+  ExpressionCache::iterator found = expression_cache_.find(expression_key_);
+  if (found == expression_cache_.end()) {
+    if (expression_cache_.size() >= kMaxCachedExpressions)
+      expression_cache_.clear();
+    CachedExpression &cached = expression_cache_[expression_key_];
+    cached.compiled = false;
+    return gcodep_expression(line, value);
+  }
+
+  CachedExpression &cached = found->second;
+  if (cached.compiled) {
+    if (!(debug_level_ & DEBUG_EXPRESSION)
+        && evaluate_expression(cached.expr, value))
+      return skip_white(end);
+    return gcodep_expression(line, value);  // Log or report error.
+  }
+
+  // Seen the second time, so record it while parsing. Only if it ends at
+  // the bracket, the recorded operations are the whole expression.
+  cached.expr.clear();
+  const char *endptr = gcodep_expression(line, value, &cached.expr);
+  cached.compiled = (endptr != NULL && endptr == skip_white(end));
+  return endptr;
+}
+
 // Parse a value out of the line.
 // The value may be a number, a parameter value, a unary function, or an
 // expression.
-const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
+const char *GCodeParser::Impl::gcodep_value(const char *line, float *value,
+                                            Expression *record) {
   char c = toupper(*line);
   if (isalpha(c)) c = 'U';  // indicates a unary in the switch below
 
@@ -898,16 +1250,21 @@ const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
     endptr = NULL;
     break;
   case '[':
-    endptr = gcodep_expression(line + 1, value);
+    // While recording, the operations of nested expressions are needed.
+    endptr = (record != NULL)
+      ? gcodep_expression(line + 1, value, record)
+      : gcodep_cached_expression(line + 1, value);
     break;
   case '#':
-    endptr = gcodep_parameter(line + 1, value);
+    endptr = gcodep_parameter(line + 1, value, record);
     break;
   case 'U':
-    endptr = gcodep_unary(line, value);
+    endptr = gcodep_unary(line, value, record);
     break;
   default:
     endptr = ParseGcodeNumber(line, value);
+    if (endptr != line)
+      record_op(record, ExprOp::PUSH_VALUE, NO_OPERATION, *value);
     break;
   }
   if (line == endptr || endptr == NULL)
@@ -917,28 +1274,42 @@ const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
   return line;
 }
 
-const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
-  std::string param_name;
-  line = read_param_name(line, &param_name);
+// If "record" is not NULL, the assignment is recorded. This is only
+// complete if it returns non-NULL.
+const char *GCodeParser::Impl::gcodep_set_parameter(
+  const char *line, CompiledAssignment *record) {
+  ParamHandle param;
+  line = read_param_name(line, &param, record ? &record->param.index : NULL);
   if (line == NULL) return NULL;
+  if (record != NULL) {
+    record->param.handle = param;
+    if (is_constant(record->param.index))
+      record->param.index.clear();
+    record->kind = CompiledAssignment::ASSIGN;
+    record->op = NO_OPERATION;
+    record->ternary = false;
+  }
+  const std::string param_name = parameters_->GetName(param);
   const char *log_name = param_name.c_str();
 
   float value;
   if (*line     == '+' &&
       *(line+1) == '+') {
     line = skip_white(line+2);
-    read_parameter(param_name, &value);
+    value = read_parameter(param);
     value++;
-    store_parameter(param_name, value);
+    store_parameter(param, value);
+    if (record) record->kind = CompiledAssignment::INCREMENT;
     gprintf(GLOG_EXPRESSION, "#%s++ -> #%s=%f\n", log_name, log_name, value);
     return line;
   }
   if (*line     == '-' &&
       *(line+1) == '-') {
     line = skip_white(line+2);
-    read_parameter(param_name, &value);
+    value = read_parameter(param);
     value--;
-    store_parameter(param_name, value);
+    store_parameter(param, value);
+    if (record) record->kind = CompiledAssignment::DECREMENT;
     gprintf(GLOG_EXPRESSION, "#%s-- -> #%s=%f\n", log_name, log_name, value);
     return line;
   }
@@ -964,8 +1335,7 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
     line = skip_white(line+1);
   } else {
     if (*line == '\0') {
-      value = 0.0;
-      read_parameter(param_name, &value);
+      value = read_parameter(param);
       gprintf(GLOG_INFO, "#%s = %f\n", log_name, value);
     } else {
       gprintf(GLOG_SYNTAX_ERR,
@@ -977,7 +1347,7 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
 
   // Assignment
   const char *endptr;
-  endptr = gcodep_value(line, &value);
+  endptr = gcodep_value(line, &value, record ? &record->value : NULL);
   if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR,
             "gcodep_set_parameter: expected value after '#%s=' got '%s'\n",
@@ -988,7 +1358,7 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
 
   if (op != NO_OPERATION) {
     float left;
-    read_parameter(param_name, &left);
+    left = read_parameter(param);
     if (!execute_binary(&left, op, &value))
       return NULL;
     value = left;
@@ -998,11 +1368,11 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
       bool condition = (value != 0.0f);
       line = skip_white(line+1);
 
-      endptr = gcodep_value(line, &value);
+      endptr = gcodep_value(line, &value, record ? &record->if_true : NULL);
       if (endptr == NULL) {
         gprintf(GLOG_SYNTAX_ERR,
                 "gcodep_set_parameter: expected value after '#%s=[%d] ? ' got '%s'\n",
-                log_name, line, condition);
+                log_name, condition, line);
         return NULL;
       }
       line = skip_white(endptr);
@@ -1010,27 +1380,30 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
 
       if (*line == ':') {
         line = skip_white(line+1);
-        endptr = gcodep_value(line, &value);
+        endptr = gcodep_value(line, &value,
+                              record ? &record->if_false : NULL);
         if (endptr == NULL) {
           gprintf(GLOG_SYNTAX_ERR,
                   "gcodep_set_parameter: expected value after '#%s=[%d] ? %f :' got '%s'\n",
-                  log_name, line, condition, true_value);
+                  log_name, condition, true_value, line);
           return NULL;
         }
         line = skip_white(endptr);
 
         if (condition)
           value = true_value;
+        if (record) record->ternary = true;
       } else {
         gprintf(GLOG_SYNTAX_ERR,
                 "gcodep_set_parameter: expected ':' after '#%s=[%d] ? %f' got '%s'\n",
-                log_name, line, condition, true_value);
+                log_name, condition, true_value, line);
         return NULL;
       }
     }
   }
 
-  store_parameter(param_name, value);
+  if (record) record->op = op;
+  store_parameter(param, value);
   callbacks()->gcode_command_done('#', value);
 
   gprintf(GLOG_EXPRESSION, "#%s=%f\n", log_name, value);
@@ -1046,7 +1419,7 @@ void GCodeParser::Impl::gcodep_conditional(const char *line) {
 
   float value = 0.0f;
   const char *endptr;
-  endptr = gcodep_expression(line + 1, &value);
+  endptr = gcodep_cached_expression(line + 1, &value);
   if (line == endptr || endptr == NULL)
     return;
 
@@ -1105,14 +1478,154 @@ void GCodeParser::Impl::gcodep_conditional(const char *line) {
   }
 }
 
+bool GCodeParser::Impl::evaluate_expression(const Expression &expr,
+                                            float *value) {
+  std::vector<float> &stack = eval_stack_;
+  stack.clear();
+  for (const ExprOp &op : expr) {
+    switch (op.type) {
+    case ExprOp::PUSH_VALUE:
+      stack.push_back(op.value);
+      break;
+    case ExprOp::PUSH_PARAM:
+      stack.push_back(read_parameter(op.param));
+      break;
+    case ExprOp::PUSH_INDIRECT_PARAM:
+      stack.back() = read_parameter(
+        parameters_->GetNumericHandle((int) stack.back()));
+      break;
+    case ExprOp::UNARY:
+      if (calculate_unary(op.op, &stack.back()) != NULL)
+        return false;
+      break;
+    case ExprOp::ATAN2: {
+      const float value2 = stack.back();
+      stack.pop_back();
+      stack.back() = (atan2f(stack.back(), value2) * 180.0f) / M_PI;
+      break;
+    }
+    case ExprOp::BINARY: {
+      const float right = stack.back();
+      stack.pop_back();
+      if (calculate_binary(&stack.back(), op.op, right) != NULL)
+        return false;
+      break;
+    }
+    }
+  }
+  *value = stack.back();
+  return true;
+}
+
+// Get the handle of the parameter, evaluating the index if needed. Returns
+// false if that failed.
+bool GCodeParser::Impl::resolve_param(const ParamRef &param,
+                                      ParamHandle *handle) {
+  if (param.index.empty()) {
+    *handle = param.handle;
+    return true;
+  }
+  float index;
+  if (!evaluate_expression(param.index, &index))
+    return false;
+  *handle = parameters_->GetNumericHandle((int) index);
+  return true;
+}
+
+// Same as gcodep_set_parameter() does after parsing. Nothing is changed if
+// this returns false.
+bool GCodeParser::Impl::execute_assignment(
+  const CompiledAssignment &assignment) {
+  ParamHandle param;
+  if (!resolve_param(assignment.param, &param))
+    return false;
+
+  float value;
+  if (assignment.kind != CompiledAssignment::ASSIGN) {
+    const bool increment = (assignment.kind == CompiledAssignment::INCREMENT);
+    value = read_parameter(param) + (increment ? 1 : -1);
+    store_parameter(param, value);
+    return true;
+  }
+
+  if (!evaluate_expression(assignment.value, &value))
+    return false;
+
+  if (assignment.op != NO_OPERATION) {
+    float left = read_parameter(param);
+    if (calculate_binary(&left, assignment.op, value) != NULL)
+      return false;
+    value = left;
+  } else if (assignment.ternary) {
+    const bool condition = (value != 0.0f);
+    float false_value;
+    if (!evaluate_expression(assignment.if_true, &value)
+        || !evaluate_expression(assignment.if_false, &false_value))
+      return false;
+    if (!condition)
+      value = false_value;
+  }
+
+  store_parameter(param, value);
+  callbacks()->gcode_command_done('#', value);
+  return true;
+}
+
+// Returns the same as gcodep_parse_pair() would for the text the pair was
+// recorded from. If evaluating fails, the text is parsed from there on.
+const char *GCodeParser::Impl::replay_pair(const CompiledPair &pair,
+                                           int line_num,
+                                           char *letter, float *value,
+                                           FILE *err_stream) {
+  const char *const text = replay_->text.c_str();
+  const char *resume = NULL;
+  for (const CompiledAssignment &assignment : pair.assignments) {
+    if (!execute_assignment(assignment)) {
+      resume = text + assignment.from;
+      break;
+    }
+  }
+  if (resume == NULL) {
+    if (pair.letter == 0)
+      return NULL;
+    if (evaluate_expression(pair.value, value)) {
+      *letter = pair.letter;
+      return text + pair.rest;
+    }
+    resume = text + pair.letter_from;
+  }
+
+  CompiledBlock *const block = replay_;
+  replay_ = NULL;
+  resume = gcodep_parse_pair(line_num, resume, letter, value, err_stream,
+                             NULL);
+  replay_ = block;
+  return resume;
+}
+
+// The condition and the pairs of the loop body are recorded in the first
+// iteration; the following iterations then only need to evaluate them.
 void GCodeParser::Impl::gcodep_while_end() {
-    int loops = 0;
-    while (1) {
-      const char *line = while_condition_.c_str();
-      const char *endptr;
-      float value;
-      // the '[' was already parsed
-      endptr = gcodep_expression(line, &value);
+  // the '[' was already parsed
+  const std::string condition_text = while_condition_;
+  Expression condition;
+  bool condition_compiled = false;
+
+  const std::vector<StringPiece> pieces = SplitString(while_loop_, "\n");
+  std::vector<CompiledBlock> body(pieces.size());
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    body[i].text = pieces[i].ToString();
+  }
+
+  CompiledBlock *const outer_replay = replay_;
+  int loops = 0;
+  while (1) {
+    float value;
+    if (!condition_compiled || (debug_level_ & DEBUG_EXPRESSION)
+        || !evaluate_expression(condition, &value)) {
+      const char *line = condition_text.c_str();
+      const char *endptr = gcodep_expression(
+        line, &value, condition_compiled ? NULL : &condition);
       if (endptr == NULL) {
         gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
         return;
@@ -1121,18 +1634,23 @@ void GCodeParser::Impl::gcodep_while_end() {
         break;
 
       line = skip_white(endptr);
-      if (control_parse_.ExpectNext(&line, CK_DO)) {
-        std::vector<StringPiece> piece = SplitString(while_loop_, "\n");
-        for (size_t i=0; i < piece.size(); i++)
-          ParseBlock(while_owner_, piece[i].ToString().c_str(),
-                     while_err_stream_);
-      } else {
+      if (!control_parse_.ExpectNext(&line, CK_DO)) {
         gprintf(GLOG_SYNTAX_ERR, "expected DO got '%s'\n", line);
         return;
       }
-      loops++;
+      condition_compiled = true;
+    } else if (value == 0.0f) {
+      break;
     }
-    gprintf(GLOG_INFO, "Executed %d loops\n", loops);
+
+    for (CompiledBlock &block : body) {
+      replay_ = &block;
+      ParseBlock(while_owner_, block.text.c_str(), while_err_stream_);
+    }
+    replay_ = outer_replay;
+    loops++;
+  }
+  gprintf(GLOG_INFO, "Executed %d loops\n", loops);
 }
 
 void GCodeParser::Impl::gcodep_while_do(const char *line) {
@@ -1142,7 +1660,10 @@ void GCodeParser::Impl::gcodep_while_do(const char *line) {
     return;
   }
 
+  // Blocks are separated by newline; not all callers pass it along.
   while_loop_ += line;
+  if (while_loop_.empty() || while_loop_[while_loop_.size() - 1] != '\n')
+    while_loop_ += '\n';
 }
 
 // WHILE [conditionalexpression is true] DO
@@ -1180,11 +1701,58 @@ const char *GCodeParser::Impl::gcodep_parse_pair_with_linenumber(
     return NULL;
   }
 
+  if (replay_ == NULL)
+    return gcodep_parse_pair(line_num, line, letter, value, err_stream, NULL);
+
+  // In a WHILE loop, replay what was recorded for this position of the block
+  // or record it while parsing.
+  const char *const text = replay_->text.c_str();
+  if (line < text || line > text + replay_->text.length())
+    return gcodep_parse_pair(line_num, line, letter, value, err_stream, NULL);
+  const int pos = line - text;
+  for (const CompiledPair &pair : replay_->pairs) {
+    if (pair.from != pos)
+      continue;
+    if (debug_level_ & DEBUG_EXPRESSION)  // Log the text as parsed.
+      return gcodep_parse_pair(line_num, line, letter, value, err_stream, NULL);
+    return replay_pair(pair, line_num, letter, value, err_stream);
+  }
+
+  CompiledBlock *const block = replay_;
+  CompiledPair pair;
+  pair.from = pos;
+  pair.complete = false;
+  pair.letter = 0;
+  const char *const rest = gcodep_parse_pair(line_num, line, letter, value,
+                                             err_stream, &pair);
+  if (pair.complete)
+    block->pairs.push_back(pair);
+  return rest;
+}
+
+// Parse next letter/number pair from the text. If "record" is not NULL,
+// what is done is recorded; it is only complete if the pair was parsed
+// without errors and does not contain IF or WHILE.
+const char *GCodeParser::Impl::gcodep_parse_pair(
+  int line_num, const char *line,
+  char *letter, float *value,
+  FILE *err_stream, CompiledPair *record)
+{
+  line = skip_white(line);
+
+  if (*line == '\0' || *line == ';' || *line == '%') {
+    if (record) record->complete = true;
+    return NULL;
+  }
+
   if (*line == '(') {  // Comment between words; e.g. G0(move) X1(this axis)
     while (*line && *line != ')')
       line++;
     line = skip_white(line + 1);
-    if (*line == '\0') return NULL;
+    if (*line == '\0') {
+      if (record) record->complete = true;
+      return NULL;
+    }
   }
 
   if (control_parse_.ExpectNext(&line, CK_IF)) {
@@ -1197,30 +1765,40 @@ const char *GCodeParser::Impl::gcodep_parse_pair_with_linenumber(
     return NULL;
   }
 
+  const char *const text = record ? replay_->text.c_str() : NULL;
   const char *endptr;
   if (*line == '#') {  // parameter set without a letter
+    CompiledAssignment *assignment = NULL;
+    if (record != NULL) {
+      record->assignments.push_back(CompiledAssignment());
+      assignment = &record->assignments.back();
+      assignment->from = line - text;
+    }
     line++;
-    endptr = gcodep_set_parameter(line);
+    endptr = gcodep_set_parameter(line, assignment);
     if (endptr == NULL)
       return NULL;
 
     // recursive call to parse the letter/number pair
     line = endptr;
-    return gcodep_parse_pair_with_linenumber(line_num, line, letter, value,
-                                             err_stream);
+    return gcodep_parse_pair(line_num, line, letter, value, err_stream,
+                             record);
   }
 
+  if (record) record->letter_from = line - text;
   *letter = toupper(*line++);
   if (*line == '\0') {
     gprintf(GLOG_SYNTAX_ERR, "expected value after '%c'\n", *letter);
     return NULL;
   }
   // If this line has a checksum, we ignore it. In fact, the line is done.
-  if (*letter == '*')
+  if (*letter == '*') {
+    if (record) record->complete = true;
     return NULL;
+  }
   line = skip_white(line);
 
-  endptr = gcodep_value(line, value);
+  endptr = gcodep_value(line, value, record ? &record->value : NULL);
   if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR,
             "Letter '%c' is not followed by a number but '%s'\n",
@@ -1228,6 +1806,11 @@ const char *GCodeParser::Impl::gcodep_parse_pair_with_linenumber(
     return NULL;
   }
   line = endptr;
+  if (record != NULL) {
+    record->letter = *letter;
+    record->rest = line - text;
+    record->complete = true;
+  }
 
   return line;  // We parsed something; return whatever is remaining.
 }
@@ -1266,7 +1849,7 @@ void GCodeParser::Impl::InitCoordSystems() {
     value = 0.0;
     std::string coords = "";
     for (GCodeParserAxis axis : AllAxes()) {
-      read_parameter(StringPrintf("%d", 5221 + offset + axis), &value);
+      value = read_parameter(5221 + offset + axis);
       coord_system_[i][axis] = machine_origin_[axis] + value;
       if (axis <= AXIS_Y || value)
         coords += StringPrintf(" %c:%.3f", gcodep_axis2letter(axis), value);
@@ -1278,9 +1861,10 @@ void GCodeParser::Impl::InitCoordSystems() {
     }
   }
 
-  if (!read_parameter("5220", &value) || value < 1 || value > 9) {
+  value = read_parameter(5220);
+  if (value < 1 || value > 9) {
     value = 1;     // If not set or invalid, force G54
-    store_parameter("5220", value);
+    store_parameter(5220, value);
   }
 
   const int coord_system = (int)value - 1;
@@ -1348,7 +1932,7 @@ const char *GCodeParser::Impl::handle_G10(const char *line) {
   for (GCodeParserAxis a : AllAxes()) {
     if (!have_val[a]) continue;
     // We always store the absolute offset from home.
-    store_parameter(StringPrintf("%d", 5221 + variable_offset + a),
+    store_parameter(5221 + variable_offset + a,
                     coord_system_[cs][a] - machine_origin_[a]);
   }
   if (current_origin_ == &coord_system_[cs]) {
@@ -1389,7 +1973,7 @@ void GCodeParser::Impl::change_coord_system(float sub_command) {
     gprintf(GLOG_SYNTAX_ERR, "invalid coordinate system %.1f\n", sub_command);
     return;
   }
-  store_parameter("5220", coord_system);
+  store_parameter(5220, coord_system);
   current_origin_ = &coord_system_[coord_system-1];
   inform_origin_offset_change(kCoordinateSystemNames[coord_system-1]);
 }
@@ -1968,11 +2552,64 @@ void GCodeParser::ParseBlock(const char *line, FILE *err_stream) {
   impl_->ParseBlock(this, line, err_stream);
 }
 
+// Parse a regular file from a read-only memory mapping, starting at "offset".
+// Lines are found with memchr() and, as the parser wants '\0'-terminated
+// blocks, copied into a buffer that is re-used and grows with the longest
+// line; there is no limit on line length. Writing the terminator into a
+// copy-on-write mapping instead costs a page fault and page copy per page,
+// which is slower than copying the lines. Pages that have been parsed are
+// dropped again, so even huge files don't accumulate in memory.
+// Limitation: if the file is truncated while we read it, accessing the pages
+// beyond the new end raises SIGBUS, which terminates the process instead of
+// reporting an error. Files that are written while being printed should be
+// passed as a stream (e.g. a pipe), which is read without mapping.
+// Returns false if the file can't be mapped; nothing is parsed then.
+bool GCodeParser::Impl::ParseMappedFile(GCodeParser *owner, int fd,
+                                        off_t offset, FILE *err_stream) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= offset)
+    return false;
+  if ((uint64_t) st.st_size > (uint64_t) SIZE_MAX)
+    return false;  // Doesn't fit in the address space.
+  const size_t size = st.st_size;
+  char *const map = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return false;
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  const size_t kReleaseChunk = 4 << 20;  // multiple of the page size.
+  const char *released = map;     // Everything before is dropped already.
+  const char *line = map + offset;
+  const char *const end = map + size;
+  std::string block;
+  while (line < end) {
+    const char *eol = (const char*) memchr(line, '\n', end - line);
+    if (eol == NULL) eol = end;  // Last line without newline.
+    block.assign(line, eol - line);
+    ParseBlock(owner, block.c_str(), err_stream);
+    line = eol + 1;
+    if (line - released >= (ptrdiff_t) kReleaseChunk) {
+      madvise((void*) released, kReleaseChunk, MADV_DONTNEED);
+      released += kReleaseChunk;
+    }
+  }
+  munmap(map, size);
+  return true;
+}
+
 bool GCodeParser::ReadFile(FILE *input_gcode_stream, FILE *err_stream) {
   if (input_gcode_stream == nullptr) return false;
-  char buffer[8192];   // "8kB ought to be enough for everybody"
-  while (fgets(buffer, sizeof(buffer), input_gcode_stream) != nullptr) {
-    impl_->ParseBlock(this, buffer, err_stream);
+  const off_t offset = ftello(input_gcode_stream);
+  if (offset < 0 || !impl_->ParseMappedFile(this, fileno(input_gcode_stream),
+                                            offset, err_stream)) {
+    // Not a regular file, e.g. a pipe. Read line by line; the buffer is
+    // re-used and grows with the longest line.
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    while (getline(&buffer, &buffer_size, input_gcode_stream) >= 0) {
+      impl_->ParseBlock(this, buffer, err_stream);
+    }
+    free(buffer);
   }
   if (err_stream) {
     fflush(err_stream);
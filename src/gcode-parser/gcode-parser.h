@@ -36,9 +36,9 @@
 #include <stdio.h>
 
 #include <string>
-#include <map>
 
 #include "common/container.h"
+#include "gcode-parser/parameter-store.h"
 
 // Axis supported by this parser.
 // Sequence matters, as these determine the 52xx variables
@@ -94,6 +94,8 @@ public:
 
   // Convenience function: Read gcode from file. This reads the file
   // line-by-line, parses these blocks and call the EventReceiver.
+  // Reading starts at the current position of the stream. Regular files are
+  // memory mapped and parsed in place; there is no limit on line length.
   // Closes input stream after EOF.
   // The input is expected to be a stream with no stalls, so no input_idle()
   // will be called (Reading from a socket ? Use GCodeStreamer instead.).
@@ -132,7 +134,7 @@ private:
 
 // Configuration for the parser.
 struct GCodeParser::Config {
-  typedef std::map<std::string, float> ParamMap;
+  typedef ParameterStore ParamMap;
   Config() : parameters(NULL) {}
   Config(const std::string &filename) : parameters(NULL), paramfile(filename) {}
 
@@ -150,6 +152,7 @@ struct GCodeParser::Config {
   // The NIST-RS274NGC parameters/variables.
   // This maps the name to the value of the parameter. The original RS274
   // only supports integer variables, but we allow arbitrary variable names.
+  // If NULL, the parser uses its own, which is not persisted.
   ParamMap *parameters;
 
 private:
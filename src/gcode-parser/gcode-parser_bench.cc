@@ -0,0 +1,256 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Micro-benchmark of the G-code parser: parses blocks that are already in
+// memory, with an event receiver that does nothing, so we measure the parser
+// alone.
+//
+// Output is one tab-separated line per workload, with a header line
+// starting with '#', to be easily compared between builds.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+
+#include "gcode-parser/gcode-parser.h"
+
+namespace {
+typedef std::vector<std::string> Program;
+
+class NullEventReceiver : public GCodeParser::EventReceiver {
+public:
+  void gcode_start(GCodeParser *parser) final {}
+  void go_home(AxisBitmap_t axis_bitmap) final {}
+  bool probe_axis(float feed_mm_p_sec, enum GCodeParserAxis axis,
+                  float *probed_position) final { return false; }
+  void set_speed_factor(float factor) final {}
+  void set_fanspeed(float value) final {}
+  void set_temperature(float degrees_c) final {}
+  void wait_temperature() final {}
+  void dwell(float time_ms) final {}
+  void motors_enable(bool enable) final {}
+  bool coordinated_move(float feed_mm_p_sec,
+                        const AxesRegister &absolute_pos) final {
+    return true;
+  }
+  bool rapid_move(float feed_mm_p_sec,
+                  const AxesRegister &absolute_pos) final {
+    return true;
+  }
+  const char *unprocessed(char letter, float value,
+                          const char *rest_of_line) final {
+    return NULL;
+  }
+};
+}  // namespace
+
+static bool ReadProgram(const char *filename, Program *program) {
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    perror(filename);
+    return false;
+  }
+  char buffer[8192];
+  while (fgets(buffer, sizeof(buffer), f)) {
+    program->push_back(buffer);
+  }
+  fclose(f);
+  return true;
+}
+
+// 3D surfacing as exported by CAM programs: long runs of short moves with
+// all coordinates and four decimals.
+static void CreateCamSurface(int lines, Program *program) {
+  char buffer[128];
+  program->push_back("G21 G90 G17\n");
+  program->push_back("G1 F1200\n");
+  for (int i = 0; i < lines; ++i) {
+    const float x = 0.05 * (i % 2000);
+    const float y = 0.5 * (i / 2000);
+    const float z = -1.5 + 0.75 * sinf(x / 7) * cosf(y / 5);
+    snprintf(buffer, sizeof(buffer), "G1 X%.4f Y%.4f Z%.4f\n", x, y, z);
+    program->push_back(buffer);
+  }
+}
+
+// Macro-style program: the same expressions on every line, with changing
+// parameters.
+static void CreateParametric(int lines, Program *program) {
+  program->push_back("G21 G90 G17\n");
+  program->push_back("#1=0\n");
+  for (int i = 0; i < lines / 2; ++i) {
+    program->push_back("#1=[#1 + 0.01]\n");
+    program->push_back("G1 X[#1 * 10] Y[sin[#1 * 30] * 5] Z[-#1 / 10]\n");
+  }
+}
+
+// Parametric program: a WHILE loop calculating a spiral. Returns the
+// number of blocks executed.
+static int CreateWhileLoop(int iterations, Program *program) {
+  static const char *const kBody[] = {
+    "#2=[#1 * 0.01]\n",
+    "#3=[[2 + #2] * cos[#1 * 3.6]]\n",
+    "#4=[[2 + #2] * sin[#1 * 3.6]]\n",
+    "G1 X[#3 + 10] Y[#4 + 10] Z[-#2 / 10] F[600 + #1 MOD 60]\n",
+    "#1++\n",
+  };
+  program->push_back("G21 G90 G17\n");
+  program->push_back("#1=0\n");
+  program->push_back(StringPrintf("WHILE [#1 LT %d] DO\n", iterations));
+  for (const char *line : kBody) program->push_back(line);
+  program->push_back("END\n");
+  return 4 + iterations * (sizeof(kBody) / sizeof(kBody[0]));
+}
+
+// Returns best time for parsing the whole program in nanoseconds.
+static double RunBenchmark(const Program &program, int repeat) {
+  double best_ns = -1;
+  for (int r = 0; r < repeat; ++r) {
+    NullEventReceiver receiver;
+    GCodeParser::Config config;
+    GCodeParser::Config::ParamMap parameters;
+    config.parameters = &parameters;
+    GCodeParser parser(config, &receiver);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const std::string &line : program) {
+      parser.ParseBlock(line.c_str(), NULL);
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    if (best_ns < 0 || ns < best_ns)
+      best_ns = ns;
+  }
+  return best_ns;
+}
+
+// Same, but through ReadFile() from a temporary file, so including reading
+// and splitting into lines.
+static double RunReadFileBenchmark(const Program &program, int repeat) {
+  FILE *tmp = tmpfile();
+  if (!tmp) {
+    perror("tmpfile");
+    return -1;
+  }
+  for (const std::string &line : program) {
+    fputs(line.c_str(), tmp);
+  }
+  fflush(tmp);
+
+  double best_ns = -1;
+  for (int r = 0; r < repeat; ++r) {
+    NullEventReceiver receiver;
+    GCodeParser::Config config;
+    GCodeParser::Config::ParamMap parameters;
+    config.parameters = &parameters;
+    GCodeParser parser(config, &receiver);
+
+    const int fd = dup(fileno(tmp));
+    lseek(fd, 0, SEEK_SET);
+    const auto start = std::chrono::steady_clock::now();
+    parser.ReadFile(fdopen(fd, "r"), NULL);   // Closes file.
+    const auto end = std::chrono::steady_clock::now();
+
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    if (best_ns < 0 || ns < best_ns)
+      best_ns = ns;
+  }
+  fclose(tmp);
+  return best_ns;
+}
+
+// Print timing per line; "lines" is the number of blocks executed, which is
+// more than the program has when it contains loops.
+static void PrintResult(const char *name, const Program &program, int lines,
+                        double ns) {
+  long bytes = 0;
+  for (const std::string &line : program) bytes += line.size();
+  printf("%s\t%d\t%ld\t%.1f\t%.1f\n", name, lines, bytes,
+         ns / (lines > 0 ? lines : 1),
+         ns > 0 ? 1e9 / (1 << 20) * bytes / ns : 0);
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] [<gcode-file> ..]\n"
+          "Options:\n"
+          "\t-n <lines>        : Lines in generated workloads (default 200000).\n"
+          "\t-r <repeat>       : Runs per workload; best is reported (default 5).\n"
+          "Runs the generated CAM surfacing (also read through a file), "
+          "parametric and WHILE loop workloads and all given gcode files.\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  int generated_lines = 200000;
+  int repeat = 5;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+    case 'n': generated_lines = atoi(optarg); break;
+    case 'r': repeat = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (repeat < 1 || generated_lines < 0)
+    return usage(argv[0]);
+
+  Log_init("/dev/null");
+
+  printf("#workload\tlines\tbytes\tns_per_line\tMiB_per_sec\n");
+
+  Program program;
+  CreateCamSurface(generated_lines, &program);
+  PrintResult("cam-surface", program, program.size(),
+              RunBenchmark(program, repeat));
+
+  PrintResult("cam-surface-file", program, program.size(),
+              RunReadFileBenchmark(program, repeat));
+
+  Program parametric_program;
+  CreateParametric(generated_lines, &parametric_program);
+  PrintResult("parametric", parametric_program, parametric_program.size(),
+              RunBenchmark(parametric_program, repeat));
+
+  Program loop_program;
+  const int loop_lines = CreateWhileLoop(generated_lines / 5, &loop_program);
+  PrintResult("while-loop", loop_program, loop_lines,
+              RunBenchmark(loop_program, repeat));
+
+  for (int i = optind; i < argc; ++i) {
+    Program file_program;
+    if (!ReadProgram(argv[i], &file_program))
+      return 1;
+    PrintResult(argv[i], file_program, file_program.size(),
+                RunBenchmark(file_program, repeat));
+  }
+  return 0;
+}
@@ -4,10 +4,15 @@
 #include "gcode-parser.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <unistd.h>
 #include <math.h>
 
+#include <string>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include "common/string-util.h"
@@ -34,14 +39,15 @@ enum {
 
 class ParseTester : public GCodeParser::EventReceiver {
 public:
-  ParseTester() : feedrate(-1) {
+  explicit ParseTester(bool with_parameters = true) : feedrate(-1) {
     bzero(call_count, sizeof(call_count));
     GCodeParser::Config config;
     // some arbitrary machine origins to see that they are honored.
     config.machine_origin[AXIS_X] = HOME_X;
     config.machine_origin[AXIS_Y] = HOME_Y;
     config.machine_origin[AXIS_Z] = HOME_Z;
-    config.parameters = &parameters_;
+    config.parameters = with_parameters ? &parameters_ : NULL;
+    config.allow_m111 = true;
     parser_ = new GCodeParser(config, this);
     EXPECT_EQ(0, parser_->error_count());
   }
@@ -62,6 +68,37 @@ public:
     return parser_->error_count() == errors_before;
   }
 
+  // Read all of "input"; closes it. Returns 'false' if parsing failed.
+  bool TestReadFile(FILE *input) {
+    int errors_before = parser_->error_count();
+    return parser_->ReadFile(input, stderr)
+      && parser_->error_count() == errors_before;
+  }
+
+  // Same as TestParseLine(), but returns what the parser printed.
+  std::string ParseLineOutput(const char *block, bool *success) {
+    int errors_before = parser_->error_count();
+    FILE *out = tmpfile();
+    parser_->ParseBlock(block, out);
+    *success = (parser_->error_count() == errors_before);
+    std::string result;
+    rewind(out);
+    char buffer[1024];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), out)) > 0)
+      result.append(buffer, len);
+    fclose(out);
+    return result;
+  }
+
+  const GCodeParser::Config::ParamMap &parameters() const {
+    return parameters_;
+  }
+
+  const char *ParsePair(const char *line, char *letter, float *value) {
+    return parser_->ParsePair(line, letter, value, stderr);
+  }
+
   // -- gcode parser callbacks
   void gcode_start(GCodeParser *) final { Count(CALL_gcode_start); }
   void gcode_finished(bool) final { Count(CALL_gcode_finished); }
@@ -233,6 +270,108 @@ TEST(GCodeParserTest, InvalidNumbers) {
   }
 }
 
+// Numbers are converted without strtof() most of the time. The result
+// needs to be exactly the same.
+TEST(GCodeParserTest, NumbersSameAsStrtof) {
+  ParseTester counter;
+  std::vector<std::string> numbers = {
+    "0", "-0", "+0", "-.5", "5.", "16777216", "16777217", "0.1", "0.3",
+    "123456.789", "-0.00000000001", "1.0000000001", "340282356779733661637",
+    "999999999999999999999999999999999999999",
+  };
+  // Typical G-code numbers, and some longer ones.
+  uint32_t seed = 42;
+  for (int i = 0; i < 100000; ++i) {
+    seed = seed * 1103515245 + 12345;
+    const int int_digits = (seed >> 8) % 7;
+    const int fraction_digits = (seed >> 12) % 13;
+    std::string number = (seed & 0x10000) ? "-" : "";
+    for (int d = 0; d < int_digits + fraction_digits; ++d) {
+      seed = seed * 1103515245 + 12345;
+      if (d == int_digits) number += ".";
+      number += '0' + (seed >> 16) % 10;
+    }
+    if (int_digits + fraction_digits > 0) numbers.push_back(number);
+  }
+
+  for (const std::string &number : numbers) {
+    const std::string line = "X" + number + " Y1";
+    char letter;
+    float value;
+    const char *remainder = counter.ParsePair(line.c_str(), &letter, &value);
+    ASSERT_TRUE(remainder != NULL) << number;
+    EXPECT_EQ('X', letter);
+    EXPECT_EQ(std::string("Y1"), remainder);
+    const float expected = strtof(number.c_str(), NULL);
+    EXPECT_EQ(0, memcmp(&expected, &value, sizeof(value)))
+      << number << " " << expected << " vs. " << value;
+  }
+}
+
+// Around the limits of the fast conversion: integers of 2^24 and more,
+// more than ten fraction digits, up to the maximum number length.
+TEST(GCodeParserTest, NumbersAtFastPathLimitsSameAsStrtof) {
+  ParseTester counter;
+  std::vector<std::string> numbers = {
+    "16777215", "16777218", "16777219", "16777221", "33554431", "33554433",
+    "33554434", "33554435", "16777216.5", "1677721.65", "167772.165",
+    "0.0000000001", "0.00000000001", "1.0000000000", "1.00000000000",
+    "0.12345678901", "9.99999999999", "0.000000059604644775390625",
+    "0.0000000596046447753906250001", "0.0000000596046447753906249999",
+    "340282346638528859811704183484516925440",   // FLT_MAX
+    "340282356779733661637539395458142568448",   // Rounds to infinity.
+    std::string(38, '0') + "1",
+    "." + std::string(37, '0') + "1",              // Subnormal.
+    "-." + std::string(35, '0') + "1",
+    "0." + std::string(37, '0'),
+  };
+  uint32_t seed = 1;
+  for (int i = 0; i < 20000; ++i) {
+    std::string number;
+    const int len = 1 + i % 38;
+    for (int d = 0; d < len; ++d) {
+      seed = seed * 1103515245 + 12345;
+      number += '0' + (seed >> 16) % 10;
+    }
+    seed = seed * 1103515245 + 12345;
+    number.insert((seed >> 16) % (len + 1), ".");
+    numbers.push_back(number);
+  }
+
+  for (const std::string &number : numbers) {
+    const std::string line = "X" + number + " Y1";
+    char letter;
+    float value;
+    const char *remainder = counter.ParsePair(line.c_str(), &letter, &value);
+    ASSERT_TRUE(remainder != NULL) << number;
+    EXPECT_EQ(std::string("Y1"), remainder) << number;
+    const float expected = strtof(number.c_str(), NULL);
+    EXPECT_EQ(0, memcmp(&expected, &value, sizeof(value)))
+      << number << " " << expected << " vs. " << value;
+  }
+}
+
+// There are no exponents or hex numbers in G-code: 'E' and 'X' are letters.
+TEST(GCodeParserTest, NumbersHaveNoExponent) {
+  ParseTester counter;
+  const struct { const char *line; float value; const char *remainder; }
+  kTests[] = {
+    { "X1E5", 1, "E5" },
+    { "X1.5e-3", 1.5, "e-3" },
+    { "X123456789012E2", 123456789012.0f, "E2" },
+    { "X0x10", 0, "x10" },
+  };
+  for (const auto &t : kTests) {
+    char letter;
+    float value;
+    const char *remainder = counter.ParsePair(t.line, &letter, &value);
+    ASSERT_TRUE(remainder != NULL) << t.line;
+    EXPECT_EQ('X', letter);
+    EXPECT_EQ(t.value, value) << t.line;
+    EXPECT_EQ(std::string(t.remainder), remainder) << t.line;
+  }
+}
+
 TEST(GCodeParserTest, absolute_relative) {
   ParseTester counter;
 
@@ -407,6 +546,17 @@ TEST(GCodeParserTest, numeric_parameters) {
   EXPECT_EQ(HOME_X + 25, counter.abs_pos[AXIS_X]);
 }
 
+TEST(GCodeParserTest, no_parameters_in_config) {
+  ParseTester counter(false);
+
+  // Parameters read as zero, writes are ignored.
+  EXPECT_TRUE(counter.TestParseLine("#1=25 #<foo>=50"));
+  EXPECT_TRUE(counter.TestParseLine("G1 X#1 Y#<foo>"));
+  EXPECT_EQ(HOME_X + 0, counter.abs_pos[AXIS_X]);
+  EXPECT_EQ(HOME_Y + 0, counter.abs_pos[AXIS_Y]);
+  EXPECT_EQ(0, counter.get_parameter(1));
+}
+
 TEST(GCodeParserTest, alphanumeric_parameters) {
   ParseTester counter;
 
@@ -790,6 +940,241 @@ TEST(GCodeParserTest, NegativeNumbers) {
   EXPECT_EQ(-1, counter.get_parameter(1));
 }
 
+TEST(GCodeParserTest, RepeatedExpressions) {
+  ParseTester counter;
+
+  // Expressions are only compiled once; they need to see the current
+  // parameter values each time.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(counter.TestParseLine(StringPrintf("#1=%d", i).c_str()));
+    EXPECT_TRUE(counter.TestParseLine("#2=[#1 * 2 + [#1 ** 2] - -1]"));
+    EXPECT_EQ(i * 2 + i * i + 1, counter.get_parameter(2));
+    EXPECT_TRUE(counter.TestParseLine("G1 X[#1 + 1] Y[atan[#1]/[1]]"));
+    EXPECT_EQ(HOME_X + i + 1, counter.abs_pos[AXIS_X]);
+    EXPECT_FLOAT_EQ(HOME_Y + atan2f(i, 1) * 180 / M_PI,
+                    counter.abs_pos[AXIS_Y]);
+  }
+
+  // Errors happen every time.
+  EXPECT_TRUE(counter.TestParseLine("#1=0"));
+  EXPECT_FALSE(counter.TestParseLine("#2=[1 / #1]"));
+  EXPECT_FALSE(counter.TestParseLine("#2=[1 / #1]"));
+  EXPECT_TRUE(counter.TestParseLine("#1=4"));
+  EXPECT_TRUE(counter.TestParseLine("#2=[1 / #1]"));
+  EXPECT_EQ(0.25, counter.get_parameter(2));
+  EXPECT_FALSE(counter.TestParseLine("#2=[1 + 2"));
+  EXPECT_FALSE(counter.TestParseLine("#2=[[1 + 2]"));
+  EXPECT_FALSE(counter.TestParseLine("#2=[1 +]"));
+  EXPECT_FALSE(counter.TestParseLine("#2=[1 +]"));
+
+  // More different expressions than we keep compiled.
+  for (int i = 0; i < 3000; ++i) {
+    EXPECT_TRUE(counter.TestParseLine(
+                  StringPrintf("#3=[%d + #1]", i % 1500).c_str()));
+    EXPECT_EQ(i % 1500 + 4, counter.get_parameter(3));
+  }
+}
+
+// Everything observable after parsing a block.
+static void ExpectSameResult(const ParseTester &expected,
+                             const ParseTester &actual,
+                             const int expected_calls[NUM_COUNTED_CALLS],
+                             const int actual_calls[NUM_COUNTED_CALLS],
+                             const char *block) {
+  for (int i = 0; i < NUM_COUNTED_CALLS; ++i) {
+    EXPECT_EQ(expected.call_count[i] - expected_calls[i],
+              actual.call_count[i] - actual_calls[i]) << block;
+  }
+  for (GCodeParserAxis a : AllAxes()) {
+    EXPECT_EQ(expected.abs_pos[a], actual.abs_pos[a]) << block;
+  }
+  const GCodeParser::Config::ParamMap &expected_params = expected.parameters();
+  const GCodeParser::Config::ParamMap &actual_params = actual.parameters();
+  for (int p = 0; p < ParameterStore::kNumericParameters; ++p) {
+    EXPECT_EQ(expected_params.Get(p), actual_params.Get(p))
+      << block << " #" << p;
+  }
+  for (const auto &named : expected_params.named_parameters()) {
+    const auto found = actual_params.named_parameters().find(named.first);
+    ASSERT_TRUE(found != actual_params.named_parameters().end()) << block;
+    EXPECT_EQ(expected_params.Get(named.second),
+              actual_params.Get(found->second)) << block << " " << named.first;
+  }
+}
+
+// Parse "block" after "setup" once, so that its expressions are parsed as
+// text, and compare with parsing it again after the expressions have been
+// recorded, which happens the second time they are seen. The recording
+// happens with the parameters of "record_setup", if given. With
+// "log_expressions", M111 S2 is on.
+static void ExpectCachedSameAsUncached(const char *setup, const char *block,
+                                       const char *record_setup,
+                                       bool log_expressions) {
+  if (record_setup == NULL) record_setup = setup;
+  ParseTester cached;
+  if (log_expressions) {
+    EXPECT_TRUE(cached.TestParseLine("M111 S2"));
+  }
+  for (int run = 0; run < 4; ++run) {
+    const char *run_setup = (run < 2) ? record_setup : setup;
+
+    // Same number of lines before it, so that errors show the same line,
+    // and the program started if there was a block before.
+    ParseTester uncached;
+    if (log_expressions) {
+    EXPECT_TRUE(uncached.TestParseLine("M111 S2"));
+  }
+    for (int i = 0; i < run; ++i) {
+      EXPECT_TRUE(uncached.TestParseLine("G90"));
+      EXPECT_TRUE(uncached.TestParseLine(""));
+    }
+    EXPECT_TRUE(uncached.TestParseLine(run_setup));
+    uncached.abs_pos.zero();  // Only see the moves of the block.
+    int uncached_calls[NUM_COUNTED_CALLS];
+    memcpy(uncached_calls, uncached.call_count, sizeof(uncached_calls));
+    bool uncached_ok;
+    const std::string uncached_out
+      = uncached.ParseLineOutput(block, &uncached_ok);
+
+    EXPECT_TRUE(cached.TestParseLine(run_setup));
+    cached.abs_pos.zero();
+    int cached_calls[NUM_COUNTED_CALLS];
+    memcpy(cached_calls, cached.call_count, sizeof(cached_calls));
+    bool cached_ok;
+    const std::string cached_out = cached.ParseLineOutput(block, &cached_ok);
+
+    if (run_setup != setup && strcmp(run_setup, setup) != 0)
+      continue;  // Only recorded with other parameters.
+    EXPECT_EQ(uncached_ok, cached_ok) << block << " run " << run;
+    EXPECT_EQ(uncached_out, cached_out) << block << " run " << run;
+    ExpectSameResult(uncached, cached, uncached_calls, cached_calls, block);
+  }
+}
+
+TEST(GCodeParserTest, CachedExpressionsSameAsUncached) {
+  struct {
+    const char *setup;
+    const char *block;
+    const char *record_setup;  // If parameters differ while recording.
+  } const kTestCases[] = {
+    // All the expressions of the tests above.
+    { "#1=0", "#1=[100 + 20]" },
+    { "#1=0", "#1=[100 - 20]" },
+    { "#1=0", "#1=[100 / 20]" },
+    { "#1=0", "#1=[100 * 20]" },
+    { "#1=0", "#1=[2 ** 3]" },
+    { "#1=0", "#1=[5 MOD 2]" },
+    { "#1=0", "#1=[-5 MOD 2]" },
+    { "#1=0", "#1=[1 AND 1]" },
+    { "#1=0", "#1=[1 AND 0]" },
+    { "#1=0", "#1=[0 AND 1]" },
+    { "#1=0", "#1=[0 AND 0]" },
+    { "#1=0", "#1=[1 OR 1]" },
+    { "#1=0", "#1=[1 OR 0]" },
+    { "#1=0", "#1=[0 OR 1]" },
+    { "#1=0", "#1=[0 OR 0]" },
+    { "#1=0", "#1=[1 XOR 1]" },
+    { "#1=0", "#1=[1 XOR 0]" },
+    { "#1=0", "#1=[0 XOR 1]" },
+    { "#1=0", "#1=[0 XOR 0]" },
+    { "#1=0", "#1=[2.0 / 3 * 1.5 - 5.5 / 11.0]" },
+    { "#1=0", "#1=abs[-100]" },
+    { "#1=0", "#1=abs[100]" },
+    { "#1=0", "#1=acos[.5]" },
+    { "#1=0", "#1=asin[.5]" },
+    { "#1=0", "#1=atan[4]/[4]" },
+    { "#1=0", "#1=cos[60]" },
+    { "#1=0", "#1=exp[4]" },
+    { "#1=0", "#1=fix[4.5]" },
+    { "#1=0", "#1=fup[4.5]" },
+    { "#1=0", "#1=ln[10]" },
+    { "#1=0", "#1=round[4.4]" },
+    { "#1=0", "#1=round[4.5]" },
+    { "#1=0", "#1=sin[30]" },
+    { "#1=0", "#1=sqrt[4]" },
+    { "#1=0", "#1=tan[30]" },
+    { "#1=0", "#1=[1 + 1]" },
+    { "#1=0", "#1=[6 + 15 / 3]" },
+    { "#1=0", "#1=[[6 + 15] / 3]" },
+    { "#1=0", "#1=[3 * 2**3]" },
+    { "#1=0", "#1=[1 + -1]" },
+    { "#1=0", "#1=[1 + --1]" },
+    { "#1=0", "#1=[1 + -[-1]]" },
+    { "#1=42 #2=0", "#2=[-#1]" },
+    { "#1=0", "#1=[sin[90] * -1]" },
+    { "#1=0", "#1=[-sin[90]]" },
+    { "#1=2 #2=0", "#2=[#1 * 2 + [#1 ** 2] - -1]" },
+    { "#1=2", "G1 X[#1 + 1] Y[atan[#1]/[1]]" },
+    { "#1=4 #2=0", "#2=[1 / #1]" },
+    { "#2=0", "#2=[1 + 2" },
+    { "#2=0", "#2=[[1 + 2]" },
+    { "#2=0", "#2=[1 +]" },
+    { "#1=1 #2=100", "IF [#1 LE 0] THEN #2=1" },
+    { "#1=1 #2=100", "IF [#1 GE 0] THEN #2=1" },
+    { "#1=-1 #2=5", "IF [#1 < 0] THEN #2=1 ELSE #2=0" },
+    { "#1=-1 #3=5", "IF [#1 == 0] THEN #3=1 ELSE #3=0" },
+    { "#1=0 #2=5",
+      "IF [#1<0] THEN #2=-1 ELSEIF [#1==0] THEN #2=0 ELSE #2=1" },
+    { "#1=100 #2=5",
+      "IF [#1<0] THEN #2=-1 ELSEIF [#1==0] THEN #2=0 ELSE #2=1" },
+    { "#1=1", "IF [#1=1]" },
+    { "#1=1", "IF [#1==1]" },
+    { "#1=10 #2=3", "#1+=[#2 * 2]" },
+    { "#1=10 #2=3", "#1/=[#2 - 1]" },
+    { "#1=0 #2=5", "#2=[#1<=0] ? -1 : 1" },
+    { "#1=10 #2=-10 #3=5", "#3=[[#1>0] AND [#2>0]] ? [#1*#2] : 0" },
+
+    // Parameters by number and name.
+    { "#1=7 #7=3", "##1=[#1 * 3] #8=##1 #9=#[7]" },
+    { "#1=7 #7=3 #9=0", "#9=#[#1 + 1 - 1] + 1" },
+    { "#1=7 #7=3 #9=0", "#9=[##1 + #[#1] + #<_foo>] #<_foo>=[#9 * 2]" },
+    { "#1=5000 #2=0", "#[#1 + 400]=1 #2=[#[#1 + 400] + 1]" },
+    { "#1=0", "#[-#1 - 1]=[#1 + 1]" },
+
+    // Malformed.
+    { "#2=0", "#2=[1 2]" },
+    { "#2=0", "#2=[1 FOO 2]" },
+    { "#2=0", "#2=[1 + 2]]" },
+    { "#2=0", "#2=[]" },
+    { "#2=0", "#2=foo[1]" },
+    { "#2=0", "#2=abs 1" },
+    { "#2=0", "#2=atan[1]" },
+    { "#2=0", "#2=atan[1]/2" },
+    { "#2=0", "#2=#<foo" },
+    { "#2=0", "#2=[#]" },
+    { "#2=0", "G1 X[1 + ]" },
+    { "#2=0", "#2=[1] ? [2]" },
+    { "#2=0", "#2=[1] ? [2] : ]" },
+    { "#2=0", "#2=[1] ? ]" },
+
+    // Errors while evaluating.
+    { "#2=0", "#2=acos[2]" },
+    { "#2=0", "#2=asin[-2]" },
+    { "#2=0", "#2=ln[0]" },
+    { "#2=0", "#2=sqrt[-1]" },
+    { "#2=0", "#2=[-2 ** 0.5]" },
+    { "#2=0", "#2=atan[1]/[0 / 0]" },
+    { "#1=0 #2=0", "#2=[1 / #1]", "#1=4 #2=0" },
+    { "#1=0 #2=0", "#2=[2 * [1 / #1]]", "#1=4 #2=0" },
+    { "#1=0 #2=0", "#2=[2 * sqrt[#1 - 1]]", "#1=5 #2=0" },
+    { "#1=0 #2=0", "#2=[#1 + 1] ? [1 / #1] : 0", "#1=1 #2=0" },
+    { "#1=0 #2=7", "#2 /= [#1]", "#1=2 #2=7" },
+    { "#1=0 #2=7 #3=0", "#2 = [#1 + 1] #3=[1 / #1] #2++", "#1=2 #2=7 #3=0" },
+    { "#1=0", "G1 X[1 / #1] Y2", "#1=2" },
+    { "#1=0 #2=0", "G1 X2 Y[#2 / #1]", "#1=2 #2=0" },
+    { "#1=0 #2=0", "IF [1 / #1] THEN #2=1", "#1=2 #2=0" },
+    { "#1=0 #2=0", "#2=##[#1 - 1]", "#1=2 #2=0" },
+    { "#1=0", "#[1 / #1]=1", "#1=2" },
+  };
+
+  for (bool log_expressions : { false, true }) {
+    for (const auto &c : kTestCases) {
+      ExpectCachedSameAsUncached(c.setup, c.block, c.record_setup,
+                                 log_expressions);
+    }
+  }
+}
+
 TEST(GCodeParserTest, Conditional) {
   ParseTester counter;
 
@@ -895,6 +1280,140 @@ TEST(GCodeParserTest, WhileLoop) {
   EXPECT_EQ(1024, counter.get_parameter(2));
 }
 
+TEST(GCodeParserTest, WhileLoopSameAsUnrolled) {
+  // The loop body is compiled; it needs to do the same as the text.
+  const char *const body[] = {
+    "G1 X[#1 * 2] Y#1 F[100 + #1] ; comment\n",
+    "#5=[10 + #1] #<named>=[#<named> + #1] G0 Z[sin[#1 * 30]]\n",
+    "##5=[#1 * #1] (comment) #6 = atan[#1]/[2]\n",
+    "IF [#1 GT 2] THEN #20=#1\n",
+    "#21=[#1 MOD 2] ? 1 : -1\n",
+    "#1++\n",
+  };
+  ParseTester looped;
+  EXPECT_TRUE(looped.TestParseLine("#1=0"));
+  EXPECT_TRUE(looped.TestParseLine("WHILE [#1 LT 5] DO"));
+  for (const char *line : body) {
+    EXPECT_TRUE(looped.TestParseLine(line));
+  }
+  EXPECT_TRUE(looped.TestParseLine("END"));
+
+  ParseTester unrolled;
+  EXPECT_TRUE(unrolled.TestParseLine("#1=0"));
+  for (int i = 0; i < 5; ++i) {
+    for (const char *line : body) {
+      EXPECT_TRUE(unrolled.TestParseLine(line));
+    }
+  }
+
+  EXPECT_EQ(5, looped.get_parameter(1));
+  EXPECT_EQ(16, looped.get_parameter(14));
+  EXPECT_EQ(10, looped.get_parameter("named"));
+  EXPECT_EQ(4, looped.get_parameter(20));
+  EXPECT_EQ(5, looped.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(5, looped.call_count[CALL_rapid_move]);
+
+  for (int i = 0; i < NUM_COUNTED_CALLS; ++i) {
+    EXPECT_EQ(unrolled.call_count[i], looped.call_count[i]);
+  }
+  for (GCodeParserAxis a : AllAxes()) {
+    EXPECT_EQ(unrolled.abs_pos[a], looped.abs_pos[a]);
+  }
+  EXPECT_EQ(unrolled.feedrate, looped.feedrate);
+  for (int p : { 1, 5, 6, 10, 11, 12, 13, 14, 20, 21 }) {
+    EXPECT_EQ(unrolled.get_parameter(p), looped.get_parameter(p)) << p;
+  }
+  EXPECT_EQ(unrolled.get_parameter("named"), looped.get_parameter("named"));
+
+  // Errors happening while executing are still reported.
+  EXPECT_TRUE(looped.TestParseLine("WHILE [#1 LT 7] DO"));
+  EXPECT_TRUE(looped.TestParseLine("#2=[1 / [#1 - 6]]\n"));
+  EXPECT_TRUE(looped.TestParseLine("#1++\n"));
+  EXPECT_FALSE(looped.TestParseLine("END"));
+  EXPECT_EQ(7, looped.get_parameter(1));
+}
+
+TEST(GCodeParserTest, WhileLoopErrorsSameAsUnrolled) {
+  // When evaluating fails, the rest of the pair is parsed as text; what was
+  // done before must not be done again.
+  const char *const body[] = {
+    "#3=[1 / [#1 - 2]]\n",
+    "#4++ #5=sqrt[3 - #1] #6++ G1 X[#1] Y[10 / [#1 - 1]]\n",
+    "#7=[#1 MOD 2] ? [1 / [#1 - 3]] : 0 #8=##[#1 - 1] #9++\n",
+    "#1++\n",
+  };
+  ParseTester looped;
+  EXPECT_TRUE(looped.TestParseLine("#1=0 #20=7"));
+  EXPECT_TRUE(looped.TestParseLine("WHILE [#1 LT 6] DO"));
+  for (const char *line : body) {
+    EXPECT_TRUE(looped.TestParseLine(line));
+  }
+  EXPECT_FALSE(looped.TestParseLine("END"));
+
+  ParseTester unrolled;
+  EXPECT_TRUE(unrolled.TestParseLine("#1=0 #20=7"));
+  for (int i = 0; i < 6; ++i) {
+    for (const char *line : body) {
+      unrolled.TestParseLine(line);
+    }
+  }
+
+  EXPECT_EQ(6, looped.get_parameter(1));
+  EXPECT_EQ(6, looped.get_parameter(4));
+  for (int i = 0; i < NUM_COUNTED_CALLS; ++i) {
+    EXPECT_EQ(unrolled.call_count[i], looped.call_count[i]);
+  }
+  for (GCodeParserAxis a : AllAxes()) {
+    EXPECT_EQ(unrolled.abs_pos[a], looped.abs_pos[a]);
+  }
+  for (int p = 1; p <= 20; ++p) {
+    EXPECT_EQ(unrolled.get_parameter(p), looped.get_parameter(p)) << p;
+  }
+}
+
+TEST(GCodeParserTest, ReadFile) {
+  // Lines longer than any buffer, a loop and no newline at the end.
+  std::string program = "G1 X1 Y2" + std::string(20000, ' ') + "Z3\n"
+    "#1=0\n"
+    "WHILE [#1 LT 3] DO\n"
+    "  G0 X#1 ; comment to end of line\n"
+    "  #1++\n"
+    "END\n"
+    "G1 X4 Y5 Z6";
+
+  ParseTester from_file;
+  FILE *file = tmpfile();
+  ASSERT_TRUE(file != NULL);
+  fputs("G1 X100 ; already read\n", file);
+  const long start = ftell(file);
+  fputs(program.c_str(), file);
+  fseek(file, start, SEEK_SET);  // Reading starts at the current position.
+  EXPECT_TRUE(from_file.TestReadFile(file));
+
+  EXPECT_EQ(2, from_file.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(3, from_file.call_count[CALL_rapid_move]);
+  EXPECT_EQ(1, from_file.call_count[CALL_gcode_finished]);
+  EXPECT_EQ(3, from_file.get_parameter(1));
+  EXPECT_EQ(HOME_X + 4, from_file.abs_pos[AXIS_X]);
+  EXPECT_EQ(HOME_Z + 6, from_file.abs_pos[AXIS_Z]);
+
+  // Same from a stream that can't be mapped.
+  ParseTester from_pipe;
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  FILE *const pipe_out = fdopen(fds[1], "w");
+  fputs(program.c_str(), pipe_out);  // fits into the pipe buffer.
+  fclose(pipe_out);
+  EXPECT_TRUE(from_pipe.TestReadFile(fdopen(fds[0], "r")));
+
+  for (int i = 0; i < NUM_COUNTED_CALLS; ++i) {
+    EXPECT_EQ(from_file.call_count[i], from_pipe.call_count[i]);
+  }
+  for (GCodeParserAxis a : AllAxes()) {
+    EXPECT_EQ(from_file.abs_pos[a], from_pipe.abs_pos[a]);
+  }
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
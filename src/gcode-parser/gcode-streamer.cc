@@ -25,7 +25,8 @@
 GCodeStreamer::GCodeStreamer(FDMultiplexer *event_server, GCodeParser *parser,
                              GCodeParser::EventReceiver *parse_events)
   : event_server_(event_server), parser_(parser), parse_events_(parse_events),
-    is_processing_(false), connection_fd_(-1), lines_processed_(0) {
+    is_processing_(false), connection_fd_(-1), lines_processed_(0),
+    wake_fd_(-1), blocked_(false) {
   // Let's start the input idle tasklet
   // TODO: the lifetime implications are a bit problematic as we need to
   // outlive the Loop() of the event server.
@@ -53,6 +54,12 @@ bool GCodeStreamer::ConnectStream(int fd, FILE *msg_stream) {
   return true;
 }
 
+void GCodeStreamer::SetFlowControl(int wake_fd,
+                                   const std::function<bool()> &input_blocked) {
+  wake_fd_ = wake_fd;
+  input_blocked_ = input_blocked;
+}
+
 void GCodeStreamer::CloseStream() {
   if (msg_stream_) {
     fflush(msg_stream_);
@@ -82,21 +89,52 @@ bool GCodeStreamer::ReadData() {
   }
 
   is_processing_ = true;
-  const char *line;
-  while ((line = reader_.ReadLine())) {
+  if (!ParseLines()) {
+    // Don't read more until we're woken up; the line buffer might be full.
+    blocked_ = true;
+    event_server_->RunOnReadable(wake_fd_, [this](){
+      return Wake();
+    });
+    return false;
+  }
+
+  // Loop again
+  return true;
+}
+
+// Parse the complete lines in the buffer. Returns false if we had to stop
+// as input is blocked.
+bool GCodeStreamer::ParseLines() {
+  for (;;) {
+    if (input_blocked_ && input_blocked_())
+      return false;
+    const char *line = reader_.ReadLine();
+    if (!line)
+      return true;
     // NOTE:(important)
     // This should return true or false in case the line was movement or not
     // and only if is, reset the timer.
     parser_->ParseBlock(line, msg_stream_);
     ++lines_processed_;
   }
+}
 
-  // Loop again
-  return true;
+// The wake_fd_ became readable: continue with the remaining lines in the
+// buffer, then go back to reading the stream.
+bool GCodeStreamer::Wake() {
+  if (!ParseLines())
+    return true;  // Still blocked, keep waiting.
+  blocked_ = false;
+  event_server_->RunOnReadable(connection_fd_, [this](){
+    return ReadData();
+  });
+  return false;
 }
 
 // We didn't receive a line within x milliseconds.
 bool GCodeStreamer::Timeout() {
+  if (blocked_)
+    return true;  // Not idle, we're just waiting for the receiver.
   parse_events_->input_idle(is_processing_);
   is_processing_ = false;
   return true;
@@ -19,6 +19,8 @@
 #ifndef FD_GCODE_STREAMER_H_
 #define FD_GCODE_STREAMER_H_
 
+#include <functional>
+
 #include "common/fd-mux.h"
 #include "common/linebuf-reader.h"
 #include "gcode-parser/gcode-parser.h"
@@ -38,6 +40,11 @@ public:
   // Returns true if we are already connected to a stream.
   bool IsStreaming() { return connection_fd_ >= 0; }
 
+  // Stop parsing while "input_blocked" returns true, e.g. because the
+  // receiver of the parse events can't take more right now. Instead of
+  // reading, we then wait for "wake_fd" to become readable and ask again.
+  void SetFlowControl(int wake_fd, const std::function<bool()> &input_blocked);
+
 private:
   void CloseStream();
 
@@ -52,7 +59,13 @@ private:
   int connection_fd_;
   int lines_processed_;
 
+  int wake_fd_;
+  std::function<bool()> input_blocked_;
+  bool blocked_;
+
+  bool ParseLines();
   bool ReadData();
+  bool Wake();
   bool Timeout();
 };
 
@@ -81,6 +81,10 @@ public:
     event_server_.SingleCycle(0);
   }
 
+  void SetFlowControl(int wake_fd, const std::function<bool()> &blocked) {
+    streamer_->SetFlowControl(wake_fd, blocked);
+  }
+
   MOCK_METHOD1(gcode_start, void(GCodeParser *parser));
   MOCK_METHOD1(gcode_finished, void(bool end_of_stream));
   MOCK_METHOD1(input_idle, void(bool is_first));
@@ -174,6 +178,47 @@ TEST(Streaming, basic_stream) {
   tester.Cycle(); // Wait the stream to close
 }
 
+// While input is blocked, no lines are parsed and there is no idle
+// timeout. Parsing continues once woken up and unblocked.
+TEST(Streaming, flow_control) {
+  StreamTester tester;
+  MockStream wake;
+  bool blocked = false;
+  tester.SetFlowControl(wake.GetReceiverFiledescriptor(),
+                        [&blocked]() { return blocked; });
+
+  EXPECT_CALL(tester, gcode_start(_)).Times(1);
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(1);
+  tester.OpenStream();
+  tester.SendString("G1X100F1000\n");
+  tester.Cycle();
+  Mock::VerifyAndClearExpectations(&tester);
+
+  blocked = true;
+  EXPECT_CALL(tester, coordinated_move(_, _)).Times(0);
+  EXPECT_CALL(tester, input_idle(_)).Times(0);
+  tester.SendString("G1X200F1000\nG1X300F1000\n");
+  tester.Cycle();  // Reads, but doesn't parse.
+  tester.Cycle();  // Not readable anymore: timeout, but no input idle.
+  wake.SendData("x");
+  tester.Cycle();  // Woken up, but still blocked.
+  Mock::VerifyAndClearExpectations(&tester);
+
+  // Once unblocked, the lines still in the buffer are parsed on wakeup,
+  // without new data arriving on the stream.
+  blocked = false;
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(2);
+  tester.Cycle();
+  Mock::VerifyAndClearExpectations(&tester);
+
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(1);
+  EXPECT_CALL(tester, gcode_finished(_)).Times(1);
+  tester.SendString("G1X400F1000\n");
+  tester.CloseStream();
+  tester.Cycle();
+  tester.Cycle();
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
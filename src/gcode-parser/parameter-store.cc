@@ -0,0 +1,82 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "parameter-store.h"
+
+#include <ctype.h>
+
+const int ParameterStore::kNumericParameters;
+
+ParameterStore::ParameterStore() : values_(kNumericParameters, 0.0f) {
+}
+
+// Like atoi(name) >= limit for a positive "limit", but without overflowing
+// on long numbers.
+static bool LeadingNumberAtLeast(const std::string &name, int limit) {
+  size_t i = 0;
+  if (i < name.length() && name[i] == '+') ++i;
+  int number = 0;
+  for (/**/; i < name.length() && isdigit(name[i]); ++i) {
+    number = 10 * number + (name[i] - '0');
+    if (number >= limit) return true;
+  }
+  return false;
+}
+
+ParameterStore::Handle ParameterStore::GetHandle(StringPiece name) {
+  name = TrimWhitespace(name);
+
+  // Plain decimal numbers in range are the numeric parameters. Only the
+  // canonical form: with leading zeros, such as "007", it is a name.
+  if (!name.empty() && name.length() <= 9
+      && (name[0] != '0' || name.length() == 1)) {
+    int number = 0;
+    bool is_number = true;
+    for (char c : name) {
+      if (!isdigit(c)) {
+        is_number = false;
+        break;
+      }
+      number = 10 * number + (c - '0');
+    }
+    if (is_number && number < kNumericParameters)
+      return number;
+  }
+
+  const std::pair<NameMap::iterator, bool> inserted
+    = named_.insert(std::make_pair(ToLower(name), (Handle) values_.size()));
+  if (inserted.second) {
+    values_.push_back(0.0f);
+    names_.push_back(inserted.first->first);
+  }
+  return inserted.first->second;
+}
+
+bool ParameterStore::IsWritable(Handle handle) const {
+  if (handle < kNumericParameters)
+    return handle != 0;
+  return !LeadingNumberAtLeast(names_[handle - kNumericParameters],
+                               kNumericParameters);
+}
+
+std::string ParameterStore::GetName(Handle handle) const {
+  if (handle < kNumericParameters)
+    return StringPrintf("%d", handle);
+  return names_[handle - kNumericParameters];
+}
@@ -0,0 +1,82 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_PARAMETER_STORE_H
+#define _BEAGLEG_PARAMETER_STORE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/string-util.h"
+
+// The NIST-RS274NGC parameters/variables.
+//
+// The numeric parameters 0..5399 are kept in an array. All other names -- we
+// allow arbitrary variable names -- get a handle the first time they are
+// seen, so that the parser can resolve names once and then access parameters
+// by handle without any lookup.
+//
+// Names are case insensitive. Parameters that never have been set are zero.
+class ParameterStore {
+public:
+  typedef int Handle;
+
+  // Number of numeric parameters; their handle is their number.
+  static const int kNumericParameters = 5400;
+
+  ParameterStore();
+
+  // Get the handle of the parameter with the given name. Names that are a
+  // number in the numeric parameter range refer to that parameter, everything
+  // else is added as new parameter if not seen before. This includes numbers
+  // with leading zeros: "007" is not the same as "7".
+  Handle GetHandle(StringPiece name);
+
+  // Same as GetHandle() for the name of the given number.
+  Handle GetNumericHandle(int number) {
+    return (number >= 0 && number < kNumericParameters)
+      ? number : GetHandle(StringPrintf("%d", number));
+  }
+
+  // Parameter zero is always zero, and numbers beyond the numeric parameter
+  // range are not supported, so they can't be written. Names count as the
+  // number they start with, if any, like with atoi().
+  bool IsWritable(Handle handle) const;
+
+  float Get(Handle handle) const { return values_[handle]; }
+  void Set(Handle handle, float value) { values_[handle] = value; }
+
+  // Name of the parameter; for numeric parameters this is the number.
+  std::string GetName(Handle handle) const;
+
+  // Access by name, like with a std::map.
+  float &operator[](StringPiece name) { return values_[GetHandle(name)]; }
+
+  // Names that are not in the numeric parameter range and their handle,
+  // sorted by name.
+  typedef std::map<std::string, Handle> NameMap;
+  const NameMap &named_parameters() const { return named_; }
+
+private:
+  std::vector<float> values_;   // Numeric parameters, then the named.
+  NameMap named_;
+  std::vector<std::string> names_;  // Names by handle.
+};
+
+#endif  // _BEAGLEG_PARAMETER_STORE_H
@@ -0,0 +1,99 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "parameter-store.h"
+
+#include <gtest/gtest.h>
+
+TEST(ParameterStore, numeric_parameters_are_their_number) {
+  ParameterStore params;
+  EXPECT_EQ(1, params.GetHandle("1"));
+  EXPECT_EQ(5399, params.GetHandle("5399"));
+  EXPECT_EQ(42, params.GetHandle(" 42 "));
+  EXPECT_EQ(0, params.GetHandle("0"));
+  EXPECT_EQ(5220, params.GetNumericHandle(5220));
+  EXPECT_EQ("5220", params.GetName(5220));
+  EXPECT_TRUE(params.named_parameters().empty());
+
+  EXPECT_EQ(0, params.Get(123));
+  params.Set(123, 3.5);
+  EXPECT_EQ(3.5, params.Get(123));
+  EXPECT_EQ(3.5, params["123"]);
+}
+
+TEST(ParameterStore, named_parameters) {
+  ParameterStore params;
+  const ParameterStore::Handle foo = params.GetHandle("Foo");
+  EXPECT_GE(foo, ParameterStore::kNumericParameters);
+  EXPECT_EQ(foo, params.GetHandle("foo"));
+  EXPECT_EQ(foo, params.GetHandle("FOO"));
+  EXPECT_EQ("foo", params.GetName(foo));
+  EXPECT_EQ(0, params.Get(foo));
+
+  const ParameterStore::Handle bar = params.GetHandle("_bar");
+  EXPECT_NE(foo, bar);
+  params["_BAR"] = 7;
+  EXPECT_EQ(7, params.Get(bar));
+
+  // Numbers out of range are just names.
+  const ParameterStore::Handle big = params.GetNumericHandle(5400);
+  EXPECT_EQ(big, params.GetHandle("5400"));
+  EXPECT_EQ("5400", params.GetName(big));
+  EXPECT_EQ(params.GetHandle("-1"), params.GetNumericHandle(-1));
+
+  ASSERT_EQ(4u, params.named_parameters().size());
+  EXPECT_EQ("-1", params.named_parameters().begin()->first);
+}
+
+TEST(ParameterStore, leading_zeros_are_names) {
+  ParameterStore params;
+  const ParameterStore::Handle zero_seven = params.GetHandle("007");
+  EXPECT_GE(zero_seven, ParameterStore::kNumericParameters);
+  EXPECT_EQ("007", params.GetName(zero_seven));
+  params["007"] = 1.5;
+  EXPECT_EQ(0, params.Get(7));
+
+  const ParameterStore::Handle zero_zero = params.GetHandle("00");
+  EXPECT_GE(zero_zero, ParameterStore::kNumericParameters);
+  EXPECT_TRUE(params.IsWritable(zero_zero));
+}
+
+TEST(ParameterStore, writable) {
+  ParameterStore params;
+  EXPECT_FALSE(params.IsWritable(0));
+  EXPECT_TRUE(params.IsWritable(1));
+  EXPECT_TRUE(params.IsWritable(5399));
+  EXPECT_FALSE(params.IsWritable(params.GetNumericHandle(5400)));
+  EXPECT_TRUE(params.IsWritable(params.GetHandle("foo")));
+
+  // Names count as the number they start with.
+  EXPECT_TRUE(params.IsWritable(params.GetHandle("-1")));
+  EXPECT_TRUE(params.IsWritable(params.GetHandle("12abc")));
+  EXPECT_FALSE(params.IsWritable(params.GetHandle("6000abc")));
+  EXPECT_FALSE(params.IsWritable(params.GetHandle("+6000")));
+
+  // Too long for an int.
+  EXPECT_FALSE(params.IsWritable(params.GetHandle("99999999999")));
+  EXPECT_FALSE(params.IsWritable(params.GetHandle("4294967296")));
+  EXPECT_TRUE(params.IsWritable(params.GetHandle("-99999999999")));
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -44,6 +44,10 @@ MachineControlConfig::MachineControlConfig() {
   home_order = kHomeOrder;
   threshold_angle = -1;
   speed_tune_angle = 0;
+  junction_deviation = 0;
+  lookahead_segments = 64;
+  chord_tolerance = 0;
+  threaded_planning = false;
   auto_motor_disable_seconds = -1;
   auto_fan_disable_seconds = -1;
   auto_fan_pwm = 0;
@@ -90,6 +94,10 @@ public:
       ACCEPT_VALUE("auto-fan-disable-seconds",
                    Int,  &config_->auto_fan_disable_seconds);
       ACCEPT_VALUE("auto-fan-pwm",   Int,    &config_->auto_fan_pwm);
+      ACCEPT_VALUE("lookahead-segments", Int, &config_->lookahead_segments);
+      ACCEPT_EXPR("junction-deviation",     &config_->junction_deviation);
+      ACCEPT_EXPR("chord-tolerance",        &config_->chord_tolerance);
+      ACCEPT_VALUE("threaded-planning", Bool, &config_->threaded_planning);
       return false;
     }
 
@@ -103,6 +111,7 @@ public:
       ACCEPT_EXPR("max-probe-feedrate", &config_->max_probe_feedrate[current_axis_]);
 
       ACCEPT_EXPR("max-acceleration", &config_->acceleration[current_axis_]);
+      ACCEPT_EXPR("max-jerk",         &config_->jerk[current_axis_]);
 
       ACCEPT_EXPR("range",            &config_->move_range_mm[current_axis_]);
 
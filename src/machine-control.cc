@@ -51,6 +51,7 @@
 #include "sim-firmware.h"
 #include "sim-audio-out.h"
 #include "spindle-control.h"
+#include "threaded-step-motion-queue.h"
 
 static int usage(const char *prog, const char *msg) {
   if (msg) {
@@ -74,6 +75,7 @@ static int usage(const char *prog, const char *msg) {
           // -W <wav-file>  dry run for development: output wav file.
           "  -P                         : Verbose: Show some more debug output (Default: off).\n"
           "  -S                         : Synchronous: don't queue (Default: off).\n"
+          "      --threaded-steps       : Dryrun; generate steps in a thread with PRU-like timing and queue (Default: off).\n"
           "      --allow-m111           : Allow changing the debug level with M111 (Default: off).\n"
           "\nSegment acceleration tuning:\n"
           "     --threshold-angle       : Specifies the threshold angle used for segment acceleration (Default: 10 degrees).\n"
@@ -235,7 +237,9 @@ static void run_gcode_server(int listen_socket, FDMultiplexer *event_server,
 // THIS IS A SAMPLE ONLY at this point. We need to come up with a proper
 // definition first what we want from a status server.
 // At this point: whenever it receives the character 'p' it prints the
-// position as json.
+// position as json. The characters '+' and '-' change the speed override
+// in 10% steps, '=' resets it to 100%; each replies with the new override.
+// 'q' prints the motion queue statistics, such as underruns.
 static void run_status_server(const char *bind_addr, int port,
                               FDMultiplexer *event_server,
                               GCodeMachineControl *machine) {
@@ -285,6 +289,29 @@ static void run_status_server(const char *bind_addr, int port,
                     home_status == GCodeMachineControl::HomingState::HOMED ? "yes" : "unknown",
 		    machine->GetMotorsEnabled() ? "true" : "false");
           }
+          MotionQueueStats stats;
+          if (query == 'q' && machine->GetQueueStats(&stats)) {
+            // JSON {"capacity":int, "pending":int, "underruns":int,
+            //       "underrun_max_ms":fval, "underrun_total_ms":fval}
+            dprintf(conn, "{\"capacity\":%d, \"pending\":%d, "
+                    "\"underruns\":%d, \"underrun_max_ms\":%.1f, "
+                    "\"underrun_total_ms\":%.1f}\n",
+                    stats.capacity, stats.pending, stats.underruns,
+                    stats.underrun_max_usec / 1000.0,
+                    stats.underrun_total_usec / 1000.0);
+          }
+          if (query == '+' || query == '-' || query == '=') {
+            float factor = 1.0f;
+            if (query != '=') {
+              factor = machine->GetSpeedOverride() + (query == '+' ? 0.1f : -0.1f);
+              if (factor < 0.1f) factor = 0.1f;
+              if (factor > 2.0f) factor = 2.0f;
+            }
+            machine->SetSpeedOverride(factor);
+            // JSON {"speed_override":fval}
+            dprintf(conn, "{\"speed_override\":%.2f}\n",
+                    machine->GetSpeedOverride());
+          }
           return true;
         });
       return true;
@@ -304,6 +331,7 @@ int main(int argc, char *argv[]) {
   MachineControlConfig config;
   bool dry_run = false;
   bool simulation_output = false;
+  bool threaded_steps = false;
   const char *logfile = NULL;
   std::string paramfile;
   const char *config_file = NULL;
@@ -322,7 +350,8 @@ int main(int argc, char *argv[]) {
     OPT_PRIVS,
     OPT_ENABLE_M111,
     OPT_PARAM_FILE,
-    OPT_STATUS_SERVER
+    OPT_STATUS_SERVER,
+    OPT_THREADED_STEPS
   };
 
   static struct option long_options[] = {
@@ -346,6 +375,7 @@ int main(int argc, char *argv[]) {
     { "priv",               required_argument, NULL, OPT_PRIVS },
     { "allow-m111",         no_argument,       NULL, OPT_ENABLE_M111 },
     { "status-server",      required_argument, NULL, OPT_STATUS_SERVER },
+    { "threaded-steps",     no_argument,       NULL, OPT_THREADED_STEPS },
 
     // possibly deprecated soon.
     { "threshold-angle",    required_argument, NULL, OPT_SET_THRESHOLD_ANGLE },
@@ -399,6 +429,10 @@ int main(int argc, char *argv[]) {
       dry_run = true;
       wav_output = fopen(optarg, "w");
       break;
+    case OPT_THREADED_STEPS:
+      dry_run = true;
+      threaded_steps = true;
+      break;
     case 'P':
       config.debug_print = true;
       break;
@@ -543,6 +577,8 @@ int main(int argc, char *argv[]) {
       motion_backend = new SimFirmwareQueue(stdout, 3); // TODO: derive from cfg
     } else if (wav_output) {
       motion_backend = new SimFirmwareAudioQueue(wav_output);
+    } else if (threaded_steps) {
+      motion_backend = new ThreadedStepMotionQueue(NULL);
     } else {
       motion_backend = new DummyMotionQueue();
     }
@@ -589,6 +625,17 @@ int main(int argc, char *argv[]) {
   GCodeStreamer *streamer =
     new GCodeStreamer(&event_server, parser,
                       machine_control->ParseEventReceiver());
+
+  // Instead of blocking the event loop while the motion queue is full, hold
+  // back what doesn't fit and stop reading GCode until the queue makes
+  // progress. With threaded planning, the planner thread does the waiting.
+  const int motion_event_fd = motion_backend->EventFd();
+  if (motion_event_fd >= 0 && !config.threaded_planning) {
+    motor_operations.SetNonBlocking(true);
+    streamer->SetFlowControl(motion_event_fd, [&motor_operations]() {
+      return !motor_operations.SendHeldBack();
+    });
+  }
   int ret = 0;
   if (has_filename) {
     const char *filename = argv[optind];
@@ -615,6 +662,9 @@ int main(int argc, char *argv[]) {
     Log_info("Caught signal: immediate exit. "
              "Skipping potential remaining queue.");
   }
+  if (!caught_signal) {
+    motor_operations.WaitQueueEmpty();  // Send what has been held back.
+  }
   motion_backend->Shutdown(!caught_signal);
 
   delete motion_backend;
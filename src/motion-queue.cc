@@ -0,0 +1,153 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Changing the speed of motion segments that are already queued.
+
+#include "motion-queue.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "motor-interface-constants.h"
+
+// Time over which a speed change is ramped in.
+static const double kSpeedRampSeconds = 0.1;
+
+// Delay in hires cycles: the acceleration delays are fixed point values.
+static const double kHiresCycles
+  = (double) TIMER_FREQUENCY * (1 << DELAY_CYCLE_SHIFT);
+
+static uint32_t ClampDelay(double delay) {
+  delay += 0.5;
+  return delay >= UINT32_MAX ? UINT32_MAX : (uint32_t) delay;
+}
+
+// The term of the acceleration series at "index", scaled with the
+// acceleration: hires_accel_cycles = factor * term. Same as in
+// motor-operations.cc.
+static double AccelerationSeriesTerm(uint32_t index) {
+  if (index == 0) return 0.67605 * (sqrt(1.0) - sqrt(0.0));
+  if (index < 1024) return sqrt(index + 1.0) - sqrt(index);
+  return 1.0 / (2.0 * sqrt(index + 0.5));
+}
+
+void ScaleMotionSegmentSpeed(MotionSegment *segment, float factor) {
+  segment->travel_delay_cycles
+    = ClampDelay(segment->travel_delay_cycles / factor);
+  segment->hires_accel_cycles
+    = ClampDelay(segment->hires_accel_cycles / factor);
+}
+
+// With constant acceleration "a" in loops/s^2, the acceleration series is
+// at index n at the speed sqrt(2 * a * n) loops/s, and
+//   hires_accel_cycles = kHiresCycles * sqrt(2 / a) * term(n)
+// So the square of the speed changes linearly over the loops of a segment.
+// Get the square of the speeds at the start and the end of "segment".
+static void GetSquaredSpeeds(const MotionSegment &segment,
+                             double *start, double *end) {
+  if (segment.loops_travel) {
+    const double speed = (double) TIMER_FREQUENCY
+      / std::max(segment.travel_delay_cycles, 1u);
+    *start = *end = speed * speed;
+    return;
+  }
+  const double accel_factor = segment.hires_accel_cycles
+    / AccelerationSeriesTerm(segment.accel_series_index) / kHiresCycles;
+  const double twice_accel = 4.0 / (accel_factor * accel_factor);
+  *start = twice_accel * segment.accel_series_index;
+  if (segment.loops_accel) {
+    *end = twice_accel * (segment.accel_series_index + segment.loops_accel);
+  } else {
+    *end = twice_accel * ((double) segment.accel_series_index
+                          - segment.loops_decel);
+  }
+}
+
+// Set the profile of "segment" to go from the squared speed "start" to "end"
+// over its loops.
+static void SetSquaredSpeeds(double start, double end, MotionSegment *segment) {
+  const int loops = (segment->loops_accel + segment->loops_travel
+                     + segment->loops_decel);
+  segment->loops_accel = segment->loops_travel = segment->loops_decel = 0;
+  segment->accel_series_index = 0;
+  segment->hires_accel_cycles = 0;
+  segment->travel_delay_cycles = 0;
+
+  if (fabs(end - start) <= 1e-3 * std::max(start, end)) {
+    // Practically constant; travel with the average speed.
+    segment->loops_travel = loops;
+    segment->travel_delay_cycles
+      = ClampDelay(2.0 * TIMER_FREQUENCY / (sqrt(start) + sqrt(end)));
+    return;
+  }
+  const double twice_accel = fabs(end - start) / loops;
+  uint32_t index = (uint32_t) (start / twice_accel + 0.5);
+  if (end > start) {
+    segment->loops_accel = loops;
+  } else {
+    segment->loops_decel = loops;
+    index = std::max(index, (uint32_t) loops);
+  }
+  segment->accel_series_index = index;
+  segment->hires_accel_cycles
+    = ClampDelay(kHiresCycles * sqrt(4.0 / twice_accel)
+                 * AccelerationSeriesTerm(index));
+}
+
+// Duration of "segment" in seconds.
+static double SegmentSeconds(const MotionSegment &segment) {
+  const int loops = (segment.loops_accel + segment.loops_travel
+                     + segment.loops_decel);
+  if (loops == 0) return 0;
+  double start, end;
+  GetSquaredSpeeds(segment, &start, &end);
+  return 2.0 * loops / (sqrt(start) + sqrt(end));
+}
+
+QueuedSpeedScaler::QueuedSpeedScaler(float factor)
+  : factor_(factor), total_seconds_(0), elapsed_seconds_(0) {}
+
+void QueuedSpeedScaler::Add(const MotionSegment &segment) {
+  total_seconds_ += SegmentSeconds(segment);
+}
+
+// The factor at "seconds" of the original motion: changing linearly from 1
+// to factor_ over the ramp, which ends with the queue at the latest.
+double QueuedSpeedScaler::RampFactor(double seconds) const {
+  const double ramp = std::min(kSpeedRampSeconds, total_seconds_);
+  if (seconds >= ramp) return factor_;
+  return 1.0 + (factor_ - 1.0) * seconds / ramp;
+}
+
+void QueuedSpeedScaler::Scale(MotionSegment *segment) {
+  const double seconds = SegmentSeconds(*segment);
+  const double start_factor = RampFactor(elapsed_seconds_);
+  elapsed_seconds_ += seconds;
+  const double end_factor = RampFactor(elapsed_seconds_);
+  if (start_factor == factor_ || !isfinite(seconds)) {
+    ScaleMotionSegmentSpeed(segment, factor_);
+    return;
+  }
+  if (seconds == 0) return;
+  double start, end;
+  GetSquaredSpeeds(*segment, &start, &end);
+  SetSquaredSpeeds(start * start_factor * start_factor,
+                   end * end_factor * end_factor, segment);
+}
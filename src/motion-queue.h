@@ -47,13 +47,17 @@
 // using a microcontroller or FPGA.
 // Also useful for testing.
 
+// A segment only moves in one of the phases, so at most one of the loops_*
+// values is non-zero.
 struct MotionSegment {
-  // Queue header
   uint8_t state;           // see motor-interface-constants.h STATE_* constants.
 
   uint8_t direction_bits;
+  uint8_t ends_in_motion;  // Motors still move at the end of this segment,
+                           // so running out of segments after it is an
+                           // underrun. Not sent to the hardware.
+  uint8_t reserved;        // Padding to 32 bit.
 
-  // TravelParameters (needs to match TravelParameters in motor-interface-pru.p)
   uint16_t loops_accel;    // Phase 1: loops spent in acceleration
   uint16_t loops_travel;   // Phase 2: lops spent in travel
   uint16_t loops_decel;    // Phase 3: loops spent in deceleration
@@ -64,31 +68,87 @@ struct MotionSegment {
   uint32_t travel_delay_cycles; // travel delay cycles.
 
   uint32_t fractions[MOTION_MOTOR_COUNT]; // fixed point fractions to add each step.
+} __attribute__((packed, aligned(4)));
+static_assert(sizeof(MotionSegment) % 4 == 0,
+              "MotionSegment needs to be a multiple of 32 bit.");
 
-#if JERK_EXPERIMENT
-  /*
-   * The following not handled yet in PRU, just experimental in sim right now.
-   */
-  uint16_t jerk_start;
-  uint16_t jerk_stop;
-  float jerk_motion;
-#endif
-} __attribute__((packed));
+// Change the timing of "segment" for it to run with its speed multiplied by
+// "factor". The step count and the acceleration series index stay the same,
+// so all delays in the segment are scaled uniformly.
+void ScaleMotionSegmentSpeed(MotionSegment *segment, float factor);
+
+// Changes the speed of segments waiting in a motion queue by a factor.
+// Starting right away with the next segment would change the speed
+// abruptly, so the factor is ramped in: the speed at the start of the first
+// segment stays the same, and the factor changes linearly over the first
+// 100ms of motion, or the whole queue if it is shorter. Segments after the
+// ramp are scaled uniformly.
+class QueuedSpeedScaler {
+public:
+  explicit QueuedSpeedScaler(float factor);
+
+  float factor() const { return factor_; }
+
+  // Add a segment that is going to be scaled. All of them need to be added
+  // before scaling the first, so that the ramp ends with the queue.
+  void Add(const MotionSegment &segment);
+
+  // Scale the next segment, in execution order.
+  void Scale(MotionSegment *segment);
+
+private:
+  double RampFactor(double seconds) const;
+
+  const float factor_;
+  double total_seconds_;    // Duration of the added segments.
+  double elapsed_seconds_;  // Duration of the segments scaled so far.
+};
 
 namespace internal {
 // Layout of the status register
 // Assuming atomicity of 32 bit boundaries
 // This 32 bit value will be a copy of the R28 register of the PRU.
-// First 0-23 bits are assigned to the counter, top 24-31 bits to the index.
+// The lower bits are assigned to the counter, the top bits to the index
+// (see QUEUE_STATUS_INDEX_SHIFT in motor-interface-constants.h).
 // This is an internal implementation detail of the PRUMotionQueue.
 struct QueueStatus {
   uint32_t counter : 24; // remaining number of cycles to be performed
   uint32_t index : 8;    // represent the executing slot [0 to QUEUE_LEN - 1]
 };
+
+// The encoding of MotionSegments in the PRU queue. Exposed for
+// tests and tools that need to play the PRU side.
+
+// Encode "segment" into "out", which needs to have space for
+// QUEUE_ELEMENT_MAX_SIZE bytes. Returns the encoded size in bytes.
+int EncodeMotionSegment(const MotionSegment &segment, uint32_t *out);
+
+// Decode the element starting at "in". Returns its size in bytes.
+int DecodeMotionSegment(const volatile uint32_t *in, MotionSegment *segment);
+
+// Size in bytes of an encoded element, given its first word.
+int EncodedSegmentSize(uint32_t header);
+
+// Byte offset in the queue of the element following the one at "pos" with
+// the given size.
+unsigned int NextElementPosition(unsigned int pos, int size);
 }
 
 typedef FixedArray<int, MOTION_MOTOR_COUNT> MotorsRegister;
 
+// Capacity and occupancy of a MotionQueue.
+struct MotionQueueStats {
+  int capacity;   // Maximum number of segments the queue can hold.
+  int pending;    // Segments in the queue, same as GetPendingElements().
+
+  // Underruns: the queue ran empty while the motors were still supposed to
+  // move, so they came to an abrupt stop. The durations are upper bounds,
+  // measured from the last time the queue was seen busy.
+  int underruns;
+  int64_t underrun_max_usec;
+  int64_t underrun_total_usec;
+};
+
 // Low level motion queue operations.
 class MotionQueue {
 public:
@@ -100,6 +160,29 @@ public:
   // Returns true if segment was added, false if PRU abort was detected
   virtual bool Enqueue(MotionSegment *segment) = 0;
 
+  // Enqueue "count" segments. Blocks until all of them are in the queue.
+  // Implementations can fill several free slots at once.
+  // Returns true if all segments were added, false if abort was detected.
+  virtual bool EnqueueBatch(MotionSegment *segments, int count) {
+    for (int i = 0; i < count; ++i) {
+      if (!Enqueue(&segments[i])) return false;
+    }
+    return true;
+  }
+
+  // Like EnqueueBatch(), but never blocks: enqueues as many of the segments
+  // as fit into the queue right now.
+  // Returns the number of segments enqueued, or -1 if abort was detected.
+  // Queues that never block just enqueue all of them.
+  virtual int TryEnqueueBatch(MotionSegment *segments, int count) {
+    return EnqueueBatch(segments, count) ? count : -1;
+  }
+
+  // File descriptor that becomes readable when the queue makes progress.
+  // An event loop can watch it to call TryEnqueueBatch() again once there
+  // is space, instead of blocking in Enqueue(). Returns -1 if not available.
+  virtual int EventFd() { return -1; }
+
   // Block and wait for queue to be empty.
   virtual void WaitQueueEmpty() = 0;
 
@@ -116,6 +199,18 @@ public:
   // The return parameter head_item_progress is set to the number
   // of not yet executed loops in the item currenly being executed.
   virtual int GetPendingElements(uint32_t *head_item_progress) = 0;
+
+  // Fill "stats" with the capacity and current number of elements of the
+  // queue. The capacity does not change over the lifetime of the queue, so
+  // users can use it to size their own buffers.
+  virtual void GetQueueStats(MotionQueueStats *stats) = 0;
+
+  // Change the speed of segments waiting in the queue with the "scaler",
+  // starting with the first segment the hardware is not working on yet.
+  // The segments to be scaled are added to the scaler first.
+  // Returns true if everything up to the end of the queue has been scaled.
+  // Implementations that can't access their queue ignore this.
+  virtual bool ScaleQueuedSpeed(QueuedSpeedScaler *scaler) { return false; }
 };
 
 // Standard implementation.
@@ -131,21 +226,45 @@ public:
   ~PRUMotionQueue();
 
   bool Enqueue(MotionSegment *segment);
+  bool EnqueueBatch(MotionSegment *segments, int count);
+  int TryEnqueueBatch(MotionSegment *segments, int count);
+  int EventFd();
   void WaitQueueEmpty();
   void MotorEnable(bool on);
   void Shutdown(bool flush_queue);
   int GetPendingElements(uint32_t *head_item_progress);
+  void GetQueueStats(MotionQueueStats *stats);
+  bool ScaleQueuedSpeed(QueuedSpeedScaler *scaler);
 
 private:
   bool Init();
 
-  void ClearPRUAbort(unsigned int idx);
+  uint8_t ElementState(unsigned int pos);
+  void ClearPRUAbort(unsigned int pos);
+  void ReleaseFinishedElements();
+  bool HoldElement(unsigned int pos);
+  void ReleaseHold();
+  bool HasSpaceFor(int size);
+  bool CheckPRUAbort();
+  bool WaitForSpace(int size);
+  int EnqueueSegments(MotionSegment *segments, int count, bool may_block);
+  void CheckUnderrun();
 
   HardwareMapping *const hardware_mapping_;
   PruHardwareInterface *const pru_interface_;
 
   volatile struct PRUCommunication *pru_data_;
-  unsigned int queue_pos_;
+  unsigned int queue_pos_;  // Byte offset of the next element to write.
+
+  // Positions of the elements the PRU has not finished yet, oldest first.
+  class InFlightElements;
+  InFlightElements *const in_flight_;
+
+  bool last_ends_in_motion_;   // Last segment with loops still moving.
+  int64_t last_busy_usec_;     // Last time we saw unfinished elements.
+  int underruns_;
+  int64_t underrun_max_usec_;
+  int64_t underrun_total_usec_;
 };
 
 
@@ -161,6 +280,11 @@ public:
       *head_item_progress = 0;
     return 1;
   }
+  void GetQueueStats(MotionQueueStats *stats) {
+    *stats = {};
+    stats->capacity = 1;
+    stats->pending = 1;
+  }
 };
 
 #endif  // _BEAGLEG_MOTION_QUEUE_H_
@@ -0,0 +1,177 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Test for changing the speed of queued motion segments.
+ *
+ * Segments are created by the motor operations, and the delays between the
+ * loops are calculated like the PRU does.
+ */
+#include "motion-queue.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+#include "hardware-mapping.h"
+#include "motor-interface-constants.h"
+#include "motor-operations.h"
+
+class RecordingMotionQueue : public MotionQueue {
+public:
+  bool Enqueue(MotionSegment *segment) {
+    segments.push_back(*segment);
+    return true;
+  }
+  void WaitQueueEmpty() {}
+  void MotorEnable(bool on) {}
+  void Shutdown(bool flush_queue) {}
+  int GetPendingElements(uint32_t *head_item_progress) { return 0; }
+  void GetQueueStats(MotionQueueStats *stats) {
+    *stats = {};
+    stats->capacity = 1000;
+  }
+
+  std::vector<MotionSegment> segments;
+};
+
+// Motion segments for moves of the first motor, as the planner would
+// create them: "steps" from speed v0 to v1 each, in steps/s.
+static std::vector<MotionSegment> CreateSegments(
+  const std::vector<LinearSegmentSteps> &moves) {
+  HardwareMapping hw;
+  RecordingMotionQueue backend;
+  MotionQueueMotorOperations motor_operations(&hw, &backend);
+  for (const LinearSegmentSteps &move : moves) {
+    motor_operations.Enqueue(move);
+  }
+  return backend.segments;
+}
+
+// Delays of the first and the last loop of "segment", calculated like in the
+// CalculateDelay macro of motor-interface-pru.p.
+static void FirstAndLastDelay(MotionSegment segment,
+                              double *first, double *last) {
+  uint32_t remainder = 0;
+  bool is_first = true;
+  for (;;) {
+    double delay;
+    if (segment.loops_accel) {
+      if (segment.accel_series_index != 0) {
+        const uint32_t divident = (segment.hires_accel_cycles << 1) + remainder;
+        const uint32_t divisor = (segment.accel_series_index << 2) + 1;
+        segment.hires_accel_cycles -= divident / divisor;
+        remainder = divident % divisor;
+      }
+      ++segment.accel_series_index;
+      --segment.loops_accel;
+      delay = 1.0 * segment.hires_accel_cycles / (1 << DELAY_CYCLE_SHIFT);
+    } else if (segment.loops_travel) {
+      --segment.loops_travel;
+      delay = segment.travel_delay_cycles;
+    } else if (segment.loops_decel) {
+      const uint32_t divident = (segment.hires_accel_cycles << 1) + remainder;
+      const uint32_t divisor = (segment.accel_series_index << 2) - 1;
+      segment.hires_accel_cycles += divident / divisor;
+      remainder = divident % divisor;
+      --segment.accel_series_index;
+      --segment.loops_decel;
+      delay = 1.0 * segment.hires_accel_cycles / (1 << DELAY_CYCLE_SHIFT);
+    } else {
+      return;
+    }
+    if (is_first) *first = delay;
+    is_first = false;
+    *last = delay;
+  }
+}
+
+// Relative change of the delay from the end of segment "a" to the start of
+// segment "b".
+static double SpeedJump(const MotionSegment &a, const MotionSegment &b) {
+  double a_first, a_last, b_first, b_last;
+  FirstAndLastDelay(a, &a_first, &a_last);
+  FirstAndLastDelay(b, &b_first, &b_last);
+  return fabs(b_first - a_last) / a_last;
+}
+
+static const std::vector<LinearSegmentSteps> kMoves = {
+  { 0, 4000, 0, {1000} },       // Accelerate from standstill.
+  { 4000, 4000, 0, {400} },
+  { 4000, 6000, 0, {1200} },
+  { 6000, 6000, 0, {600} },
+  { 6000, 3000, 0, {1000} },
+  { 3000, 3000, 0, {900} },
+  { 3000, 5000, 0, {1000} },
+  { 5000, 5000, 0, {2000} },
+};
+
+// The speed at the segment boundaries stays continuous when slowing down
+// or speeding up the queue, even from the executing segment to the first
+// scaled one.
+TEST(QueuedSpeedScaler, speed_stays_continuous) {
+  for (float factor : { 0.3f, 0.7f, 1.5f }) {
+    const std::vector<MotionSegment> original = CreateSegments(kMoves);
+    std::vector<MotionSegment> scaled = original;
+
+    // The first one is executing.
+    QueuedSpeedScaler scaler(factor);
+    for (size_t i = 1; i < scaled.size(); ++i) scaler.Add(scaled[i]);
+    for (size_t i = 1; i < scaled.size(); ++i) scaler.Scale(&scaled[i]);
+
+    for (size_t i = 1; i < scaled.size(); ++i) {
+      EXPECT_LT(SpeedJump(scaled[i-1], scaled[i]),
+                SpeedJump(original[i-1], original[i]) + 0.01)
+        << "factor=" << factor << " segment=" << i;
+    }
+  }
+}
+
+// After the ramp, segments are scaled uniformly.
+TEST(QueuedSpeedScaler, uniform_after_ramp) {
+  const std::vector<MotionSegment> original = CreateSegments(kMoves);
+  std::vector<MotionSegment> scaled = original;
+
+  QueuedSpeedScaler scaler(0.5);
+  for (size_t i = 1; i < scaled.size(); ++i) scaler.Add(scaled[i]);
+  for (size_t i = 1; i < scaled.size(); ++i) scaler.Scale(&scaled[i]);
+
+  EXPECT_EQ(0, memcmp(&original[0], &scaled[0], sizeof(MotionSegment)));
+
+  // The last segments are after the first 100ms.
+  for (size_t i = scaled.size() - 3; i < scaled.size(); ++i) {
+    MotionSegment expected = original[i];
+    ScaleMotionSegmentSpeed(&expected, 0.5);
+    EXPECT_EQ(0, memcmp(&expected, &scaled[i], sizeof(MotionSegment)))
+      << "segment=" << i;
+  }
+}
+
+// If the queue is shorter than the ramp, the ramp ends with it: the speed at
+// the end of the queue, where the next enqueued segments continue, is scaled.
+TEST(QueuedSpeedScaler, short_queue_ends_at_new_speed) {
+  const std::vector<LinearSegmentSteps> kShortMoves = {
+    { 4000, 4000, 0, {20} },
+    { 4000, 6000, 0, {50} },
+    { 6000, 6000, 0, {30} },
+  };
+  const std::vector<MotionSegment> original = CreateSegments(kShortMoves);
+  std::vector<MotionSegment> scaled = original;
+
+  QueuedSpeedScaler scaler(0.5);
+  for (size_t i = 1; i < scaled.size(); ++i) scaler.Add(scaled[i]);
+  for (size_t i = 1; i < scaled.size(); ++i) scaler.Scale(&scaled[i]);
+
+  EXPECT_LT(SpeedJump(scaled[0], scaled[1]), 0.01);
+  double first, original_last, scaled_last;
+  FirstAndLastDelay(original.back(), &first, &original_last);
+  FirstAndLastDelay(scaled.back(), &first, &scaled_last);
+  EXPECT_NEAR(2.0, scaled_last / original_last, 0.02);
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
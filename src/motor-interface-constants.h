@@ -32,7 +32,31 @@
 #define STATE_EXIT   2   // Filled by host, no parameters; tells PRU to exit.
 #define STATE_ABORT  3   // Filled by PRU when Estop is detected
 
-#define QUEUE_LEN 16
+// Number of slots in the ring buffer between host and PRU. The deeper the
+// queue, the longer host scheduling hiccups are bridged at high step rates.
+// Set at build time with BEAGLEG_QUEUE_LEN in the Makefile. The queue needs
+// to fit into the PRU data RAM, which is checked at compile time.
+#ifndef QUEUE_LEN
+#define QUEUE_LEN 128
+#endif
+
+// Motion segments are stored in the ring buffer in slots of fixed size: the
+// header word (u8 state, u8 direction_bits, u16 reserved) followed by the
+// TravelParameters in motor-interface-pru.p.
+#define QUEUE_ELEMENT_MIN_SIZE (24 + 8 * 4)
+#define QUEUE_ELEMENT_MAX_SIZE QUEUE_ELEMENT_MIN_SIZE
+
+// Size of the ring buffer in bytes.
+#define QUEUE_SIZE (QUEUE_LEN * QUEUE_ELEMENT_MAX_SIZE)
+
+// Size of the PRU data RAM that holds the status register and the queue.
+#define PRU_DATA_RAM_SIZE 8192
+
+// The status register has the remaining loops of the current element in the
+// lower bits and its position in the ring buffer in the bits above this
+// shift. The loop count is less than 2^18 as an element has 3 * 16 bit loops
+// at most.
+#define QUEUE_STATUS_INDEX_SHIFT 24  // Position is the slot number.
 
 // In calculation of delay cycles: number of bits shifted
 // for higher resolution.
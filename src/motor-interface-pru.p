@@ -28,7 +28,9 @@
 #define CONST_PRUDRAM	   C24
 
 #define QUEUE_ELEMENT_SIZE (SIZE(QueueHeader) + SIZE(TravelParameters))
-#define QUEUE_OFFSET 4
+// Status of an element the host holds back, followed by the queue.
+#define HOLD_OFFSET 4
+#define QUEUE_OFFSET 8
 
 #define PARAM_START r7
 #define PARAM_END  r19
@@ -63,6 +65,7 @@
 .struct QueueHeader
 	.u8 state
 	.u8 direction_bits
+	.u16 reserved		 // Padding: elements are 32 bit aligned.
 .ends
 
 ;; counter states of the motors
@@ -187,15 +190,24 @@ INIT:
 
 	MOV r2, QUEUE_OFFSET ; Queue address in PRU memory
 	MOV r28, 0           ; Status register in PRU memory,
-	                     ; r28.b3 for current queue position,
-	                     ; bottom three for the remaining steps of the current slot.
+	                     ; bits from QUEUE_STATUS_INDEX_SHIFT up for current
+	                     ; queue position, bits below for the remaining
+	                     ; steps of the current slot.
 QUEUE_READ:
 	;;
 	;; Read next element from ring-buffer
 	;;
 
+	;; Tell the host which element we're about to pick up: the status
+	;; register has its index and no loops left. Only then check if the
+	;; host holds it back to rewrite it; see PRUMotionQueue::HoldElement().
+	MOV r0, 0
+	SBCO r28, CONST_PRUDRAM, r0, 4
+	LBCO r1, CONST_PRUDRAM, HOLD_OFFSET, 4
+	QBEQ QUEUE_READ, r1, r28
+
 	;; Check queue header at our read-position until it contains something.
-	.assign QueueHeader, r1.w0, r1.w0, queue_header
+	.assign QueueHeader, r1, r1, queue_header
 	LBCO queue_header, CONST_PRUDRAM, r2, SIZE(queue_header)
 	QBEQ QUEUE_READ, queue_header.state, STATE_EMPTY ; wait until got data.
 	QBEQ QUEUE_READ, queue_header.state, STATE_ABORT
@@ -220,9 +232,9 @@ QUEUE_READ:
 
 	;; STATUS REGISTER
 	;; ! We are assuming that writing the 4 bytes status register is atomic
-	;; and we guarantee that the bottom three bytes are all zero so we just need
+	;; and we guarantee that the counter bits are all zero so we just need
 	;; to sum up the 3 loop counters. The upper bound of this sum will always be
-	;; less than 2^18, thus fit in the lower 24 bits allocated for it.
+	;; less than 2^18, thus fit in the QUEUE_STATUS_INDEX_SHIFT bits allocated.
 	;; At each loop executed this counter is decreased of one unit.
 	ADD r28, r28, travel_params.loops_accel
 	ADD r28, r28, travel_params.loops_travel
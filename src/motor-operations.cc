@@ -27,7 +27,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
-#include <deque>
 
 #include "common/logging.h"
 
@@ -45,6 +44,9 @@
 // accumulate too much error.
 #define MAX_STEPS_PER_SEGMENT (65535 / LOOPS_PER_STEP)
 
+// Maximum number of motion segments we hand to the backend in one batch.
+#define MOTION_SEGMENT_BATCH_SIZE 16
+
 // TODO: don't store this singleton like, but keep in user_data of the MotorOperations
 static float hardware_frequency_limit_ = 1e6;    // Don't go over 1 Mhz
 
@@ -57,13 +59,45 @@ static float clip_hardware_frequency_limit(float v) {
   return v < hardware_frequency_limit_ ? v : hardware_frequency_limit_;
 }
 
+// Below this index, we look up the terms of the acceleration series
+// sqrt(index + 1) - sqrt(index) in a table. Above, we use the approximation
+// 1 / (2 * sqrt(index + 1/2)), which has a relative error below 1e-7 there.
+#define ACCEL_SERIES_TABLE_SIZE 1024
+
+namespace {
+class AccelerationSeriesTable {
+public:
+  AccelerationSeriesTable() {
+    for (int i = 0; i < ACCEL_SERIES_TABLE_SIZE; ++i) {
+      // Calculated in double: in float, the difference looses most of its
+      // precision with increasing index.
+      term_[i] = sqrt(i + 1.0) - sqrt(i);
+    }
+    // The approximation is pretty far off in the first step; adjust.
+    term_[0] *= 0.67605f;
+  }
+
+  float term(int index) const { return term_[index]; }
+
+private:
+  float term_[ACCEL_SERIES_TABLE_SIZE];
+};
+}  // namespace
+
+static const AccelerationSeriesTable accel_series_table;
+
+// Delay cycles of step "index" in the acceleration series for the given
+// acceleration in steps/s^2.
 static float calcAccelerationCurveValueAt(int index, float acceleration) {
-  // counter_freq * sqrt(2 / accleration)
-  const float accel_factor = TIMER_FREQUENCY
-    * (sqrtf(LOOPS_PER_STEP * 2.0f / acceleration)) / LOOPS_PER_STEP;
-  // The approximation is pretty far off in the first step; adjust.
-  const float c0 = (index == 0) ? accel_factor * 0.67605f : accel_factor;
-  return c0 * (sqrtf(index + 1) - sqrtf(index));
+  if (index < ACCEL_SERIES_TABLE_SIZE) {
+    // counter_freq * sqrt(2 / accleration)
+    const float accel_factor = TIMER_FREQUENCY
+      * (sqrtf(LOOPS_PER_STEP * 2.0f / acceleration)) / LOOPS_PER_STEP;
+    return accel_factor * accel_series_table.term(index);
+  }
+  // Acceleration factor and series term combined in a single square root.
+  return (float) TIMER_FREQUENCY / LOOPS_PER_STEP
+    * sqrtf(LOOPS_PER_STEP / (2.0f * acceleration * (index + 0.5f)));
 }
 
 #if 0
@@ -102,22 +136,153 @@ struct MotionQueueMotorOperations::HistorySegment {
   unsigned short aux_bits;
 };
 
+// History of the segments sent to the backend, newest first. It only needs
+// to be as long as the backend queue, so it is a ring buffer allocated once
+// with that capacity; older elements are overwritten.
+class MotionQueueMotorOperations::HistoryRing {
+public:
+  explicit HistoryRing(int capacity)
+    : capacity_(capacity), buffer_(new HistorySegment[capacity]),
+      newest_(0), size_(1) {
+    buffer_[0] = {};   // Initial position.
+  }
+  ~HistoryRing() { delete [] buffer_; }
+
+  void push_front(const HistorySegment &segment) {
+    newest_ = (newest_ + 1) % capacity_;
+    buffer_[newest_] = segment;
+    if (size_ < capacity_) ++size_;
+  }
+
+  const HistorySegment &front() const { return buffer_[newest_]; }
+
+  // Return element "age" positions before the newest. Clamps to the oldest
+  // one we have.
+  const HistorySegment &at_age(int age) const {
+    if (age >= size_) age = size_ - 1;
+    if (age < 0) age = 0;
+    return buffer_[(newest_ + capacity_ - age) % capacity_];
+  }
+
+private:
+  const int capacity_;
+  HistorySegment *const buffer_;
+  int newest_;
+  int size_;
+};
+
+static int GetQueueCapacity(MotionQueue *backend) {
+  MotionQueueStats stats;
+  backend->GetQueueStats(&stats);
+  return stats.capacity > 0 ? stats.capacity : 1;
+}
+
+// The history covers the backend queue and the segments held back. One more:
+// SetExternalPosition() adds an element that is not sent to the backend.
 MotionQueueMotorOperations::
 MotionQueueMotorOperations(HardwareMapping *hw, MotionQueue *backend)
   : hardware_mapping_(hw),
     backend_(backend),
-    shadow_queue_(new std::deque<struct HistorySegment>()) {
-  // Initialize the history queue.
-  shadow_queue_->push_front({});
+    max_held_back_(GetQueueCapacity(backend)),
+    non_blocking_(false),
+    held_back_(new std::vector<MotionSegment>()),
+    held_back_aborted_(false),
+    shadow_queue_(new HistoryRing(2 * max_held_back_ + 1)) {
+  held_back_->reserve(max_held_back_);
 }
 
 MotionQueueMotorOperations::~MotionQueueMotorOperations() {
   delete shadow_queue_;
+  delete held_back_;
 }
 
-bool MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
-                                                 int defining_axis_steps) {
-  struct MotionSegment new_element = {};
+// Hand segments to the backend. In non-blocking mode, the ones that don't
+// fit into its queue right now are held back. Returns false if aborted.
+bool MotionQueueMotorOperations::SendToBackend(MotionSegment *segments,
+                                               int count) {
+  if (held_back_aborted_) {
+    held_back_aborted_ = false;
+    return false;
+  }
+  if (!non_blocking_)
+    return backend_->EnqueueBatch(segments, count);
+
+  int sent = 0;
+  if (held_back_->empty()) {
+    sent = backend_->TryEnqueueBatch(segments, count);
+    if (sent < 0) return false;
+  }
+  for (int i = sent; i < count; ++i) {
+    if ((int) held_back_->size() == max_held_back_ && !FlushHeldBack())
+      return false;
+    held_back_->push_back(segments[i]);
+  }
+  return true;
+}
+
+bool MotionQueueMotorOperations::SendHeldBack() {
+  if (held_back_->empty()) return true;
+  const int sent = backend_->TryEnqueueBatch(held_back_->data(),
+                                             held_back_->size());
+  if (sent < 0) {
+    // Nothing after the aborted segment is executed. The next Enqueue()
+    // reports the abort.
+    held_back_->clear();
+    held_back_aborted_ = true;
+    return true;
+  }
+  held_back_->erase(held_back_->begin(), held_back_->begin() + sent);
+  return held_back_->empty();
+}
+
+// Wait until all held back segments are in the backend queue. Returns false
+// if aborted.
+bool MotionQueueMotorOperations::FlushHeldBack() {
+  if (held_back_->empty()) return true;
+  const bool ret = backend_->EnqueueBatch(held_back_->data(),
+                                          held_back_->size());
+  held_back_->clear();
+  return ret;
+}
+
+// Collects motion segments to be handed to the backend together.
+class MotionQueueMotorOperations::SegmentBatch {
+public:
+  explicit SegmentBatch(MotionQueueMotorOperations *ops)
+    : ops_(ops), count_(0), has_move_(false) {}
+
+  // Add segment, sending the batch on if it is full.
+  // Returns false if aborted.
+  bool Add(const MotionSegment &segment, bool is_move) {
+    segments_[count_++] = segment;
+    has_move_ |= is_move;
+    return count_ < MOTION_SEGMENT_BATCH_SIZE || Flush();
+  }
+
+  // Send all collected segments to the backend. Returns false if aborted.
+  bool Flush() {
+    if (count_ == 0) return true;
+    if (has_move_) ops_->backend_->MotorEnable(true);
+    const int count = count_;
+    count_ = 0;
+    has_move_ = false;
+    return ops_->SendToBackend(segments_, count);
+  }
+
+private:
+  MotionQueueMotorOperations *const ops_;
+  MotionSegment segments_[MOTION_SEGMENT_BATCH_SIZE];
+  int count_;
+  bool has_move_;
+};
+
+// Set up "out" for the steps of all motors in "param", and remember the new
+// position. The speed profile is left to the caller.
+void MotionQueueMotorOperations::FillMotionSteps(const LinearSegmentSteps &param,
+                                                 int defining_axis_steps,
+                                                 struct MotionSegment *out) {
+  struct MotionSegment &new_element = *out;
+  new_element = {};
   new_element.direction_bits = 0;
 
   // The new segment is based on the previous position.
@@ -148,64 +313,66 @@ bool MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param
   history_segment.aux_bits = param.aux_bits;
   shadow_queue_->push_front(history_segment);
 
+  new_element.aux = param.aux_bits;
+  new_element.state = STATE_FILLED;
+}
+
+// Travel "total_loops" with constant speed "v" in steps/s.
+static void SetTravelProfile(float v, int total_loops,
+                             struct MotionSegment *out) {
+  out->loops_travel = total_loops;
+  const float travel_speed = clip_hardware_frequency_limit(v);
+  out->travel_delay_cycles = round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * travel_speed));
+}
+
+// Accelerate or decelerate "total_loops" with "acceleration" in steps/s^2,
+// starting at "accel_series_index" in the acceleration series; that is the
+// number of loops it takes to accelerate from zero to the start speed.
+static void SetAccelerationProfile(bool accelerate, float acceleration,
+                                   int accel_series_index, int total_loops,
+                                   struct MotionSegment *out) {
+  if (accelerate)
+    out->loops_accel = total_loops;
+  else
+    out->loops_decel = total_loops;
+  out->accel_series_index = accel_series_index;
+  out->hires_accel_cycles =
+    round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(accel_series_index, acceleration));
+}
+
+void MotionQueueMotorOperations::FillMotionSegment(const LinearSegmentSteps &param,
+                                                   int defining_axis_steps,
+                                                   struct MotionSegment *out) {
+  FillMotionSteps(param, defining_axis_steps, out);
+
   // TODO: clamp acceleration to be a minimum value.
   const int total_loops = LOOPS_PER_STEP * defining_axis_steps;
   // There are three cases: either we accelerate, travel or decelerate.
   if (param.v0 == param.v1) {
-    // Travel
-    new_element.loops_accel = new_element.loops_decel = 0;
-    new_element.loops_travel = total_loops;
-    const float travel_speed = clip_hardware_frequency_limit(param.v0);
-    new_element.travel_delay_cycles = round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * travel_speed));
-  } else if (param.v0 < param.v1) {
-    // acclereate
-    new_element.loops_travel = new_element.loops_decel = new_element.travel_delay_cycles = 0;
-    new_element.loops_accel = total_loops;
-
+    SetTravelProfile(param.v0, total_loops, out);
+  } else {
     // v1 = v0 + a*t -> t = (v1 - v0)/a
     // s = a/2 * t^2 + v0 * t; subsitution t from above.
     // a = (v1^2-v0^2)/(2*s)
-    float acceleration = (sq(param.v1) - sq(param.v0)) / (2.0f * defining_axis_steps);
-    //fprintf(stderr, "M-OP HZ: defining=%d ; accel=%.2f\n", defining_axis_steps, acceleration);
+    const float acceleration = fabsf(sq(param.v1) - sq(param.v0)) / (2.0f * defining_axis_steps);
     // If we accelerated from zero to our first speed, this is how many steps
-    // we needed. We need to go this index into our taylor series.
+    // we needed. We need to go this index into our taylor series; when
+    // decelerating, we reduce from there.
     const int accel_loops_from_zero =
       round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
-
-    new_element.accel_series_index = accel_loops_from_zero;
-    new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
-  } else {  // v0 > v1
-    // decelerate
-    new_element.loops_travel = new_element.loops_accel = new_element.travel_delay_cycles = 0;
-    new_element.loops_decel = total_loops;
-
-    float acceleration = (sq(param.v0) - sq(param.v1)) / (2.0f * defining_axis_steps);
-    //fprintf(stderr, "M-OP HZ: defining=%d ; decel=%.2f\n", defining_axis_steps, acceleration);
-    // We are into the taylor sequence this value up and reduce from there.
-    const int accel_loops_from_zero =
-      round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
-
-    new_element.accel_series_index = accel_loops_from_zero;
-    new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
+    SetAccelerationProfile(param.v0 < param.v1, acceleration,
+                           accel_loops_from_zero, total_loops, out);
   }
-
-  new_element.aux = param.aux_bits;
-  new_element.state = STATE_FILLED;
-  backend_->MotorEnable(true);
-  return backend_->Enqueue(&new_element);
+  out->ends_in_motion = param.v1 > 0;
 }
 
 bool MotionQueueMotorOperations::GetPhysicalStatus(PhysicalStatus *status) {
-  // Shrink the queue
+  // The element currently executed is the oldest one still in the queue.
+  // The held back ones are the newest.
   uint32_t loops;
-  const int buffer_size = backend_->GetPendingElements(&loops);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
-
-  // Get the last element
-  const HistorySegment &hs = shadow_queue_->back();
+  const int buffer_size = (backend_->GetPendingElements(&loops)
+                           + held_back_->size());
+  const HistorySegment &hs = shadow_queue_->at_age(buffer_size - 1);
   const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
 
   // NOTE: Assuming MOTION_MOTOR_COUNT == BEAGLEG_NUM_MOTORS
@@ -233,13 +400,26 @@ void MotionQueueMotorOperations::SetExternalPosition(int axis, int steps) {
     history_segment.pos_info[axis].position_steps = steps;
   }
   shadow_queue_->push_front(history_segment);
-  // Shrink the queue and remove the elements that we are not interested
-  // in anymore.
-  // TODO: We need to find a way to get the maximum number of elements
-  // of the shadow queue (ie backend_->GetQueueStats()?)
-  const int buffer_size = backend_->GetPendingElements(NULL);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
+}
+
+bool MotionQueueMotorOperations::ScaleQueuedSpeed(float factor) {
+  // The held back segments continue where the backend queue ends, so the
+  // speed ramp covers them as well.
+  QueuedSpeedScaler scaler(factor);
+  for (const MotionSegment &segment : *held_back_) {
+    scaler.Add(segment);
+  }
+  if (!backend_->ScaleQueuedSpeed(&scaler))
+    return false;
+  for (MotionSegment &segment : *held_back_) {
+    scaler.Scale(&segment);
+  }
+  return true;
+}
+
+bool MotionQueueMotorOperations::GetQueueStats(MotionQueueStats *stats) {
+  backend_->GetQueueStats(stats);
+  return true;
 }
 
 static int get_defining_axis_steps(const LinearSegmentSteps &param) {
@@ -252,8 +432,10 @@ static int get_defining_axis_steps(const LinearSegmentSteps &param) {
   return defining_axis_steps;
 }
 
-bool MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
+bool MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
+                                                 SegmentBatch *batch) {
   const int defining_axis_steps = get_defining_axis_steps(param);
+  struct MotionSegment new_element;
   bool ret;
 
   if (defining_axis_steps == 0) {
@@ -268,65 +450,81 @@ bool MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
     history_segment.aux_bits = param.aux_bits;
     shadow_queue_->push_front(history_segment);
 
-    ret = backend_->Enqueue(&empty_element);
+    ret = batch->Add(empty_element, false);
   }
   else if (defining_axis_steps > MAX_STEPS_PER_SEGMENT) {
     // We have more steps that we can enqueue in one chunk, so let's cut
-    // it in pieces.
-    const double a = (sqd(param.v1) - sqd(param.v0))/(2.0*defining_axis_steps);
+    // it in pieces. All pieces have the same acceleration, so each continues
+    // in the acceleration series where the previous stopped: the speeds at
+    // the boundaries follow from the loops done so far without calculating
+    // them, and the last piece ends exactly at the final speed.
     const int divisions = (defining_axis_steps / MAX_STEPS_PER_SEGMENT) + 1;
-    int64_t hires_steps_per_div[BEAGLEG_NUM_MOTORS];
-    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
-      // (+1 to fix rounding trouble in the LSB)
-      hires_steps_per_div[i] = ((int64_t)param.steps[i] << 32)/divisions + 1;
-    }
-
-    struct LinearSegmentSteps previous = {}, accumulator = {}, output;
-    int64_t hires_step_accumulator[BEAGLEG_NUM_MOTORS] = {0};
-    double previous_speed = param.v0;   // speed calculation in double
+    const bool accelerate = param.v1 > param.v0;
+    // These squared values can get huge, lets not loose precision here.
+    const double v0squared = sqd(param.v0);
+    const double a = fabs(sqd(param.v1) - v0squared) / (2.0*defining_axis_steps);
+    const double start_index = (a > 0) ? LOOPS_PER_STEP * v0squared / (2.0*a) : 0;
 
+    struct LinearSegmentSteps output = {};
     output.aux_bits = param.aux_bits;  // use the original Aux bits for all segments
-    for (int d = 0; d < divisions; ++d) {
+    int position[BEAGLEG_NUM_MOTORS] = {0};
+    int previous_boundary = 0;
+    for (int d = 1; d <= divisions; ++d) {
+      // The defining axis is cut in equal pieces, the other axes in
+      // proportion. Rounding both towards zero, no other axis gets more
+      // steps in a piece than the defining axis. The last boundary is
+      // exactly the end, so the total number of steps is preserved.
+      const int boundary = (int64_t) defining_axis_steps * d / divisions;
       for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
-        hires_step_accumulator[i] += hires_steps_per_div[i];
-        accumulator.steps[i] = hires_step_accumulator[i] >> 32;
-        output.steps[i] = accumulator.steps[i] - previous.steps[i];
+        const int target = (int64_t) param.steps[i] * boundary / defining_axis_steps;
+        output.steps[i] = target - position[i];
+        position[i] = target;
+      }
+      const int division_steps = boundary - previous_boundary;
+      FillMotionSteps(output, division_steps, &new_element);
+      const int total_loops = LOOPS_PER_STEP * division_steps;
+      if (param.v0 == param.v1) {
+        SetTravelProfile(param.v0, total_loops, &new_element);
+      } else {
+        const double loops_done = LOOPS_PER_STEP * (double) previous_boundary;
+        const int index = (int) round(accelerate
+                                      ? start_index + loops_done
+                                      : start_index - loops_done);
+        SetAccelerationProfile(accelerate, a, index, total_loops, &new_element);
       }
-      const int division_steps = get_defining_axis_steps(output);
-      // These squared values can get huge, lets not loose precision
-      // here and do calculations in double (otherwise our results can
-      // be a little bit off and fail to reach zero properly).
-      const double v0squared = sqd(previous_speed);
-      // v1 = v0 + a*t; t = (sqrt(v0^2 + 2 * a * steps) - v0) / a
-      // -> v1 = sqrt(v0^ + 2 * a * steps)
-      const double v1squared = v0squared + 2.0 * a * division_steps;
-      // Rounding errors can make v1squared slightly negative...
-      const double v1 = v1squared > 0.0 ? sqrt(v1squared) : 0;
-      output.v0 = previous_speed;
-      output.v1 = v1;
-      ret = EnqueueInternal(output, division_steps);
+      // Only the last piece can come to a stop.
+      new_element.ends_in_motion = (d < divisions) || param.v1 > 0;
+      ret = batch->Add(new_element, true);
       if (!ret) break;
-      previous = accumulator;
-      previous_speed = v1;
+      previous_boundary = boundary;
     }
   } else {
-    ret = EnqueueInternal(param, defining_axis_steps);
+    FillMotionSegment(param, defining_axis_steps, &new_element);
+    ret = batch->Add(new_element, true);
   }
-  // Shrink the queue and remove the elements that we are not interested
-  // in anymore.
-  // TODO: We need to find a way to get the maximum number of elements
-  // of the shadow queue (ie backend_->GetQueueStats()?)
-  const int buffer_size = backend_->GetPendingElements(NULL);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
   return ret;
 }
 
+bool MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
+  return EnqueueBatch(&param, 1);
+}
+
+bool MotionQueueMotorOperations::EnqueueBatch(const LinearSegmentSteps *segments,
+                                              int count) {
+  SegmentBatch batch(this);
+  for (int i = 0; i < count; ++i) {
+    if (!EnqueueInternal(segments[i], &batch))
+      return false;
+  }
+  return batch.Flush();
+}
+
 void MotionQueueMotorOperations::MotorEnable(bool on) {
-  backend_->WaitQueueEmpty();
+  WaitQueueEmpty();
   backend_->MotorEnable(on);
 }
 
 void MotionQueueMotorOperations::WaitQueueEmpty() {
+  if (!FlushHeldBack()) held_back_aborted_ = true;
   backend_->WaitQueueEmpty();
 }
@@ -20,9 +20,12 @@
 #define _BEAGLEG_MOTOR_OPERATIONS_H_
 
 #include <stdio.h>
-#include <deque>
+
+#include <vector>
 
 class MotionQueue;
+struct MotionQueueStats;
+struct MotionSegment;
 
 enum {
   BEAGLEG_NUM_MOTORS = 8
@@ -34,8 +37,9 @@ struct LinearSegmentSteps {
   // Speed is steps/s. If initial speed and final speed differ, the motor will
   // accelerate or decelerate to reach the final speed within the given number of
   // alotted steps of the axis with the most number of steps; all other axes are
-  // scaled accordingly. Uses jerk-settings to increase/decrease acceleration;
-  // the acceleration is zero at the end of the move.
+  // scaled accordingly. The acceleration is constant within the segment;
+  // jerk limited speed changes are broken into several segments by the
+  // planner.
   float v0;     // initial speed
   float v1;     // final speed
 
@@ -65,6 +69,17 @@ public:
   // Returns true if the move was added, false if aborted
   virtual bool Enqueue(const LinearSegmentSteps &segment) = 0;
 
+  // Enqueue "count" segments in one go. Same as calling Enqueue() for each
+  // of them, but implementations can pass them on to the hardware with less
+  // overhead.
+  // Returns true if all moves were added, false if aborted.
+  virtual bool EnqueueBatch(const LinearSegmentSteps *segments, int count) {
+    for (int i = 0; i < count; ++i) {
+      if (!Enqueue(segments[i])) return false;
+    }
+    return true;
+  }
+
   // Waits for the queue to be empty and Enables/disables motors according to the
   // given boolean value (Right now, motors cannot be individually addressed).
   virtual void MotorEnable(bool on) = 0;
@@ -78,6 +93,17 @@ public:
   virtual bool GetPhysicalStatus(PhysicalStatus *status) = 0;
 
   virtual void SetExternalPosition(int axis, int steps) = 0;
+
+  // Change the speed of the segments that are already enqueued, but not
+  // executed yet, by the given factor. Used for real-time speed overrides.
+  // Returns true if the speed at the end of the queue, where the next
+  // enqueued segment continues, is scaled as well. The default
+  // implementation can't change anything once enqueued.
+  virtual bool ScaleQueuedSpeed(float factor) { return false; }
+
+  // Get the statistics of the motion queue, e.g. underruns.
+  // Returns 'true' if the statistics were available and are updated.
+  virtual bool GetQueueStats(MotionQueueStats *stats) { return false; }
 };
 
 class HardwareMapping;
@@ -88,20 +114,47 @@ public:
   ~MotionQueueMotorOperations() override;
 
   bool Enqueue(const LinearSegmentSteps &segment) final;
+  bool EnqueueBatch(const LinearSegmentSteps *segments, int count) final;
   void MotorEnable(bool on) final;
   void WaitQueueEmpty() final;
   bool GetPhysicalStatus(PhysicalStatus *status) final;
   void SetExternalPosition(int axis, int pos) final;
+  bool ScaleQueuedSpeed(float factor) final;
+  bool GetQueueStats(MotionQueueStats *stats) final;
+
+  // If "on", Enqueue() does not wait if the backend queue is full: up to a
+  // queue length of segments are held back instead, to be sent with
+  // SendHeldBack(). Only if there are even more, Enqueue() waits.
+  // Everything waiting for the queue sends the held back segments first.
+  // Useful with a backend that has an EventFd() telling when to try again.
+  void SetNonBlocking(bool on) { non_blocking_ = on; }
+
+  // Send the held back segments, as many as fit into the backend queue
+  // without waiting. Returns true if there are none left.
+  bool SendHeldBack();
 
 private:
+  class SegmentBatch;
   bool EnqueueInternal(const LinearSegmentSteps &param,
-                       int defining_axis_steps);
+                       SegmentBatch *batch);
+  bool SendToBackend(MotionSegment *segments, int count);
+  bool FlushHeldBack();
+  void FillMotionSteps(const LinearSegmentSteps &param,
+                       int defining_axis_steps, struct MotionSegment *out);
+  void FillMotionSegment(const LinearSegmentSteps &param,
+                         int defining_axis_steps, struct MotionSegment *out);
 
   HardwareMapping *const hardware_mapping_;
   MotionQueue *backend_;
+  const int max_held_back_;
+
+  bool non_blocking_;
+  std::vector<MotionSegment> *const held_back_;  // Not in the backend yet.
+  bool held_back_aborted_;  // Abort while sending held back segments.
 
   struct HistorySegment;
-  std::deque<struct HistorySegment> *shadow_queue_;
+  class HistoryRing;
+  HistoryRing *const shadow_queue_;
 };
 
 #endif  // _BEAGLEG_MOTOR_OPERATIONS_H_
@@ -7,9 +7,13 @@
  */
 #include "motion-queue.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
@@ -17,15 +21,20 @@
 #include "common/logging.h"
 #include "hardware-mapping.h"
 #include "motor-operations.h"
+#include "motor-interface-constants.h"
 
 class MockMotionQueue : public MotionQueue {
 public:
-  MockMotionQueue() : remaining_loops_(0), queue_size_(0) {}
+  MockMotionQueue(unsigned int capacity = 16)
+    : remaining_loops_(0), queue_size_(0), capacity_(capacity) {}
 
+  // If the queue is full, we assume the oldest element is executed in the
+  // meantime.
   bool Enqueue(MotionSegment *segment) {
+    last_segment_ = *segment;
     remaining_loops_ = segment->loops_accel
       + segment->loops_travel + segment->loops_decel;
-    queue_size_++;
+    if (queue_size_ < capacity_) queue_size_++;
     return true;
   }
 
@@ -37,6 +46,13 @@ public:
         *head_item_progress = remaining_loops_;
       return queue_size_;
   }
+  void GetQueueStats(MotionQueueStats *stats) {
+    *stats = {};
+    stats->capacity = capacity_;
+    stats->pending = queue_size_;
+  }
+
+  const MotionSegment &last_segment() const { return last_segment_; }
 
   void SimRun(const uint32_t executed_loops, const unsigned int buffer_size) {
     assert(buffer_size <= queue_size_);
@@ -49,6 +65,8 @@ public:
 private:
   uint32_t remaining_loops_;
   unsigned int queue_size_;
+  const unsigned int capacity_;
+  MotionSegment last_segment_;
 };
 
 // Check that on init, the initial position is 0.
@@ -205,6 +223,269 @@ TEST(RealtimePosition, zero_loops_edge) {
   EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
 }
 
+// The history only keeps as many elements as the backend queue can hold,
+// and older elements are overwritten. Make sure that we still find the
+// right one after many more segments than that went through.
+TEST(RealtimePosition, history_wraps_around) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend(4);
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps kSegment = {
+    0 /* v0 */, 0 /* v1 */, 0 /* aux */,
+    {100, -10, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  for (int i = 0; i < 23; ++i) {
+    motor_operations.Enqueue(kSegment);
+  }
+
+  // Three elements in the queue. The oldest (the 21st) is executing and
+  // has half of its 200 loops left.
+  motion_backend.SimRun(100, 3);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  const int expected[BEAGLEG_NUM_MOTORS] = {2050, -205, 0, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
+
+  motion_backend.SimRun(0, 0);
+  motor_operations.GetPhysicalStatus(&status);
+  const int expected_end[BEAGLEG_NUM_MOTORS] = {2300, -230, 0, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected_end, ::testing::ContainerEq(status.pos_steps));
+}
+
+// The queue needs to know if the motors still move after a segment to
+// detect underruns.
+TEST(MotionSegment, ends_in_motion) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps kAccelerate = {
+    0 /* v0 */, 1000 /* v1 */, 0 /* aux */, {100, 0, 0, 0, 0, 0, 0, 0}
+  };
+  motor_operations.Enqueue(kAccelerate);
+  EXPECT_TRUE(motion_backend.last_segment().ends_in_motion);
+
+  const LinearSegmentSteps kStop = {
+    1000 /* v0 */, 0 /* v1 */, 0 /* aux */, {100, 0, 0, 0, 0, 0, 0, 0}
+  };
+  motor_operations.Enqueue(kStop);
+  EXPECT_FALSE(motion_backend.last_segment().ends_in_motion);
+
+  // Long segments are split; only the last part comes to a stop.
+  const LinearSegmentSteps kLongStop = {
+    10000 /* v0 */, 0 /* v1 */, 0 /* aux */, {1000000, 0, 0, 0, 0, 0, 0, 0}
+  };
+  motor_operations.Enqueue(kLongStop);
+  EXPECT_FALSE(motion_backend.last_segment().ends_in_motion);
+}
+
+// Long segments are split into several motion segments. Check that the
+// pieces add up to exactly the original move, as the hardware would execute
+// it, and that the speed continues seamlessly from piece to piece.
+class RecordingMotionQueue : public MockMotionQueue {
+public:
+  bool Enqueue(MotionSegment *segment) {
+    segments.push_back(*segment);
+    return MockMotionQueue::Enqueue(segment);
+  }
+  std::vector<MotionSegment> segments;
+};
+
+// Number of steps the hardware creates for "motor": like the PRU, it adds
+// the fraction once per loop plus once at the end; the top bit is the step.
+static int HardwareSteps(const MotionSegment &segment, int motor) {
+  const int loops = segment.loops_accel + segment.loops_travel
+    + segment.loops_decel;
+  uint32_t state = 0;
+  int steps = 0;
+  for (int i = 0; i <= loops; ++i) {
+    const uint32_t before = state;
+    state += segment.fractions[motor];
+    if (~before & state & 0x80000000) ++steps;
+  }
+  return steps;
+}
+
+TEST(MotionSegment, split_million_steps) {
+  const int kLoopsPerStep = 2;
+  const LinearSegmentSteps kMoves[] = {
+    { 1000, 50000, 0, {1000000, -333333, 999999, 7, 0, 0, 0, 0} },
+    { 50000, 0, 0, {-1234567, 1000001, 0, 0, 0, 0, 0, 1} },
+    { 0, 20000, 0, {1000000, 0, 0, 0, 0, 0, 0, 0} },
+    { 30000, 30000, 0, {2000003, 1999999, -65536, 0, 0, 0, 0, 0} },
+  };
+  for (const LinearSegmentSteps &move : kMoves) {
+    HardwareMapping hw;
+    RecordingMotionQueue motion_backend;
+    MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+    ASSERT_TRUE(motor_operations.Enqueue(move));
+    const std::vector<MotionSegment> &segments = motion_backend.segments;
+    ASSERT_GT(segments.size(), 1u);
+
+    int defining_steps = 0;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      int steps = 0;
+      for (const MotionSegment &segment : segments) {
+        const bool reverse = segment.direction_bits & (1 << m);
+        steps += (reverse ? -1 : 1) * HardwareSteps(segment, m);
+      }
+      EXPECT_EQ(move.steps[m], steps) << "motor " << m;
+      defining_steps = std::max(defining_steps, abs(move.steps[m]));
+    }
+
+    // Pieces continue where the previous stopped in the acceleration series.
+    for (size_t i = 0; i < segments.size(); ++i) {
+      const MotionSegment &s = segments[i];
+      EXPECT_EQ(i + 1 < segments.size() || move.v1 > 0, s.ends_in_motion);
+      if (move.v0 == move.v1) {
+        EXPECT_GT(s.loops_travel, 0);
+        continue;
+      }
+      if (i == 0) continue;
+      const MotionSegment &prev = segments[i - 1];
+      if (move.v1 > move.v0) {
+        EXPECT_EQ(prev.accel_series_index + prev.loops_accel,
+                  s.accel_series_index);
+      } else {
+        EXPECT_EQ(prev.accel_series_index - prev.loops_decel,
+                  s.accel_series_index);
+      }
+    }
+
+    // ... and end up at the final speed: that is where the series would be
+    // if we accelerated from zero to v1.
+    if (move.v0 != move.v1) {
+      const double a = fabs((double)move.v1 * move.v1
+                            - (double)move.v0 * move.v0) / (2.0 * defining_steps);
+      const MotionSegment &last = segments.back();
+      const int end_index = (move.v1 > move.v0)
+        ? last.accel_series_index + last.loops_accel
+        : last.accel_series_index - last.loops_decel;
+      EXPECT_NEAR(kLoopsPerStep * (double)move.v1 * move.v1 / (2 * a),
+                  end_index, 1.0);
+    }
+  }
+}
+
+// The delay cycles of the acceleration series are looked up in a table
+// or approximated. Check them against the formula they are derived from.
+TEST(AccelerationCurve, precalculated_values_match_formula) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const int kLoopsPerStep = 2;
+  for (float v0 = 0; v0 < 200000; v0 = 1.7 * v0 + 10) {
+    for (int steps = 1; steps < 30000; steps *= 7) {
+      // Accelerate and decelerate between v0 and v1.
+      const float v1 = 1.5 * v0 + 100;
+      for (bool accelerate : { true, false }) {
+        LinearSegmentSteps segment = {
+          accelerate ? v0 : v1, accelerate ? v1 : v0, 0 /* aux */,
+          {steps, 0, 0, 0, 0, 0, 0, 0} /* steps */
+        };
+        motor_operations.Enqueue(segment);
+        const MotionSegment &result = motion_backend.last_segment();
+
+        const double a = ((double)v1 * v1 - (double)v0 * v0) / (2.0 * steps);
+        const int index = result.accel_series_index;
+        const double accel_factor = TIMER_FREQUENCY
+          * sqrt(kLoopsPerStep * 2.0 / a) / kLoopsPerStep;
+        const double c0 = (index == 0) ? accel_factor * 0.67605 : accel_factor;
+        const double expected = (1 << DELAY_CYCLE_SHIFT)
+          * c0 * (sqrt(index + 1.0) - sqrt(index));
+        if (expected > INT32_MAX) continue;  // Too slow acceleration.
+        // Integer rounding of the result and float precision.
+        EXPECT_NEAR(expected, result.hires_accel_cycles, 1 + 1e-5 * expected)
+          << "v0=" << v0 << " v1=" << v1 << " steps=" << steps
+          << " index=" << index;
+      }
+    }
+  }
+}
+
+// Backend that, without blocking, only takes as many segments as it has
+// free slots.
+class LimitedMotionQueue : public MockMotionQueue {
+public:
+  LimitedMotionQueue(int capacity)
+    : MockMotionQueue(capacity), free_slots(0), aborted(false) {}
+
+  bool Enqueue(MotionSegment *segment) {
+    segments.push_back(*segment);
+    return MockMotionQueue::Enqueue(segment);
+  }
+  int TryEnqueueBatch(MotionSegment *segments, int count) {
+    if (aborted) return -1;
+    const int n = std::min(count, free_slots);
+    free_slots -= n;
+    for (int i = 0; i < n; ++i) Enqueue(&segments[i]);
+    return n;
+  }
+
+  std::vector<MotionSegment> segments;
+  int free_slots;
+  bool aborted;
+};
+
+static const LinearSegmentSteps kHeldBackSegment = {
+  0 /* v0 */, 0 /* v1 */, 0 /* aux */, {100, 0, 0, 0, 0, 0, 0, 0} /* steps */
+};
+
+// In non-blocking mode, segments that don't fit are held back and sent
+// once there is space. They count as part of the queue for the position.
+TEST(NonBlocking, held_back_until_space) {
+  HardwareMapping hw;
+  LimitedMotionQueue motion_backend(16);
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  motor_operations.SetNonBlocking(true);
+
+  motion_backend.free_slots = 2;
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_TRUE(motor_operations.Enqueue(kHeldBackSegment));
+  }
+  EXPECT_EQ(2u, motion_backend.segments.size());
+  EXPECT_FALSE(motor_operations.SendHeldBack());
+
+  // The second segment is executing, half done. The other three are
+  // still held back.
+  motion_backend.SimRun(100, 1);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(150, status.pos_steps[0]);
+
+  motion_backend.free_slots = 2;
+  EXPECT_FALSE(motor_operations.SendHeldBack());
+  EXPECT_EQ(4u, motion_backend.segments.size());
+  motion_backend.free_slots = 10;
+  EXPECT_TRUE(motor_operations.SendHeldBack());
+  EXPECT_EQ(5u, motion_backend.segments.size());
+}
+
+// At most a queue length of segments is held back, then Enqueue() waits
+// for the backend. An abort is reported by the next Enqueue().
+TEST(NonBlocking, limited_held_back) {
+  HardwareMapping hw;
+  LimitedMotionQueue motion_backend(4);
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  motor_operations.SetNonBlocking(true);
+
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(motor_operations.Enqueue(kHeldBackSegment));
+  }
+  EXPECT_EQ(0u, motion_backend.segments.size());
+  EXPECT_TRUE(motor_operations.Enqueue(kHeldBackSegment));
+  EXPECT_EQ(4u, motion_backend.segments.size());
+
+  motion_backend.aborted = true;
+  EXPECT_TRUE(motor_operations.SendHeldBack());  // Nothing left to send.
+  motion_backend.aborted = false;
+  EXPECT_FALSE(motor_operations.Enqueue(kHeldBackSegment));
+  EXPECT_TRUE(motor_operations.Enqueue(kHeldBackSegment));
+  EXPECT_EQ(4u, motion_backend.segments.size());
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,108 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_PLANNER_MATH_H_
+#define _BEAGLEG_PLANNER_MATH_H_
+
+// Speed profile and junction calculations of the planner.
+//
+// These are templates on the scalar type: the planner uses PlannerFloat,
+// while tests compare it with a double precision reference to bound the error.
+
+#include <cmath>
+#include <limits>
+
+// Scalar type used in the planner. On the Cortex-A8 of the BeagleBone, single
+// precision is considerably faster (double is not handled by NEON and slow on
+// its VFP) and precise enough for planning. Elsewhere, we use double.
+// Override with -DPLANNER_SINGLE_PRECISION or -DPLANNER_DOUBLE_PRECISION.
+#if defined(PLANNER_SINGLE_PRECISION) \
+  || (defined(__arm__) && !defined(PLANNER_DOUBLE_PRECISION))
+typedef float PlannerFloat;
+#else
+typedef double PlannerFloat;
+#endif
+
+// Given that we want to travel "s" steps, start with speed "v0",
+// accelerate peak speed v1 and slow down to "v2" with acceleration "a",
+// what is v1 ?
+template <typename T>
+inline T get_peak_speed(T s, T v0, T v2, T a) {
+  return std::sqrt((v2*v2 + v0*v0 + 2 * a * s) / 2);
+}
+
+// Highest speed we can reach starting with speed "v0" and accelerating
+// with "a" over distance "s". Acceleration <= 0 means unlimited.
+template <typename T>
+inline T get_reachable_speed(T v0, T a, T s) {
+  if (a <= 0) return std::numeric_limits<T>::infinity();
+  return std::sqrt(v0*v0 + 2 * a * s);
+}
+
+// Lowest speed we can reach starting with speed "v0" and decelerating
+// with "a" over distance "s". Acceleration <= 0 means unlimited.
+template <typename T>
+inline T get_lowest_reachable_speed(T v0, T a, T s) {
+  if (a <= 0) return 0;
+  const T v_sq = v0*v0 - 2 * a * s;
+  return v_sq > 0 ? std::sqrt(v_sq) : 0;
+}
+
+// Distance needed to change speed from "v0" to "v1" with acceleration "a".
+template <typename T>
+inline T get_speed_change_distance(T v0, T v1, T a) {
+  return std::fabs(v1*v1 - v0*v0) / (2 * a);
+}
+
+// Time needed to change speed by "dv" with jerk limitation: the acceleration
+// ramps up with jerk "j" to at most "a", stays there and ramps down again.
+// If "dv" is too small to reach "a", the ramps meet in the middle.
+template <typename T>
+inline T get_jerk_limited_speed_change_time(T dv, T a, T j) {
+  dv = std::fabs(dv);
+  if (dv * j >= a * a)
+    return dv / a + a / j;
+  return 2 * std::sqrt(dv / j);
+}
+
+// Distance needed to change speed from "v0" to "v1" with acceleration at
+// most "a" and jerk "j". The profile is symmetric, so we travel with the
+// average speed of v0 and v1.
+template <typename T>
+inline T get_jerk_limited_speed_change_distance(T v0, T v1, T a, T j) {
+  return (v0 + v1) / 2 * get_jerk_limited_speed_change_time(v1 - v0, a, j);
+}
+
+// Junction deviation: maximum speed to go around a corner, if we imagine it
+// being rounded off by a circle that deviates "deviation" from the corner
+// point. Going around that circle with the centripetal acceleration "accel"
+// gives the maximum speed v = sqrt(a * r).
+//
+// The radius only depends on sin(theta/2), theta being the angle of the
+// corner, which we get from the cosine of the angle between the two segment
+// directions with the half-angle identity, so no trigonometric functions
+// are needed. Requires -1 < cos_angle < 1.
+template <typename T>
+inline T get_junction_deviation_speed(T cos_angle, T accel, T deviation) {
+  // Angle of the corner is 180 - angle between the vectors.
+  const T sin_half_corner = std::sqrt((1 + cos_angle) / 2);
+  const T radius = deviation * sin_half_corner / (1 - sin_half_corner);
+  return std::sqrt(accel * radius);
+}
+
+#endif  // _BEAGLEG_PLANNER_MATH_H_
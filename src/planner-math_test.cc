@@ -0,0 +1,126 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Test for the planner math.
+ *
+ * The planner might calculate in single precision on the target. Compare
+ * the float instantiations with the double reference to bound the error.
+ */
+#include "planner-math.h"
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+
+// Relative error we accept in single precision.
+static const double kMaxRelativeError = 1e-6;
+
+#define EXPECT_CLOSE(reference, value) \
+  EXPECT_NEAR(reference, value, kMaxRelativeError * fabs(reference))
+
+TEST(PlannerMath, PeakSpeed) {
+  for (int steps = 1; steps < 10000000; steps *= 3) {
+    for (double v0 = 0; v0 < 1e6; v0 = v0 * 7 + 13) {
+      for (double v2 = 0; v2 < 1e6; v2 = v2 * 5 + 11) {
+        for (double a = 1; a < 1e7; a *= 9) {
+          EXPECT_CLOSE(get_peak_speed<double>(steps, v0, v2, a),
+                       get_peak_speed<float>(steps, v0, v2, a));
+        }
+      }
+    }
+  }
+}
+
+TEST(PlannerMath, LowestReachableSpeed) {
+  EXPECT_EQ(0, get_lowest_reachable_speed<float>(10, 0, 10));
+  EXPECT_EQ(0, get_lowest_reachable_speed<float>(10, 1, 50));
+  EXPECT_EQ(0, get_lowest_reachable_speed<float>(10, 1, 100));
+  EXPECT_FLOAT_EQ(8, get_lowest_reachable_speed<float>(10, 1, 18));
+  // Going back to the speed we started with.
+  EXPECT_FLOAT_EQ(10, get_lowest_reachable_speed<float>(
+                    get_reachable_speed<float>(10, 3, 7), 3, 7));
+}
+
+TEST(PlannerMath, ReachableSpeed) {
+  EXPECT_TRUE(std::isinf(get_reachable_speed<float>(10, 0, 10)));
+  for (double v0 = 0; v0 < 1e4; v0 = v0 * 7 + 0.3) {
+    for (double a = 0.1; a < 1e5; a *= 9) {
+      for (double s = 0.001; s < 1e3; s *= 3) {
+        EXPECT_CLOSE(get_reachable_speed<double>(v0, a, s),
+                     get_reachable_speed<float>(v0, a, s));
+      }
+    }
+  }
+}
+
+TEST(PlannerMath, SpeedChangeDistance) {
+  EXPECT_EQ(0, get_speed_change_distance<float>(100, 100, 10));
+  EXPECT_FLOAT_EQ(500, get_speed_change_distance<float>(0, 100, 10));
+  EXPECT_FLOAT_EQ(500, get_speed_change_distance<float>(100, 0, 10));
+
+  // Speeds in steps/s, so the squares get large; the difference is what
+  // matters, so the error is relative to the larger speed squared.
+  for (double v0 = 0; v0 < 1e6; v0 = v0 * 7 + 13) {
+    for (double v1 = 0; v1 < 1e6; v1 = v1 * 5 + 11) {
+      for (double a = 1; a < 1e7; a *= 9) {
+        const double scale = std::max(v0, v1) * std::max(v0, v1) / (2 * a);
+        EXPECT_NEAR(get_speed_change_distance<double>(v0, v1, a),
+                    get_speed_change_distance<float>(v0, v1, a),
+                    kMaxRelativeError * scale);
+      }
+    }
+  }
+}
+
+TEST(PlannerMath, JerkLimitedSpeedChange) {
+  // Reaching the acceleration limit: 1s ramping up to 10, 9s constant
+  // acceleration and 1s ramping down for a speed change of 100.
+  EXPECT_FLOAT_EQ(11, get_jerk_limited_speed_change_time<float>(100, 10, 10));
+  EXPECT_FLOAT_EQ(11, get_jerk_limited_speed_change_time<float>(-100, 10, 10));
+  EXPECT_FLOAT_EQ(50 * 11,
+                  get_jerk_limited_speed_change_distance<float>(0, 100, 10, 10));
+  EXPECT_FLOAT_EQ(50 * 11,
+                  get_jerk_limited_speed_change_distance<float>(100, 0, 10, 10));
+
+  // Ramps meet in the middle at an acceleration of sqrt(50), below the limit.
+  EXPECT_FLOAT_EQ(2 * sqrtf(0.5f),
+                  get_jerk_limited_speed_change_time<float>(5, 10, 10));
+
+  // Never shorter than with constant acceleration.
+  for (double v0 = 0; v0 < 1e6; v0 = v0 * 7 + 13) {
+    for (double v1 = 0; v1 < 1e6; v1 = v1 * 5 + 11) {
+      for (double a = 1; a < 1e7; a *= 9) {
+        const double d = get_jerk_limited_speed_change_distance<double>(
+          v0, v1, a, 10 * a);
+        EXPECT_GE(d, get_speed_change_distance<double>(v0, v1, a));
+        EXPECT_CLOSE(d, get_jerk_limited_speed_change_distance<float>(
+                       v0, v1, a, 10 * a));
+      }
+    }
+  }
+}
+
+TEST(PlannerMath, JunctionDeviationSpeed) {
+  // A 90 degree corner: sin(45 degree) in the half angle.
+  const double s = sqrt(0.5);
+  EXPECT_NEAR(sqrt(100 * 0.05 * s / (1 - s)),
+              get_junction_deviation_speed<double>(0, 100, 0.05), 1e-9);
+
+  // Close to straight and close to reverse are the numerically hard cases.
+  // The reference gets the same float-rounded angle, so that we only measure
+  // the error of the calculation, not of the representation of the input.
+  for (double angle = -0.999999; angle < 0.999999; angle += 0.001) {
+    const float cos_angle = angle;
+    for (double accel = 10; accel < 1e5; accel *= 7) {
+      const double reference
+        = get_junction_deviation_speed<double>(cos_angle, accel, 0.05);
+      const float value
+        = get_junction_deviation_speed<float>(cos_angle, accel, 0.05);
+      EXPECT_NEAR(reference, value, 1e-4 * reference) << cos_angle;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,37 +18,200 @@
  */
 #include <stdlib.h>
 
+#include <atomic>
 #include <cmath>  // We use these functions as they work type-agnostic
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "common/logging.h"
 #include "common/container.h"
 
 #include "planner.h"
+#include "planner-math.h"
 #include "hardware-mapping.h"
 #include "gcode-machine-control.h"
+#include "motion-queue.h"
 #include "motor-operations.h"
 
+// Capacity of the planning buffer. Needs to hold the last emitted position,
+// the segment to be emitted next and PLANNER_MAX_LOOKAHEAD segments after it;
+// the RingDeque keeps one slot free.
+// A power of two keeps the modulo operations in the ring cheap.
+#define PLANNING_BUFFER_CAPACITY 1024
+static_assert(PLANNING_BUFFER_CAPACITY >= PLANNER_MAX_LOOKAHEAD + 3,
+              "Planning buffer too small for maximum lookahead");
+
+// Number of commands that can be queued for the planner thread.
+#define PLANNER_THREAD_QUEUE_LEN 256
+
+// With jerk limitation, each jerk ramp of a speed change is broken into this
+// many pieces of constant acceleration, which is what the motion queue
+// backends can execute.
+#define SCURVE_PIECES_PER_JERK_RAMP 4
+
+// Minimum number of defining axis steps per S-curve piece. Shorter speed
+// changes have less pieces or are done with constant acceleration.
+#define SCURVE_MIN_STEPS_PER_PIECE 16
+
+// Maximum number of segments a speed change or a whole move is broken into.
+#define MAX_SPEED_CHANGE_SEGMENTS (2 * SCURVE_PIECES_PER_JERK_RAMP + 1)
+#define MAX_MOVE_SEGMENTS (2 * MAX_SPEED_CHANGE_SEGMENTS + 1)
+
 namespace {
 // The target position vector is essentially a position in the
 // GCODE_NUM_AXES-dimensional space.
 //
-// An AxisTarget has a position vector, in absolute machine coordinates, and a
-// speed when arriving at that position.
+// An AxisTarget has a position vector, in absolute machine coordinates, and
+// the limits of the speed profile of the segment leading there from the
+// previous position.
 //
-// The speed is initially the aimed goal; if it cannot be reached, the
-// AxisTarget will be modified to contain the actually reachable value. That is
-// used in planning along the path.
+// All speeds and accelerations are along the path in mm/s and mm/s^2, so that
+// they can be compared between segments. They are only converted to steps/s of
+// the defining axis when the segment is emitted to the motor operations.
 struct AxisTarget {
   int position_steps[GCODE_NUM_AXES];  // Absolute position at end of segment. In steps.
 
   // Derived values
   int delta_steps[GCODE_NUM_AXES];     // Difference to previous position.
   enum GCodeParserAxis defining_axis;  // index into defining axis.
-  double speed;                         // (desired) speed in steps/s on defining axis.
   unsigned short aux_bits;             // Auxillary bits in this segment; set with M42
-  double dx, dy, dz;                    // 3D delta_steps in real units
-  double len;                           // 3D length
+  PlannerFloat dx, dy, dz;             // 3D delta_steps in real units
+  PlannerFloat len;                    // Length of the path in mm.
+  PlannerFloat steps_per_len;          // Defining axis steps per mm of path.
+
+  // Planning values.
+  PlannerFloat feedrate;               // Requested speed, before speed factor.
+  PlannerFloat speed;                  // Desired speed, clamped to axis limits.
+  PlannerFloat accel;                  // Acceleration. <= 0: unlimited.
+  PlannerFloat jerk;                   // Jerk. <= 0: no S-curve.
+  PlannerFloat max_entry_speed;        // Highest speed to join previous segment.
+  PlannerFloat entry_speed;            // Planned speed at the begin of segment.
 };
+
+// Jerk limited speed change from v0 to v1 over a given number of steps.
+//
+// The acceleration ramps up with the given jerk, stays constant, and ramps
+// down again, taking the time we need for the steps with the average speed.
+// The planner provides at least get_jerk_limited_speed_change_distance()
+// steps for the acceleration limit, so the constant acceleration we need is
+// within that limit. (If the time is too short for the jerk to reach the
+// speed change at all, which can only happen by rounding, the jerk is raised
+// to make the acceleration ramps meet in the middle).
+// All values are in steps of the defining axis.
+class SCurveProfile {
+public:
+  SCurveProfile(double v0, double v1, int steps, double jerk)
+    : v0_(v0), sign_(v1 > v0 ? 1 : -1), dv_(std::fabs(v1 - v0)),
+      total_time_(2.0 * steps / (v0 + v1)), jerk_(jerk) {
+    const double jt = jerk_ * total_time_;
+    if (jt * total_time_ >= 4 * dv_) {
+      accel_ = (jt - std::sqrt(jt * jt - 4 * jerk_ * dv_)) / 2;
+      ramp_time_ = accel_ / jerk_;
+    } else {
+      ramp_time_ = total_time_ / 2;
+      jerk_ = 4 * dv_ / (total_time_ * total_time_);
+      accel_ = jerk_ * ramp_time_;
+    }
+  }
+
+  double total_time() const { return total_time_; }
+  double ramp_time() const { return ramp_time_; }
+
+  // Speed at time t.
+  double speed_at(double t) const {
+    double change;
+    if (t < ramp_time_) {
+      change = jerk_ * t * t / 2;
+    } else if (t <= total_time_ - ramp_time_) {
+      change = jerk_ * ramp_time_ * ramp_time_ / 2 + accel_ * (t - ramp_time_);
+    } else {
+      const double r = total_time_ - t;
+      change = dv_ - jerk_ * r * r / 2;
+    }
+    return v0_ + sign_ * change;
+  }
+
+  // Distance traveled at time t.
+  double distance_at(double t) const {
+    double change;  // Integral of the speed change.
+    if (t < ramp_time_) {
+      change = jerk_ * t * t * t / 6;
+    } else if (t <= total_time_ - ramp_time_) {
+      const double u = t - ramp_time_;
+      change = jerk_ * ramp_time_ * ramp_time_ * ramp_time_ / 6
+        + jerk_ * ramp_time_ * ramp_time_ / 2 * u + accel_ * u * u / 2;
+    } else {
+      // The profile is point symmetric, so the last ramp mirrors the first.
+      const double r = total_time_ - t;
+      change = dv_ * t - dv_ * total_time_ / 2 + jerk_ * r * r * r / 6;
+    }
+    return v0_ * t + sign_ * change;
+  }
+
+  // Time at which we have traveled distance "s". The distance is monotonic
+  // in time, so we find it by bisection.
+  double time_at_distance(double s) const {
+    double low = 0, high = total_time_;
+    for (int i = 0; i < 50; ++i) {
+      const double t = (low + high) / 2;
+      if (distance_at(t) < s)
+        low = t;
+      else
+        high = t;
+    }
+    return (low + high) / 2;
+  }
+
+private:
+  const double v0_;
+  const int sign_;
+  const double dv_;          // Absolute speed change.
+  const double total_time_;
+  double jerk_;
+  double accel_;             // Peak acceleration.
+  double ramp_time_;         // Time to ramp up acceleration.
+};
+
+// With jerk limitation, speed changes need more distance than with constant
+// acceleration. Find the highest peak speed up to "*peak_speed" at which the
+// jerk limited speed changes from "v0" and to "v1" both fit into "steps", and
+// the steps for each of them.
+// Returns false if they don't fit even without peak: entry and exit speed
+// are planned with acceleration only, so this happens on short segments.
+bool fit_jerk_limited_speed_changes(PlannerFloat v0, PlannerFloat v1,
+                                    PlannerFloat accel, PlannerFloat jerk,
+                                    int steps, PlannerFloat *peak_speed,
+                                    int *accel_steps, int *decel_steps) {
+  // The steps are rounded up, so that the time is never too short for the
+  // jerk; leave room for that.
+  const PlannerFloat available = steps - 2;
+  auto needed = [=](PlannerFloat peak) {
+    return get_jerk_limited_speed_change_distance(v0, peak, accel, jerk)
+      + get_jerk_limited_speed_change_distance(peak, v1, accel, jerk);
+  };
+  PlannerFloat low = std::max(v0, v1);
+  if (available <= 0 || needed(low) > available)
+    return false;
+  PlannerFloat high = *peak_speed;
+  if (needed(high) > available) {
+    for (int i = 0; i < 32; ++i) {
+      const PlannerFloat mid = (low + high) / 2;
+      if (needed(mid) <= available)
+        low = mid;
+      else
+        high = mid;
+    }
+    if (low <= 0)
+      return false;   // Can't get moving from standstill.
+    *peak_speed = low;
+  }
+  *accel_steps = std::ceil(get_jerk_limited_speed_change_distance(
+                             v0, *peak_speed, accel, jerk));
+  *decel_steps = std::ceil(get_jerk_limited_speed_change_distance(
+                             *peak_speed, v1, accel, jerk));
+  return true;
+}
 }  // end anonymous namespace
 
 class Planner::Impl {
@@ -58,45 +221,103 @@ public:
        MotorOperations *motor_backend);
   ~Impl();
 
-  bool move_machine_steps(const struct AxisTarget *last_pos,
-                          struct AxisTarget *target_pos,
-                          const struct AxisTarget *upcoming);
+  bool move_machine_steps(const struct AxisTarget *target_pos,
+                          PlannerFloat v0, PlannerFloat v1);
 
   void assign_steps_to_motors(struct LinearSegmentSteps *command,
                               enum GCodeParserAxis axis,
                               int steps);
 
-  bool issue_motor_move_if_possible();
-  bool machine_move(const AxesRegister &axis, float feedrate);
+  int add_speed_change(const struct LinearSegmentSteps &command,
+                       int defining_axis_steps, double jerk,
+                       struct LinearSegmentSteps *out);
+
+  void plan_lookahead();
+  bool issue_motor_moves_if_possible(bool flush);
+  bool machine_move(const AxesRegister &axis, float feedrate,
+                    HardwareMapping::AuxBitmap aux_bits);
+  bool merge_or_move(const AxesRegister &axis, float feedrate,
+                     HardwareMapping::AuxBitmap aux_bits);
+  bool flush_merged_segment();
   void bring_path_to_halt();
+  void apply_speed_factor();
 
-  float acceleration_for_move(const int *axis_steps,
-                              enum GCodeParserAxis defining_axis) {
-    return max_axis_accel_[defining_axis];
-    // TODO: we need to scale the acceleration if one of the other axes could't
-    // deal with it. Look at axis steps for that.
-  }
+  // Determine the highest speed the segment "to" can be entered with when
+  // coming from segment "from".
+  PlannerFloat determine_max_entry_speed(const struct AxisTarget *from,
+                                         const struct AxisTarget *to);
+
+  // Given per-axis limits (e.g. acceleration or jerk in mm/s^2 or mm/s^3),
+  // determine the highest value along the path of the move that keeps every
+  // axis within its limit. Axes without limit (<= 0) are not considered.
+  // Returns 0 if there is no limit.
+  PlannerFloat path_limit_for_move(const struct AxisTarget *t,
+                                   const FloatAxisConfig &axis_limit);
 
   // Avoid division by zero if there is no config defined for axis.
-  double axis_delta_to_mm(const AxisTarget *pos, enum GCodeParserAxis axis) {
+  PlannerFloat axis_delta_to_mm(const AxisTarget *pos,
+                                enum GCodeParserAxis axis) {
     if (cfg_->steps_per_mm[axis] != 0.0)
-      return (double)pos->delta_steps[axis] / cfg_->steps_per_mm[axis];
+      return (PlannerFloat)pos->delta_steps[axis] / cfg_->steps_per_mm[axis];
     return 0.0;
   }
 
-  double euclidian_speed(const struct AxisTarget *t);
+  bool enqueue_move(const AxesRegister &axis, float feedrate,
+                    HardwareMapping::AuxBitmap aux_bits) {
+    if (cfg_->chord_tolerance > 0)
+      return merge_or_move(axis, feedrate, aux_bits);
+    return machine_move(axis, feedrate, aux_bits);
+  }
 
+  // Planner thread. If enabled, moves are planned and sent to the motor
+  // operations in a separate thread, fed by a lock-free queue. All other
+  // operations first wait for that thread to finish its work.
+  struct PlannerCommand {
+    enum Type { MOVE, HALT, EXIT } type;
+    AxesRegister target;
+    float feedrate;
+    HardwareMapping::AuxBitmap aux_bits;
+  };
+  void run_planner_thread();
+  void send_command(const PlannerCommand &command);
+  void wait_commands_done();
+
+  // The queue and the counters are only accessed lock-free; the mutex is
+  // only used to sleep until "condition" becomes true, which must not change
+  // anything. Whoever changes what a condition depends on wakes the
+  // sleepers, which is cheap if there are none.
+  template <typename Condition> void sleep_until(Condition condition);
+  void wake_sleepers();
+
+  // Status of the motor operations. Queries can't wait for the motor
+  // operations while the planner thread uses them, as it might block for a
+  // long time in a full queue. So the thread publishes the status after each
+  // command, and queries only update it if the motor operations are free.
+  struct StatusSnapshot {
+    bool has_physical_status;
+    PhysicalStatus physical_status;
+    bool has_queue_stats;
+    MotionQueueStats queue_stats;
+  };
+  void publish_status();      // Needs to hold motor_ops_mutex_.
+  StatusSnapshot get_status();
+
+  bool Enqueue(const AxesRegister &axis, float feedrate);
+  void BringPathToHalt();
   void GetCurrentPosition(AxesRegister *pos);
   int DirectDrive(GCodeParserAxis axis, float distance, float v0, float v1);
   void SetExternalPosition(GCodeParserAxis axis, float pos);
+  void SetSpeedFactor(float factor);
+  bool GetQueueStats(MotionQueueStats *stats);
+  void SetIncrementalPlanning(bool incremental) {
+    incremental_planning_ = incremental;
+  }
 
-  // Given the desired target speed of the defining axis and the steps to be
-  // performed on all axes, determine if we need to scale down as to not exceed
-  // the individual maximum speed constraints on any axis. Return the new speed
-  // of the defining axis.
-  double clamp_to_limits(enum GCodeParserAxis defining_axis,
-                         const double target_value,
-                         const int *axis_steps);
+  // Given the desired target speed along the path, determine if we need to
+  // scale down as to not exceed the individual maximum speed constraints on
+  // any axis. Return the new speed along the path.
+  PlannerFloat clamp_to_limits(const struct AxisTarget *t,
+                               PlannerFloat target_speed);
 
 private:
   const struct MachineControlConfig *const cfg_;
@@ -104,64 +325,60 @@ private:
   MotorOperations *const motor_ops_;
 
   // Next buffered positions. Written by incoming gcode, read by outgoing
-  // motor movements.
-  RingDeque<AxisTarget, 4> planning_buffer_;
+  // motor movements. The first element is the last position that has been
+  // emitted to the motor operations, all following are still to be planned.
+  RingDeque<AxisTarget, PLANNING_BUFFER_CAPACITY> planning_buffer_;
+  unsigned lookahead_;   // Segments known after one before it is emitted.
+
+  // Watermark in the planning buffer: the entry speeds of all segments up to
+  // and including this index are optimal and won't change anymore with
+  // more segments arriving, so re-planning can stop there.
+  int planned_;
+  bool full_replan_;     // Limits changed; re-plan all segments.
+  bool incremental_planning_;   // If false, always do a full re-plan.
 
   // Pre-calculated per axis limits in steps, steps/s, steps/s^2
   // All arrays are indexed by axis.
   AxesRegister max_axis_speed_;   // max travel speed hz
-  AxesRegister max_axis_accel_;   // acceleration hz/s
-  float highest_accel_;           // hightest accel of all axes.
 
   HardwareMapping::AuxBitmap last_aux_bits_;  // last enqueued aux bits.
 
+  // Segment merging stage in front of the planning buffer: consecutive
+  // segments are merged into one while all intermediate points are within
+  // the chord tolerance.
+  bool has_merged_segment_;
+  AxesRegister merge_start_;        // Start position of merged segment (mm)
+  AxesRegister merge_target_;       // Current end of merged segment (mm)
+  float merge_feedrate_;
+  HardwareMapping::AuxBitmap merge_aux_bits_;
+  double merge_deviation_;          // Upper bound deviation of merged points.
+
+  std::thread *planner_thread_;
+  SPSCRingQueue<PlannerCommand, PLANNER_THREAD_QUEUE_LEN> commands_;
+  std::mutex commands_mutex_;          // Only used to sleep.
+  std::condition_variable commands_changed_;
+  std::atomic<int> sleepers_;
+  std::atomic<unsigned> commands_sent_;
+  std::atomic<unsigned> commands_done_;
+  std::atomic<bool> enqueue_failed_;   // Set by thread if motor ops aborted.
+  std::mutex motor_ops_mutex_;         // Held while thread uses motor ops.
+  std::mutex status_mutex_;
+  StatusSnapshot status_;              // Guarded by status_mutex_.
+
+  // Speed factor as requested by SetSpeedFactor() and the one currently
+  // used in the plan.
+  std::atomic<float> speed_factor_request_;
+  float speed_factor_;
+
   bool path_halted_;
   bool position_known_;
 };
 
-// Speed relative to defining axis
-static double get_speed_factor_for_axis(const struct AxisTarget *t,
-                                        enum GCodeParserAxis request_axis) {
-  if (t->delta_steps[t->defining_axis] == 0) return 0.0;
-  return 1.0 * t->delta_steps[request_axis] / t->delta_steps[t->defining_axis];
-}
-
-// Get the speed for a particular axis. Depending on the direction, this can
-// be positive or negative.
-static double get_speed_for_axis(const struct AxisTarget *target,
-                                 enum GCodeParserAxis request_axis) {
-  return target->speed * get_speed_factor_for_axis(target, request_axis);
-}
-
-// Given that we want to travel "s" steps, start with speed "v0",
-// accelerate peak speed v1 and slow down to "v2" with acceleration "a",
-// what is v1 ?
-static double get_peak_speed(int s, double v0, double v2, double a) {
-  return std::sqrt(v2*v2 + v0*v0 + 2 * a * s) / std::sqrt(2.0);
-}
-
-static double euclid_distance(double x, double y, double z) {
+static PlannerFloat euclid_distance(PlannerFloat x, PlannerFloat y,
+                                    PlannerFloat z) {
   return std::sqrt(x*x + y*y + z*z);
 }
 
-// Number of steps to accelerate or decelerate (negative "a") from speed
-// v0 to speed v1. Modifies v1 if we can't reach the speed with the allocated
-// number of steps.
-static double steps_for_speed_change(double a, double v0, double *v1,
-                                     int max_steps) {
-  // s = v0 * t + a/2 * t^2
-  // v1 = v0 + a*t
-  const double t = (*v1 - v0) / a;
-  // TODO:
-  if (t < 0) Log_error("Error condition: t=%.1f INSUFFICIENT LOOKAHEAD\n", t);
-  double steps = a/2 * t*t + v0 * t;
-  if (steps <= max_steps) return steps;
-  // Ok, we would need more steps than we have available. We correct the speed to what
-  // we actually can reach.
-  *v1 = std::sqrt(v0*v0 + 2 * a * max_steps);
-  return max_steps;
-}
-
 // Returns true, if all results in zero movement
 static bool subtract_steps(struct LinearSegmentSteps *value,
                            const struct LinearSegmentSteps &subtract) {
@@ -173,87 +390,84 @@ static bool subtract_steps(struct LinearSegmentSteps *value,
   return has_nonzero;
 }
 
-static bool within_acceptable_range(double new_val, double old_val,
-                                    double fraction) {
-  const double max_diff = fraction * old_val;
+static bool within_acceptable_range(PlannerFloat new_val,
+                                    PlannerFloat old_val,
+                                    PlannerFloat fraction) {
+  const PlannerFloat max_diff = fraction * old_val;
   if (new_val < old_val - max_diff) return false;
   if (new_val > old_val + max_diff) return false;
   return true;
 }
 
-// Determine the fraction of the speed that "from" should decelerate
-// to at the end of its travel.
-// The way trapezoidal moves work, be still have to decelerate to zero in
-// most times, which is inconvenient. TODO(hzeller): speed matching is not
-// cutting it :)
-static double determine_joining_speed(const struct AxisTarget *from,
-                                      const struct AxisTarget *to,
-                                      const double threshold,
-                                      const double speed_tune_angle) {
+// Determine the maximum speed along the path with which the segment "from"
+// can join the segment "to". The result still needs to be clamped to the
+// speed of both segments.
+static PlannerFloat determine_joining_speed(const struct AxisTarget *from,
+                                            const struct AxisTarget *to,
+                                            const PlannerFloat threshold,
+                                            const PlannerFloat speed_tune_angle) {
   // the dot product of the vectors
-  const double dot = from->dx*to->dx + from->dy*to->dy + from->dz*to->dz;
-  const double mag = from->len * to->len;
+  const PlannerFloat dot = from->dx*to->dx + from->dy*to->dy + from->dz*to->dz;
+  const PlannerFloat mag = from->len * to->len;
   if (dot == 0) return 0.0;         // orthogonal 90 degree, full stop
   if (dot < 0) return 0.0;          // turning around, full stop
-  const double dotmag = dot / mag;
-  if (within_acceptable_range(1.0, dotmag, 1e-5))
+  const PlannerFloat dotmag = dot / mag;
+  if (within_acceptable_range(1, dotmag, PlannerFloat(1e-5)))
     return to->speed;               // codirectional 0 degree, keep accelerating
 
   // the angle between the vectors
-  const double rad2deg = 180.0 / M_PI;
-  const double angle = std::fabs(std::acos(dotmag) * rad2deg);
+  const PlannerFloat rad2deg = 180 / M_PI;
+  const PlannerFloat angle = std::fabs(std::acos(dotmag) * rad2deg);
 
-  if (angle >= 45.0)
+  if (angle >= 45)
     return 0.0;                     // angle to large, come to full stop
   if (angle <= threshold) {         // in tolerance, keep accelerating
     if (dot < 1) {                  // speed tune segments less than 1mm (i.e. arcs)
-      const double deg2rad = M_PI / 180.0;
-      const double angle_speed_adj = std::cos((angle + speed_tune_angle) * deg2rad);
+      const PlannerFloat deg2rad = M_PI / 180;
+      const PlannerFloat angle_speed_adj
+        = std::cos((angle + speed_tune_angle) * deg2rad);
       return to->speed * angle_speed_adj;
     }
     return to->speed;
   }
 
   // The angle between the from and to segments is < 45 degrees but greater
-  // than the threshold. Use the "old" logic to determine the joining speed
-  //
-  // Our goal is to figure out what our from defining speed should
-  // be at the end of the move.
-  bool is_first = true;
-  double from_defining_speed = from->speed;
-  const int from_defining_steps = from->delta_steps[from->defining_axis];
-  for (const GCodeParserAxis axis : AllAxes()) {
-    const int from_delta = from->delta_steps[axis];
-    const int to_delta = to->delta_steps[axis];
-
-    // Quick integer decisions
-    if (from_delta == 0 && to_delta == 0) continue;   // uninteresting: no move.
-    if (from_delta == 0 || to_delta == 0) return 0.0; // accel from/to zero
-    if ((from_delta < 0 && to_delta > 0) || (from_delta > 0 && to_delta < 0))
-      return 0.0;  // turing around
-
-    double to_speed = get_speed_for_axis(to, axis);
-    // What would this speed translated to our defining axis be ?
-    double speed_conversion = 1.0 * from_defining_steps / from_delta;
-    double goal = to_speed * speed_conversion;
-    if (goal < 0.0) return 0.0;
-    if (is_first || within_acceptable_range(goal, from_defining_speed, 1e-5)) {
-      if (goal < from_defining_speed) from_defining_speed = goal;
-      is_first = false;
-    } else {
-      return 0.0;  // Too far off.
-    }
-  }
+  // than the threshold. The axis speeds can't be matched without a step
+  // change, so come to a full stop.
+  return 0.0;
+}
 
-  return from_defining_speed;
+// Determine the maximum speed along the path with which the segment "from"
+// can join the segment "to" by junction deviation.
+static PlannerFloat determine_junction_deviation_speed(
+  const struct AxisTarget *from, const struct AxisTarget *to,
+  const PlannerFloat deviation) {
+  // Cosine of the angle between the two direction vectors.
+  const PlannerFloat cos_angle
+    = (from->dx*to->dx + from->dy*to->dy + from->dz*to->dz)
+    / (from->len * to->len);
+  if (cos_angle <= PlannerFloat(-1 + 1e-6)) return 0;  // turning around, stop.
+  if (cos_angle >= PlannerFloat(1 - 1e-6)) return to->speed;  // straight.
+
+  // The accelerations along the path are <= 0 if unlimited.
+  PlannerFloat accel = to->accel;
+  if (from->accel > 0 && (accel <= 0 || from->accel < accel))
+    accel = from->accel;
+  if (accel <= 0) return to->speed;
+
+  return get_junction_deviation_speed(cos_angle, accel, deviation);
 }
 
 Planner::Impl::Impl(const MachineControlConfig *config,
                     HardwareMapping *hardware_mapping,
                     MotorOperations *motor_backend)
   : cfg_(config), hardware_mapping_(hardware_mapping),
-    motor_ops_(motor_backend),
-    highest_accel_(-1), path_halted_(true), position_known_(true) {
+    motor_ops_(motor_backend), planned_(1), full_replan_(false),
+    incremental_planning_(true),
+    last_aux_bits_(0), has_merged_segment_(false),
+    planner_thread_(NULL), sleepers_(0), commands_sent_(0), commands_done_(0),
+    enqueue_failed_(false), status_(), speed_factor_request_(1.0f),
+    speed_factor_(1.0f), path_halted_(true), position_known_(true) {
   // Initial machine position. We assume the homed position here, which is
   // wherever the endswitch is for each axis.
   struct AxisTarget *init_axis = planning_buffer_.append();
@@ -266,20 +480,115 @@ Planner::Impl::Impl(const MachineControlConfig *config,
   }
   position_known_ = true;
 
-  float lowest_accel = cfg_->max_feedrate[AXIS_X] * cfg_->steps_per_mm[AXIS_X];
+  lookahead_ = cfg_->lookahead_segments;
+  if (lookahead_ < 1) lookahead_ = 1;
+  if (lookahead_ > PLANNER_MAX_LOOKAHEAD) lookahead_ = PLANNER_MAX_LOOKAHEAD;
+
   for (const GCodeParserAxis i : AllAxes()) {
     max_axis_speed_[i] = cfg_->max_feedrate[i] * cfg_->steps_per_mm[i];
-    const float accel = cfg_->acceleration[i] * cfg_->steps_per_mm[i];
-    max_axis_accel_[i] = accel;
-    if (accel > highest_accel_)
-      highest_accel_ = accel;
-    if (accel < lowest_accel)
-      lowest_accel = accel;
+  }
+
+  if (cfg_->threaded_planning) {
+    planner_thread_ = new std::thread([this]() { run_planner_thread(); });
   }
 }
 
 Planner::Impl::~Impl() {
-  bring_path_to_halt();
+  BringPathToHalt();
+  if (planner_thread_) {
+    PlannerCommand exit_command = {};
+    exit_command.type = PlannerCommand::EXIT;
+    send_command(exit_command);
+    planner_thread_->join();
+    delete planner_thread_;
+  }
+}
+
+template <typename Condition>
+void Planner::Impl::sleep_until(Condition condition) {
+  if (condition()) return;
+  std::unique_lock<std::mutex> l(commands_mutex_);
+  sleepers_.fetch_add(1);
+  // Either we see the change here, or the changing thread sees us sleeping.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  commands_changed_.wait(l, condition);
+  sleepers_.fetch_sub(1);
+}
+
+void Planner::Impl::wake_sleepers() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) == 0)
+    return;
+  // Sleepers check their condition while holding the mutex, so once we have
+  // it, they either saw the change or are waiting for the notification.
+  { std::lock_guard<std::mutex> l(commands_mutex_); }
+  commands_changed_.notify_all();
+}
+
+void Planner::Impl::run_planner_thread() {
+  PlannerCommand command;
+  for (;;) {
+    sleep_until([this]() { return !commands_.empty(); });
+    commands_.pop(&command);
+    wake_sleepers();   // There is space in the queue now.
+    if (command.type == PlannerCommand::EXIT)
+      break;
+
+    {
+      std::lock_guard<std::mutex> l(motor_ops_mutex_);
+      if (command.type == PlannerCommand::MOVE) {
+        if (!enqueue_move(command.target, command.feedrate, command.aux_bits))
+          enqueue_failed_ = true;
+      } else {
+        bring_path_to_halt();
+      }
+      publish_status();
+    }
+
+    ++commands_done_;
+    wake_sleepers();
+  }
+}
+
+// Send command to planner thread; blocks while the queue is full.
+void Planner::Impl::send_command(const PlannerCommand &command) {
+  sleep_until([this]() { return !commands_.full(); });
+  ++commands_sent_;
+  commands_.push(command);
+  wake_sleepers();
+}
+
+// Wait until the planner thread has processed all commands we sent.
+void Planner::Impl::wait_commands_done() {
+  if (!planner_thread_) return;
+  sleep_until([this]() { return commands_done_ == commands_sent_; });
+}
+
+bool Planner::Impl::Enqueue(const AxesRegister &axis, float feedrate) {
+  if (!planner_thread_)
+    return enqueue_move(axis, feedrate, hardware_mapping_->GetAuxBits());
+
+  // Report failure of previous moves of the planner thread.
+  if (enqueue_failed_.exchange(false))
+    return false;
+  PlannerCommand command;
+  command.type = PlannerCommand::MOVE;
+  command.target = axis;
+  command.feedrate = feedrate;
+  command.aux_bits = hardware_mapping_->GetAuxBits();
+  send_command(command);
+  return true;
+}
+
+void Planner::Impl::BringPathToHalt() {
+  if (!planner_thread_) {
+    bring_path_to_halt();
+    return;
+  }
+  PlannerCommand halt_command = {};
+  halt_command.type = PlannerCommand::HALT;
+  send_command(halt_command);
+  wait_commands_done();
 }
 
 // Assign steps to all the motors responsible for given axis.
@@ -290,65 +599,53 @@ void Planner::Impl::assign_steps_to_motors(struct LinearSegmentSteps *command,
 }
 
 // Example with speed: given i the axis with the highest (relative) out of bounds
-// speed, what's the speed of the defining_axis so that every speed respects i's
-// bounds? The defining axis should be rescaled with this maximum offset.
+// speed, what's the speed along the path so that every speed respects i's
+// bounds? The path speed should be rescaled with this maximum offset.
 // offset = speed_limit[i] / speed[i]
-double Planner::Impl::clamp_to_limits(enum GCodeParserAxis defining_axis,
-                                      const double target_speed,
-                                      const int *axis_steps) {
-  double ratio, max_offset = 1, offset;
+PlannerFloat Planner::Impl::clamp_to_limits(const struct AxisTarget *t,
+                                            PlannerFloat target_speed) {
   const FloatAxisConfig &max_axis_speed = cfg_->max_feedrate;
-  const FloatAxisConfig &steps_per_mm = cfg_->steps_per_mm;
+  PlannerFloat max_offset = 1;
   for (const GCodeParserAxis i : AllAxes()) {
-    ratio = std::fabs((1.0 * axis_steps[i] * steps_per_mm[defining_axis])
-                      / (axis_steps[defining_axis] * steps_per_mm[i]));
-    offset = ratio > 0 ? max_axis_speed[i] / (target_speed * ratio) : 1;
+    const PlannerFloat axis_len = std::fabs(axis_delta_to_mm(t, i));
+    if (axis_len == 0) continue;
+    const PlannerFloat axis_speed = target_speed * axis_len / t->len;
+    const PlannerFloat offset = max_axis_speed[i] / axis_speed;
     if (offset < max_offset) max_offset = offset;
   }
   return target_speed * max_offset;
 }
 
-double Planner::Impl::euclidian_speed(const struct AxisTarget *t) {
-  double speed_factor = 1.0;
-  if (t->len > 0) {
-    const double axis_len_mm = axis_delta_to_mm(t, t->defining_axis);
-    speed_factor = std::fabs(axis_len_mm) / t->len;
+// The limit along the path is the axis limit scaled by the ratio of path
+// length to axis travel: axis_value = path_value * axis_len / len.
+// The axis that reaches its limit first determines the overall limit.
+PlannerFloat Planner::Impl::path_limit_for_move(const struct AxisTarget *t,
+                                                const FloatAxisConfig &axis_limit) {
+  PlannerFloat result = 0;
+  for (const GCodeParserAxis i : AllAxes()) {
+    const PlannerFloat axis_len = std::fabs(axis_delta_to_mm(t, i));
+    if (axis_len == 0 || axis_limit[i] <= 0) continue;
+    const PlannerFloat path_limit = axis_limit[i] * t->len / axis_len;
+    if (result == 0 || path_limit < result) result = path_limit;
   }
-  return t->speed * speed_factor;
+  return result;
 }
 
-// Move the given number of machine steps for each axis.
+// Move the given number of machine steps for each axis, entering the segment
+// with speed "v0" and leaving it with speed "v1" (both along the path).
 //
-// This will be up to three segments: accelerating from last_pos speed to
-// target speed, regular travel, and decelerating to the speed that the
-// next segment is never forced to decelerate, but stays at speed or accelerate.
+// This will be up to three segments: accelerating from v0 to the peak speed
+// we can reach in this segment, regular travel, and decelerating to v1.
 //
 // The segments are sent to the motor operations backend.
 //
-// Since we calculate the deceleration, this modifies the speed of target_pos
-// to reflect what the last speed was at the end of the move.
-//
 // Returns true if move was executed, false if aborted
-bool Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
-                                       struct AxisTarget *target_pos,
-                                       const struct AxisTarget *upcoming) {
-  bool ret = true;
-  if (target_pos->delta_steps[target_pos->defining_axis] == 0) {
-    if (last_aux_bits_ != target_pos->aux_bits) {
-      // Special treatment: bits changed since last time, let's push them through.
-      struct LinearSegmentSteps bit_set_command = {};
-      bit_set_command.aux_bits = target_pos->aux_bits;
-      ret = motor_ops_->Enqueue(bit_set_command);
-      last_aux_bits_ = target_pos->aux_bits;
-    }
-    return ret;
-  }
+bool Planner::Impl::move_machine_steps(const struct AxisTarget *target_pos,
+                                       PlannerFloat v0, PlannerFloat v1) {
   struct LinearSegmentSteps accel_command = {};
   struct LinearSegmentSteps move_command = {};
   struct LinearSegmentSteps decel_command = {};
 
-  assert(target_pos->speed > 0);  // Speed is always a positive scalar.
-
   // Aux bits are set synchronously with what we need.
   move_command.aux_bits = target_pos->aux_bits;
   const enum GCodeParserAxis defining_axis = target_pos->defining_axis;
@@ -357,111 +654,95 @@ bool Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
   memcpy(&accel_command, &move_command, sizeof(accel_command));
   memcpy(&decel_command, &move_command, sizeof(decel_command));
 
-  // Always start from the last steps/sec speed to avoid motion glitches.
-  // The planner will use that speed to determine what the peak speed for
-  // this move is and if we need to accel to reach the desired target speed.
-  const double last_speed = last_pos->speed;
-
-  // We need to arrive at a speed that the upcoming move does not have
-  // to decelerate further (after all, it has a fixed feed-rate it should not
-  // go over).
-  double next_speed = determine_joining_speed(target_pos, upcoming,
-                                             cfg_->threshold_angle,
-                                             cfg_->speed_tune_angle);
-  // Clamp the next speed to insure that this segment does not go over.
-  if (next_speed > target_pos->speed)
-    next_speed = target_pos->speed;
-
   const int *axis_steps = target_pos->delta_steps;  // shortcut.
   const int abs_defining_axis_steps = abs(axis_steps[defining_axis]);
-  const double a = acceleration_for_move(axis_steps, defining_axis);
-  const double peak_speed = get_peak_speed(abs_defining_axis_steps,
-                                          last_speed, next_speed, a);
-  assert(peak_speed > 0);
 
-  // TODO: if we only have < 5 steps or so, we should not even consider
-  // accelerating or decelerating, but just do one speed.
-
-  if (peak_speed < target_pos->speed) {
-    target_pos->speed = peak_speed;  // Don't manage to accelerate to desired v
-  }
-
-  // Make sure the target feedrate for the move is clamped to what all the
-  // moving axes can reach.
-  double target_feedrate = target_pos->speed / cfg_->steps_per_mm[defining_axis];
-  target_feedrate = clamp_to_limits(defining_axis, target_feedrate, axis_steps);
-  target_pos->speed = target_feedrate * cfg_->steps_per_mm[defining_axis];
-
-  const double accel_fraction =
-    (last_speed < target_pos->speed)
-    ? steps_for_speed_change(a, last_speed, &target_pos->speed,
-                             abs_defining_axis_steps) / abs_defining_axis_steps
-    : 0;
-
-  // We only decelerate if the upcoming speed is _slower_
-  double dummy_next_speed = next_speed;  // Don't care to modify; we don't have
-  const double decel_fraction =
-    (next_speed < target_pos->speed)
-    ? steps_for_speed_change(-a, target_pos->speed, &dummy_next_speed,
-                             abs_defining_axis_steps) / abs_defining_axis_steps
-    : 0;
-
-#if 0
-  // Useful debugging info.
-  // TODO: we get a decel glitch when the last_pos has accelerated to a speed
-  // that is faster than the target can decelerate from.
-  if (dummy_next_speed != next_speed) {
-    fprintf(stderr, "  \033[1m\033[31mGLITCH\033[0m "
-                    "- move too short for full decel (reached v1: %10.2f)\n",
-            dummy_next_speed);
+  // From here on, we calculate in steps and steps/s of the defining axis.
+  const PlannerFloat f = target_pos->steps_per_len;
+  const PlannerFloat accel = target_pos->accel * f;
+  const PlannerFloat start_speed = v0 * f;
+  const PlannerFloat end_speed = v1 * f;
+  PlannerFloat jerk = target_pos->jerk * f;
+
+  PlannerFloat peak_speed = target_pos->speed * f;
+  int accel_steps = 0;
+  int decel_steps = 0;
+  if (accel > 0) {
+    const PlannerFloat reachable
+      = get_peak_speed<PlannerFloat>(abs_defining_axis_steps,
+                                     start_speed, end_speed, accel);
+    if (reachable < peak_speed)
+      peak_speed = reachable;  // Don't manage to accelerate to desired v
+    // Rounding errors should not make us go below the planned speeds.
+    if (peak_speed < start_speed) peak_speed = start_speed;
+    if (peak_speed < end_speed) peak_speed = end_speed;
+
+    // If the jerk limited speed changes don't fit, fall back to constant
+    // acceleration, which the entry and exit speeds are planned for.
+    if (jerk > 0 && !fit_jerk_limited_speed_changes(start_speed, end_speed,
+                                                    accel, jerk,
+                                                    abs_defining_axis_steps,
+                                                    &peak_speed,
+                                                    &accel_steps,
+                                                    &decel_steps)) {
+      jerk = 0;
+    }
   }
-#endif
-
-  assert(accel_fraction + decel_fraction <= 1.0 + 1e-3);
-
-#if 0
-  // fudging: if we have tiny acceleration segments, don't do these at all
-  // but only do speed; otherwise we have a lot of rattling due to many little
-  // segments of acceleration/deceleration (e.g. for G2/G3).
-  // This is not optimal. Ideally, we would actually calculate in terms of
-  // jerk and optimize to stay within that constraint.
-  const int accel_decel_steps
-    = (accel_fraction + decel_fraction) * abs_defining_axis_steps;
-  const double accel_decel_mm
-    = (accel_decel_steps / cfg_->steps_per_mm[defining_axis]);
-  const char do_accel = (accel_decel_mm > 2 || accel_decel_steps > 16);
-#else
-  const char do_accel = 1;
-#endif
+  if (accel > 0 && jerk <= 0) {
+    accel_steps = std::lround(get_speed_change_distance(start_speed,
+                                                        peak_speed, accel));
+    decel_steps = std::lround(get_speed_change_distance(peak_speed,
+                                                        end_speed, accel));
+    if (accel_steps > abs_defining_axis_steps)
+      accel_steps = abs_defining_axis_steps;
+    if (accel_steps == 0 && start_speed <= 0)
+      accel_steps = 1;  // Can't move from standstill without accelerating.
+    if (decel_steps > abs_defining_axis_steps - accel_steps)
+      decel_steps = abs_defining_axis_steps - accel_steps;
+
+    // Speed changes that are less than a step worth.
+    if (accel_steps == 0)
+      peak_speed = start_speed;
+    if (decel_steps == 0 && peak_speed != end_speed) {
+      decel_steps = 1;
+      if (accel_steps + decel_steps > abs_defining_axis_steps) {
+        if (accel_steps > 1 || start_speed > 0) {
+          if (--accel_steps == 0) peak_speed = start_speed;
+        } else {
+          decel_steps = 0;  // Single step from standstill: only accelerate.
+        }
+      }
+    }
+  }
+  assert(peak_speed > 0);
 
   bool has_accel = false;
   bool has_move = false;
   bool has_decel = false;
 
-  if (do_accel && accel_fraction * abs_defining_axis_steps > 0) {
+  if (accel_steps > 0) {
     has_accel = true;
-    accel_command.v0 = (float)last_speed;        // Last speed of defining axis
-    accel_command.v1 = (float)target_pos->speed; // New speed of defining axis
+    accel_command.v0 = (float)start_speed;  // Last speed of defining axis
+    accel_command.v1 = (float)peak_speed;   // New speed of defining axis
 
     // Now map axis steps to actual motor driver
+    const double accel_fraction = 1.0 * accel_steps / abs_defining_axis_steps;
     for (const GCodeParserAxis a : AllAxes()) {
       const int accel_steps = std::lround(accel_fraction * axis_steps[a]);
       assign_steps_to_motors(&accel_command, a, accel_steps);
     }
-  } else {
-    if (last_speed) target_pos->speed = last_speed; // No accel so use the last speed
   }
 
-  move_command.v0 = (float)target_pos->speed;
-  move_command.v1 = (float)target_pos->speed;
+  move_command.v0 = (float)peak_speed;
+  move_command.v1 = (float)peak_speed;
 
-  if (do_accel && decel_fraction * abs_defining_axis_steps > 0) {
+  if (decel_steps > 0) {
     has_decel = true;
-    decel_command.v0 = (float)target_pos->speed;
-    decel_command.v1 = (float)next_speed;
-    target_pos->speed = next_speed;
+    decel_command.v0 = (float)peak_speed;
+    decel_command.v1 = (float)end_speed;
 
     // Now map axis steps to actual motor driver
+    const double decel_fraction = 1.0 * decel_steps / abs_defining_axis_steps;
     for (const GCodeParserAxis a : AllAxes()) {
       const int decel_steps = std::lround(decel_fraction * axis_steps[a]);
       assign_steps_to_motors(&decel_command, a, decel_steps);
@@ -479,30 +760,315 @@ bool Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
 
   if (cfg_->synchronous) motor_ops_->WaitQueueEmpty();
 
-  // Make sure each segment gets added in case we get aborted
-  if (has_accel)        ret = motor_ops_->Enqueue(accel_command);
-  if (ret && has_move)  ret = motor_ops_->Enqueue(move_command);
-  if (ret && has_decel) ret = motor_ops_->Enqueue(decel_command);
+  // All segments of this move are handed to the motor operations together.
+  struct LinearSegmentSteps segments[MAX_MOVE_SEGMENTS];
+  int count = 0;
+  if (has_accel)
+    count += add_speed_change(accel_command, accel_steps, jerk,
+                              segments + count);
+  if (has_move)
+    segments[count++] = move_command;
+  if (has_decel)
+    count += add_speed_change(decel_command, decel_steps, jerk,
+                              segments + count);
+  const bool ret = motor_ops_->EnqueueBatch(segments, count);
 
   last_aux_bits_ = target_pos->aux_bits;
 
   return ret;
 }
 
-// If we have enough data in the queue, issue motor move.
-bool Planner::Impl::issue_motor_move_if_possible() {
+// Break a speed change into segments, stored in "out", which needs to have
+// space for MAX_SPEED_CHANGE_SEGMENTS. Returns the number of segments.
+// Without jerk limit, this is a single segment with constant acceleration.
+// Otherwise, the speed change is done as S-curve: it is broken into pieces of
+// constant acceleration following the jerk limited profile, all of which
+// together take the same steps and time.
+int Planner::Impl::add_speed_change(const struct LinearSegmentSteps &command,
+                                    int defining_axis_steps, double jerk,
+                                    struct LinearSegmentSteps *out) {
+  if (jerk <= 0) {
+    out[0] = command;
+    return 1;
+  }
+
+  int ramp_pieces = SCURVE_PIECES_PER_JERK_RAMP;
+  while (ramp_pieces > 0 && defining_axis_steps
+         < (2 * ramp_pieces + 1) * SCURVE_MIN_STEPS_PER_PIECE) {
+    --ramp_pieces;
+  }
+  if (ramp_pieces == 0) {
+    out[0] = command;
+    return 1;
+  }
+
+  const SCurveProfile profile(command.v0, command.v1, defining_axis_steps,
+                              jerk);
+  const double total_time = profile.total_time();
+  const double ramp_time = profile.ramp_time();
+
+  // Pieces: ramping up acceleration, constant acceleration, ramping down.
+  // The end of each piece is rounded to full steps of the defining axis, and
+  // the speed taken at the time we reach that step, so that each piece
+  // follows the profile exactly and doesn't exceed acceleration or jerk.
+  // Pieces that are too short to contain steps are merged with the previous
+  // one, so we keep one piece pending before sending it out.
+  const int pieces = 2 * ramp_pieces + 1;
+  struct LinearSegmentSteps pending = command;
+  bool has_pending = false;
+  int count = 0;
+  int steps_done[BEAGLEG_NUM_MOTORS] = {0};
+  for (int p = 1; p <= pieces; ++p) {
+    double t;
+    if (p <= ramp_pieces)
+      t = ramp_time * p / ramp_pieces;
+    else
+      t = total_time - ramp_time * (pieces - p) / ramp_pieces;
+    const bool is_last = (p == pieces);
+    const long end_step = is_last
+      ? defining_axis_steps : std::lround(profile.distance_at(t));
+    const double fraction = 1.0 * end_step / defining_axis_steps;
+    const float speed = is_last
+      ? command.v1 : (float)profile.speed_at(profile.time_at_distance(end_step));
+
+    struct LinearSegmentSteps piece = command;
+    bool has_steps = false;
+    for (int m = 0; m < BEAGLEG_NUM_MOTORS; ++m) {
+      const int steps = std::lround(fraction * command.steps[m]);
+      piece.steps[m] = steps - steps_done[m];
+      steps_done[m] = steps;
+      has_steps |= (piece.steps[m] != 0);
+    }
+
+    if (!has_steps) {
+      pending.v1 = speed;  // Only extend speed change of pending piece.
+      continue;
+    }
+    if (has_pending) {
+      out[count++] = pending;
+      piece.v0 = pending.v1;
+    }
+    piece.v1 = speed;
+    pending = piece;
+    has_pending = true;
+  }
+  out[count++] = pending;
+  return count;
+}
+
+// Plan the entry speeds of all segments in the planning buffer that have not
+// been emitted yet. The entry speed of the first of these, planning_buffer_[1],
+// is already fixed, as the previous segment has been emitted with it.
+//
+// The backward pass makes sure that we always can decelerate to a full stop
+// at the end of the buffer, the forward pass limits the speeds to what we
+// can reach by acceleration.
+//
+// Re-planning is incremental: a new segment at the end can only raise entry
+// speeds, so the backward pass stops at the first segment whose entry speed
+// does not change, as all the ones before stay the same as well. Neither pass
+// goes beyond the planned_ watermark: segments entered at their maximum speed
+// or at the highest speed reachable by acceleration are optimal. This keeps
+// the cost per new segment amortized constant even with deep lookahead.
+void Planner::Impl::plan_lookahead() {
+  if (!incremental_planning_) {
+    planned_ = 1;
+    full_replan_ = true;
+  }
+  const int size = planning_buffer_.size();
+  if (planned_ >= size) planned_ = size - 1;
+  int first_changed = planned_ + 1;
+  PlannerFloat next_entry_speed = 0;   // Need to come to a stop at the end.
+  for (int i = size - 1; i > planned_; --i) {
+    struct AxisTarget *t = planning_buffer_[i];
+    const PlannerFloat entry_speed = std::min(
+      t->max_entry_speed,
+      get_reachable_speed(next_entry_speed, t->accel, t->len));
+    if (!full_replan_ && i < size - 1 && entry_speed == t->entry_speed) {
+      first_changed = i + 1;
+      break;
+    }
+    t->entry_speed = entry_speed;
+    next_entry_speed = entry_speed;
+  }
+  full_replan_ = false;
+
+  for (int i = first_changed; i < size; ++i) {
+    const struct AxisTarget *previous = planning_buffer_[i-1];
+    struct AxisTarget *t = planning_buffer_[i];
+    const PlannerFloat reachable = get_reachable_speed(previous->entry_speed,
+                                                       previous->accel,
+                                                       previous->len);
+    // If we accelerate into this segment as fast as we can, or enter it with
+    // the maximum speed, neither it nor the previous ones can get any faster.
+    if (t->entry_speed >= reachable) {
+      t->entry_speed = reachable;
+      planned_ = i;
+    } else if (t->entry_speed >= t->max_entry_speed) {
+      planned_ = i;
+    }
+  }
+}
+
+// Emit planned segments to the motor operations. The exit speed of a segment
+// is only final once it can't change anymore with more segments arriving:
+// if it is already at the junction limit or is as fast as we can accelerate
+// to. Otherwise we hold on to it until lookahead_ segments after it are
+// known. planning_buffer_[0] is the last emitted position, [1] the segment
+// to emit, so this is the case with lookahead_ + 2 elements in the buffer.
+// If "flush" is set, all segments are emitted, coming to a halt at the end.
+bool Planner::Impl::issue_motor_moves_if_possible(bool flush) {
+  plan_lookahead();
   bool ret = true;
-  if (planning_buffer_.size() >= 3) {
-    ret = move_machine_steps(planning_buffer_[0],  // Current established position.
-                             planning_buffer_[1],  // Position we want to move to.
-                             planning_buffer_[2]); // Next upcoming.
+  while (planning_buffer_.size() >= 2) {
+    const struct AxisTarget *current = planning_buffer_[1];
+    PlannerFloat exit_speed = 0;
+    if (planning_buffer_.size() >= 3) {
+      const struct AxisTarget *next = planning_buffer_[2];
+      exit_speed = next->entry_speed;
+      const bool is_final = (exit_speed >= next->max_entry_speed ||
+                             exit_speed >= get_reachable_speed(
+                               current->entry_speed, current->accel,
+                               current->len));
+      if (!flush && !is_final && planning_buffer_.size() < lookahead_ + 2)
+        break;
+    } else if (!flush) {
+      break;   // The last segment needs to wait for what comes next.
+    }
+    ret = move_machine_steps(current, current->entry_speed, exit_speed);
     planning_buffer_.pop_front();
+    if (planned_ > 1) --planned_;
+    if (!ret) break;
+  }
+  return ret;
+}
+
+// Distance of point "p" to the line from "start" to "end" in all axes.
+// Returns a negative value if the point does not project between start and
+// end, i.e. going through "p" would not be moving forward.
+static double distance_to_chord(const AxesRegister &start,
+                                const AxesRegister &end,
+                                const AxesRegister &p) {
+  double chord_len_sq = 0, p_len_sq = 0, dot = 0;
+  for (const GCodeParserAxis a : AllAxes()) {
+    const double chord = end[a] - start[a];
+    const double delta = p[a] - start[a];
+    chord_len_sq += chord * chord;
+    p_len_sq += delta * delta;
+    dot += chord * delta;
+  }
+  if (dot <= 0 || dot >= chord_len_sq) return -1;
+  const double dist_sq = p_len_sq - dot * dot / chord_len_sq;
+  return dist_sq > 0 ? std::sqrt(dist_sq) : 0;
+}
+
+// Merge the new target with the pending segment if the resulting chord does
+// not deviate more than the chord tolerance from any of the merged points.
+// Otherwise, the pending segment is handed to the planner and the new target
+// starts the next merged segment.
+bool Planner::Impl::merge_or_move(const AxesRegister &axis, float feedrate,
+                                  HardwareMapping::AuxBitmap aux_bits) {
+  if (has_merged_segment_
+      && feedrate == merge_feedrate_ && aux_bits == merge_aux_bits_) {
+    // The previous merged points are within merge_deviation_ of the old
+    // chord. Both chords start at the same point, so their distance to the
+    // new chord is at most merge_deviation_ plus the distance of the end of
+    // the old chord.
+    const double distance = distance_to_chord(merge_start_, axis,
+                                              merge_target_);
+    if (distance >= 0
+        && merge_deviation_ + distance <= cfg_->chord_tolerance) {
+      merge_target_ = axis;
+      merge_deviation_ += distance;
+      return true;
+    }
+  }
+
+  bool ret = true;
+  if (has_merged_segment_) {
+    ret = flush_merged_segment();
+    merge_start_ = merge_target_;
+  } else {
+    const AxisTarget *last = planning_buffer_.back();
+    for (const GCodeParserAxis a : AllAxes()) {
+      merge_start_[a] = cfg_->steps_per_mm[a] != 0
+        ? last->position_steps[a] / cfg_->steps_per_mm[a] : 0;
+    }
   }
+  has_merged_segment_ = true;
+  merge_target_ = axis;
+  merge_feedrate_ = feedrate;
+  merge_aux_bits_ = aux_bits;
+  merge_deviation_ = 0;
   return ret;
 }
 
-bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
+bool Planner::Impl::flush_merged_segment() {
+  if (!has_merged_segment_) return true;
+  has_merged_segment_ = false;
+  return machine_move(merge_target_, merge_feedrate_, merge_aux_bits_);
+}
+
+PlannerFloat Planner::Impl::determine_max_entry_speed(
+  const struct AxisTarget *from, const struct AxisTarget *to) {
+  PlannerFloat joining_speed = cfg_->junction_deviation > 0
+    ? determine_junction_deviation_speed(from, to, cfg_->junction_deviation)
+    : determine_joining_speed(from, to,
+                              cfg_->threshold_angle, cfg_->speed_tune_angle);
+  if (joining_speed > from->speed) joining_speed = from->speed;
+  if (joining_speed > to->speed) joining_speed = to->speed;
+  return joining_speed;
+}
+
+// Take over a speed factor change: re-calculate the speeds of all segments
+// that are not emitted yet; they are re-planned with the next issue.
+//
+// Segments already in the motion queue are ramped to the new speed and then
+// executed with a uniform time scale, which keeps their speed profile
+// continuous but changes their acceleration with the square of the ratio.
+// So we only do that when slowing down; when speeding up, the planned
+// segments accelerate from the speed at which the motion queue leaves off.
+void Planner::Impl::apply_speed_factor() {
+  const float factor = speed_factor_request_.load();
+  if (factor == speed_factor_) return;
+  const float ratio = factor / speed_factor_;
+  speed_factor_ = factor;
+  planned_ = 1;
+  full_replan_ = true;
+
+  // The entry of the first not emitted segment is the exit speed of the last
+  // segment in the motion queue. Only if the motion queue could scale it,
+  // it changes.
+  if (ratio < 1.0 && motor_ops_->ScaleQueuedSpeed(ratio)
+      && planning_buffer_.size() >= 2) {
+    planning_buffer_[1]->entry_speed *= ratio;
+  }
+
+  // When slowing down, we might not be able to get to the new speed right
+  // away from the fixed entry speed. So the entry speeds can't be lower than
+  // what we get to decelerating as fast as we can.
+  PlannerFloat min_entry_speed = 0;
+  for (int i = 1; i < (int)planning_buffer_.size(); ++i) {
+    struct AxisTarget *t = planning_buffer_[i];
+    t->speed = clamp_to_limits(t, t->feedrate * speed_factor_);
+    if (i >= 2) {
+      const struct AxisTarget *previous = planning_buffer_[i-1];
+      min_entry_speed = get_lowest_reachable_speed(min_entry_speed,
+                                                   previous->accel,
+                                                   previous->len);
+      t->max_entry_speed = std::max(determine_max_entry_speed(previous, t),
+                                    min_entry_speed);
+      t->entry_speed = t->max_entry_speed;
+    } else {
+      min_entry_speed = t->entry_speed;
+    }
+  }
+}
+
+bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate,
+                                 HardwareMapping::AuxBitmap aux_bits) {
   assert(position_known_);   // call SetExternalPosition() after DirectDrive()
+  apply_speed_factor();
   // We always have a previous position.
   struct AxisTarget *previous = planning_buffer_.back();
   struct AxisTarget *new_pos = planning_buffer_.append();
@@ -533,7 +1099,7 @@ bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
 
   assert(max_steps > 0);
 
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
+  new_pos->aux_bits = aux_bits;
   new_pos->defining_axis = defining_axis;
 
   // Work out the real units values for the euclidian axes now to avoid
@@ -542,42 +1108,72 @@ bool Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   new_pos->dy = axis_delta_to_mm(new_pos, AXIS_Y);
   new_pos->dz = axis_delta_to_mm(new_pos, AXIS_Z);
   new_pos->len = euclid_distance(new_pos->dx, new_pos->dy, new_pos->dz);
+  if (new_pos->len == 0) {
+    // Not moving in euclidian space; the feedrate is given for the
+    // defining axis.
+    new_pos->len = std::fabs(axis_delta_to_mm(new_pos, defining_axis));
+  }
+  new_pos->steps_per_len = max_steps / new_pos->len;
 
-  // Work out the desired euclidian travel speed in steps/s on the defining axis.
-  new_pos->speed = feedrate * cfg_->steps_per_mm[defining_axis];
-  new_pos->speed = euclidian_speed(new_pos);
-  if (new_pos->speed > max_axis_speed_[defining_axis])
-    new_pos->speed = max_axis_speed_[defining_axis];
+  // Work out the desired travel speed, acceleration and jerk along the path.
+  new_pos->feedrate = feedrate;
+  new_pos->speed = clamp_to_limits(new_pos, feedrate * speed_factor_);
+  new_pos->accel = path_limit_for_move(new_pos, cfg_->acceleration);
+  new_pos->jerk = path_limit_for_move(new_pos, cfg_->jerk);
 
-  bool ret = issue_motor_move_if_possible();
-  if (ret) path_halted_ = false;
-  return ret;
+  if (path_halted_) {
+    new_pos->max_entry_speed = 0.0;   // Starting from standstill.
+  } else {
+    new_pos->max_entry_speed = determine_max_entry_speed(previous, new_pos);
+  }
+  new_pos->entry_speed = new_pos->max_entry_speed;
+
+  path_halted_ = false;
+  return issue_motor_moves_if_possible(false);
 }
 
 void Planner::Impl::bring_path_to_halt() {
+  flush_merged_segment();
   if (path_halted_) return;
-  // Enqueue a new position that is the same position as the last
-  // one seen, but zero speed. That will allow the previous segment to
-  // slow down. Enqueue.
-  struct AxisTarget *previous = planning_buffer_.back();
-  struct AxisTarget *new_pos = planning_buffer_.append();
-  for (const GCodeParserAxis a : AllAxes()) {
-    new_pos->position_steps[a] = previous->position_steps[a];
-    new_pos->delta_steps[a] = 0;
-  }
-  new_pos->defining_axis = AXIS_X;
-  new_pos->speed = 0;
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
-  new_pos->dx = new_pos->dy = new_pos->dz = new_pos->len = 0.0;
-  issue_motor_move_if_possible();
+  apply_speed_factor();
+  // Emit all remaining segments, with the last one slowing down to zero.
+  issue_motor_moves_if_possible(true);
+  const HardwareMapping::AuxBitmap aux_bits = hardware_mapping_->GetAuxBits();
+  if (last_aux_bits_ != aux_bits) {
+    // Special treatment: bits changed since last time, let's push them through.
+    struct LinearSegmentSteps bit_set_command = {};
+    bit_set_command.aux_bits = aux_bits;
+    motor_ops_->Enqueue(bit_set_command);
+    last_aux_bits_ = aux_bits;
+  }
   path_halted_ = true;
 }
 
+void Planner::Impl::publish_status() {
+  StatusSnapshot status = {};
+  status.has_physical_status
+    = motor_ops_->GetPhysicalStatus(&status.physical_status);
+  status.has_queue_stats = motor_ops_->GetQueueStats(&status.queue_stats);
+  std::lock_guard<std::mutex> l(status_mutex_);
+  status_ = status;
+}
+
+Planner::Impl::StatusSnapshot Planner::Impl::get_status() {
+  // If the planner thread is busy with the motor operations, we use what it
+  // published last.
+  std::unique_lock<std::mutex> l(motor_ops_mutex_, std::try_to_lock);
+  if (l.owns_lock())
+    publish_status();
+  std::lock_guard<std::mutex> s(status_mutex_);
+  return status_;
+}
+
 void Planner::Impl::GetCurrentPosition(AxesRegister *pos) {
   pos->zero();
-  PhysicalStatus physical_status;
-  if (!motor_ops_->GetPhysicalStatus(&physical_status))
+  const StatusSnapshot status = get_status();
+  if (!status.has_physical_status)
     return;   // Should we return boolean to indicate that not supported ?
+  const PhysicalStatus &physical_status = status.physical_status;
   for (const GCodeParserAxis a : AllAxes()) {
 #if M114_DEBUG
     Log_debug("Machine steps Axis %c : %8d\n", gcodep_axis2letter(a),
@@ -591,7 +1187,7 @@ void Planner::Impl::GetCurrentPosition(AxesRegister *pos) {
 
 int Planner::Impl::DirectDrive(GCodeParserAxis axis, float distance,
                                float v0, float v1) {
-  bring_path_to_halt();     // Precondition. Let's just do it for good measure.
+  BringPathToHalt();        // Precondition. Let's just do it for good measure.
   position_known_ = false;
 
   const float steps_per_mm = cfg_->steps_per_mm[axis];
@@ -617,7 +1213,8 @@ int Planner::Impl::DirectDrive(GCodeParserAxis axis, float distance,
 }
 
 void Planner::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
-  assert(path_halted_);   // Precondition.
+  wait_commands_done();
+  assert(path_halted_ && !has_merged_segment_);   // Precondition.
   position_known_ = true;
 
   const int motor_position = std::lround(pos * cfg_->steps_per_mm[axis]);
@@ -631,6 +1228,23 @@ void Planner::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
   }
 }
 
+void Planner::Impl::SetSpeedFactor(float factor) {
+  speed_factor_request_ = factor;
+  // If the planner thread is busy, it picks up the new factor before
+  // planning the next move. Otherwise, we can apply it right away.
+  std::unique_lock<std::mutex> l(motor_ops_mutex_, std::try_to_lock);
+  if (l.owns_lock())
+    apply_speed_factor();
+}
+
+bool Planner::Impl::GetQueueStats(MotionQueueStats *stats) {
+  const StatusSnapshot status = get_status();
+  if (!status.has_queue_stats)
+    return false;
+  *stats = status.queue_stats;
+  return true;
+}
+
 // -- public interface
 
 Planner::Planner(const MachineControlConfig *config,
@@ -642,11 +1256,11 @@ Planner::Planner(const MachineControlConfig *config,
 Planner::~Planner() { delete impl_; }
 
 bool Planner::Enqueue(const AxesRegister &target_pos, float speed) {
-  return impl_->machine_move(target_pos, speed);
+  return impl_->Enqueue(target_pos, speed);
 }
 
 void Planner::BringPathToHalt() {
-  impl_->bring_path_to_halt();
+  impl_->BringPathToHalt();
 }
 
 void Planner::GetCurrentPosition(AxesRegister *pos) {
@@ -661,3 +1275,15 @@ int Planner::DirectDrive(GCodeParserAxis axis, float distance,
 void Planner::SetExternalPosition(GCodeParserAxis axis, float pos) {
   impl_->SetExternalPosition(axis, pos);
 }
+
+void Planner::SetSpeedFactor(float factor) {
+  impl_->SetSpeedFactor(factor);
+}
+
+bool Planner::GetQueueStats(MotionQueueStats *stats) {
+  return impl_->GetQueueStats(stats);
+}
+
+void Planner::SetIncrementalPlanning(bool incremental) {
+  impl_->SetIncrementalPlanning(incremental);
+}
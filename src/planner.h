@@ -24,6 +24,13 @@
 struct MachineControlConfig;
 class HardwareMapping;
 class MotorOperations;
+struct MotionQueueStats;
+
+// Maximum number of segments the planner can look ahead. The actual
+// lookahead is configured in MachineControlConfig::lookahead_segments: the
+// number of segments following a segment that are taken into account when
+// planning its exit speed.
+enum { PLANNER_MAX_LOOKAHEAD = 1021 };
 
 // The planner receives a sequence of desired target positions.
 // It then plans acceleration and speed profile for the physical
@@ -65,6 +72,24 @@ public:
   // Precondition: BringPathToHalt() had been called before.
   void SetExternalPosition(GCodeParserAxis axis, float pos);
 
+  // Set a speed factor all feedrates are multiplied with, in addition to the
+  // one set by the program. Unlike the program speed factor, this applies
+  // immediately: the segments that are still planned are re-planned, and
+  // segments already waiting in the motion queue are slowed down if the
+  // factor goes down (speeding them up would exceed their acceleration).
+  // Might be called while the planner is busy with a long move; it is then
+  // applied as soon as the current segment has been handed to the motors.
+  void SetSpeedFactor(float factor);
+
+  // Re-planning only looks at segments whose speeds can still change with
+  // new segments arriving. If disabled, all segments that are not emitted
+  // yet are re-planned every time. Same result, just slower; for testing.
+  void SetIncrementalPlanning(bool incremental);
+
+  // Get the statistics of the motion queue the motor operations feed.
+  // Returns false if not available.
+  bool GetQueueStats(MotionQueueStats *stats);
+
 private:
   class Impl;
   Impl *const impl_;
@@ -0,0 +1,275 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Micro-benchmark of the planner: feeds pre-recorded paths into the Planner
+// and measures how long it takes to plan them. The motor operations are
+// replaced with a stub that only counts, so we measure the planner alone.
+//
+// Output is one tab-separated line per workload, with a header line
+// starting with '#', to be easily compared between builds.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "common/logging.h"
+
+#include "config-parser.h"
+#include "gcode-machine-control.h"
+#include "gcode-parser/gcode-parser.h"
+#include "hardware-mapping.h"
+#include "motor-operations.h"
+#include "planner.h"
+
+namespace {
+struct PathElement {
+  AxesRegister pos;
+  float feedrate;
+};
+typedef std::vector<PathElement> Path;
+
+// Motor operations that just count what they receive.
+class CountingMotorOperations : public MotorOperations {
+public:
+  CountingMotorOperations() : segments_(0) {}
+
+  bool Enqueue(const LinearSegmentSteps &segment) final {
+    ++segments_;
+    return true;
+  }
+  void MotorEnable(bool on) final {}
+  void WaitQueueEmpty() final {}
+  bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
+  void SetExternalPosition(int axis, int steps) final {}
+
+  long segments() const { return segments_; }
+
+private:
+  long segments_;
+};
+
+// Event receiver recording the linear moves the parser creates, with arcs
+// and splines already broken down into segments.
+class PathRecorder : public GCodeParser::EventReceiver {
+public:
+  PathRecorder(Path *path, float rapid_feedrate)
+    : path_(path), rapid_feedrate_(rapid_feedrate), feedrate_(100) {}
+
+  void gcode_start(GCodeParser *parser) final {}
+  void go_home(AxisBitmap_t axis_bitmap) final {}
+  bool probe_axis(float feed_mm_p_sec, enum GCodeParserAxis axis,
+                  float *probed_position) final { return false; }
+  void set_speed_factor(float factor) final {}
+  void set_fanspeed(float value) final {}
+  void set_temperature(float degrees_c) final {}
+  void wait_temperature() final {}
+  void dwell(float time_ms) final {}
+  void motors_enable(bool enable) final {}
+  bool coordinated_move(float feed_mm_p_sec,
+                        const AxesRegister &absolute_pos) final {
+    if (feed_mm_p_sec > 0) feedrate_ = feed_mm_p_sec;
+    path_->push_back({absolute_pos, feedrate_});
+    return true;
+  }
+  bool rapid_move(float feed_mm_p_sec,
+                  const AxesRegister &absolute_pos) final {
+    path_->push_back({absolute_pos,
+          feed_mm_p_sec > 0 ? feed_mm_p_sec : rapid_feedrate_});
+    return true;
+  }
+  const char *unprocessed(char letter, float value,
+                          const char *rest_of_line) final {
+    return NULL;
+  }
+
+private:
+  Path *const path_;
+  const float rapid_feedrate_;
+  float feedrate_;
+};
+
+struct BenchResult {
+  long input_segments;
+  long emitted_segments;
+  double best_ns;
+};
+}  // namespace
+
+static bool RecordGCodeFile(const char *filename, float rapid_feedrate,
+                            Path *path) {
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    perror(filename);
+    return false;
+  }
+  PathRecorder recorder(path, rapid_feedrate);
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  GCodeParser parser(parser_cfg, &recorder);
+  return parser.ReadFile(f, NULL) && parser.error_count() == 0;
+}
+
+// Many short segments on circles, as created by CAM programs for arcs.
+static void CreateDenseArcs(int segments, Path *path) {
+  const float kRadius = 20;
+  const float kAngleStep = 0.5 * M_PI / 180;   // ~0.17mm segments.
+  for (int i = 0; i < segments; ++i) {
+    PathElement e;
+    e.pos[AXIS_X] = 100 + kRadius * cosf(i * kAngleStep);
+    e.pos[AXIS_Y] = 100 + kRadius * sinf(i * kAngleStep);
+    e.feedrate = 150;
+    path->push_back(e);
+  }
+}
+
+// Back and forth with reversals on every segment, like infill or
+// engraving patterns.
+static void CreateZigZag(int segments, Path *path) {
+  for (int i = 0; i < segments; ++i) {
+    PathElement e;
+    e.pos[AXIS_X] = 100 + ((i % 2) ? 1 : 0);
+    e.pos[AXIS_Y] = 100 + 0.01 * i;
+    e.feedrate = 150;
+    path->push_back(e);
+  }
+}
+
+static BenchResult RunBenchmark(const MachineControlConfig &config,
+                                const Path &path, int repeat) {
+  HardwareMapping hardware;  // We never initialize, just sim mode.
+  hardware.AddMotorMapping(AXIS_X, 1, false);
+  hardware.AddMotorMapping(AXIS_Y, 2, false);
+  hardware.AddMotorMapping(AXIS_Z, 3, false);
+
+  BenchResult result = { (long) path.size(), 0, -1 };
+  for (int r = 0; r < repeat; ++r) {
+    CountingMotorOperations motor_ops;
+    Planner *planner = new Planner(&config, &hardware, &motor_ops);
+    const auto start = std::chrono::steady_clock::now();
+    for (const PathElement &e : path) {
+      planner->Enqueue(e.pos, e.feedrate);
+    }
+    planner->BringPathToHalt();
+    const auto end = std::chrono::steady_clock::now();
+    delete planner;
+
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    if (result.best_ns < 0 || ns < result.best_ns)
+      result.best_ns = ns;
+    result.emitted_segments = motor_ops.segments();
+  }
+  return result;
+}
+
+static void PrintResult(const char *name, const BenchResult &r) {
+  const double input = r.input_segments > 0 ? r.input_segments : 1;
+  printf("%s\t%ld\t%ld\t%.3f\t%.1f\t%.0f\n", name,
+         r.input_segments, r.emitted_segments,
+         r.emitted_segments / input,
+         r.best_ns / input,
+         r.best_ns > 0 ? 1e9 * r.input_segments / r.best_ns : 0);
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] [<gcode-file> ..]\n"
+          "Options:\n"
+          "\t-c <config>       : Machine config. Default: built-in 100 steps/mm.\n"
+          "\t-l <lookahead>    : Override number of lookahead segments.\n"
+          "\t-n <segments>     : Segments in generated workloads (default 100000).\n"
+          "\t-r <repeat>       : Runs per workload; best is reported (default 5).\n"
+          "Runs the generated dense-arc and zig-zag workloads and all given "
+          "gcode files.\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  MachineControlConfig config;
+  const char *config_file = NULL;
+  int lookahead = -1;
+  int generated_segments = 100000;
+  int repeat = 5;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:l:n:r:")) != -1) {
+    switch (opt) {
+    case 'c': config_file = optarg; break;
+    case 'l': lookahead = atoi(optarg); break;
+    case 'n': generated_segments = atoi(optarg); break;
+    case 'r': repeat = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (repeat < 1 || generated_segments < 0)
+    return usage(argv[0]);
+
+  Log_init("/dev/null");
+
+  if (config_file) {
+    ConfigParser config_parser;
+    if (!config_parser.SetContentFromFile(config_file)) {
+      fprintf(stderr, "Cannot read config file '%s'\n", config_file);
+      return 1;
+    }
+    if (!config.ConfigureFromFile(&config_parser)) {
+      fprintf(stderr, "Parse error in configuration file '%s'\n", config_file);
+      return 1;
+    }
+  } else {
+    for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+      config.steps_per_mm[axis] = 100;
+      config.max_feedrate[axis] = 300;
+      config.acceleration[axis] = 200;
+    }
+  }
+  if (lookahead > 0) config.lookahead_segments = lookahead;
+
+  // Don't assume homing; we start at the origin.
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    config.homing_trigger[i] = HardwareMapping::TRIGGER_NONE;
+  }
+
+  printf("#workload\tsegments\temitted\temitted_per_segment"
+         "\tns_per_enqueue\tsegments_per_sec\n");
+
+  Path path;
+  CreateDenseArcs(generated_segments, &path);
+  PrintResult("dense-arc", RunBenchmark(config, path, repeat));
+
+  path.clear();
+  CreateZigZag(generated_segments, &path);
+  PrintResult("zig-zag", RunBenchmark(config, path, repeat));
+
+  for (int i = optind; i < argc; ++i) {
+    path.clear();
+    if (!RecordGCodeFile(argv[i], config.max_feedrate[AXIS_X], &path)) {
+      printf("#%s not-processed\n", argv[i]);
+      continue;
+    }
+    PrintResult(argv[i], RunBenchmark(config, path, repeat));
+  }
+  return 0;
+}
@@ -6,6 +6,13 @@
 #include <string.h>
 #include <math.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <random>
+
 #include <gtest/gtest.h>
 
 #include "gcode-parser/gcode-parser.h"
@@ -13,6 +20,7 @@
 
 #include "gcode-machine-control.h"
 #include "hardware-mapping.h"
+#include "motion-queue.h"
 #include "motor-operations.h"
 
 // Using different steps/mm speeds results in problems right now.
@@ -39,7 +47,7 @@ static void InitTestConfig(struct MachineControlConfig *c) {
 class FakeMotorOperations : public MotorOperations {
 public:
   FakeMotorOperations(const MachineControlConfig &config)
-    : config_(config) {}
+    : config_(config), scales_queue_(true) {}
 
   bool Enqueue(const LinearSegmentSteps &segment) final {
 #if 0
@@ -87,8 +95,22 @@ public:
   void WaitQueueEmpty() final {}
   bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
   void SetExternalPosition(int axis, int steps) final {}
+  // Scales all segments we got so far, if enabled.
+  bool ScaleQueuedSpeed(float factor) final {
+    queue_scale_factors_.push_back(factor);
+    if (!scales_queue_) return false;
+    for (LinearSegmentSteps &s : collected_) {
+      s.v0 *= factor;
+      s.v1 *= factor;
+    }
+    return true;
+  }
+  void set_scales_queue(bool scales) { scales_queue_ = scales; }
 
   const std::vector<LinearSegmentSteps> &segments() { return collected_; }
+  const std::vector<float> &queue_scale_factors() {
+    return queue_scale_factors_;
+  }
 
 private:
   // Convert speeds in segments back to speed in euklidian space to have
@@ -124,6 +146,8 @@ private:
   const MachineControlConfig &config_;
   // We keep this public for easier testing
   std::vector<LinearSegmentSteps> collected_;
+  std::vector<float> queue_scale_factors_;
+  bool scales_queue_;
 };
 
 class PlannerHarness {
@@ -153,9 +177,27 @@ public:
   void Enqueue(const AxesRegister &target, float feed) {
     assert(!finished_);   // Can only call if segments() has not been called.
     //fprintf(stderr, "NewPos: (%.1f, %.1f)\n", target[AXIS_X], target[AXIS_Y]);
+    RememberMove(target);
     planner_->Enqueue(target, feed);
   }
 
+  // Set speed factor. Returns the number of segments emitted so far.
+  size_t SetSpeedFactor(float factor) {
+    planner_->SetSpeedFactor(factor);
+    return motor_ops_.segments().size();
+  }
+
+  const std::vector<float> &queue_scale_factors() {
+    return motor_ops_.queue_scale_factors();
+  }
+
+  void SetIncrementalPlanning(bool incremental) {
+    planner_->SetIncrementalPlanning(incremental);
+  }
+
+  // If disabled, the motion queue can't change segments once enqueued.
+  void SetQueueScaling(bool scales) { motor_ops_.set_scales_queue(scales); }
+
   const std::vector<LinearSegmentSteps> &segments() {
     if (!finished_) {
       planner_->BringPathToHalt();
@@ -164,17 +206,74 @@ public:
     return motor_ops_.segments();
   }
 
+  // Segments with speeds converted back from steps/s of the defining axis
+  // to mm/s along the path of the move they belong to. Segments of different
+  // moves can only be compared in this space, as they might have different
+  // defining axes.
+  std::vector<LinearSegmentSteps> euclid_segments() {
+    std::vector<LinearSegmentSteps> result = segments();
+    size_t move = 0;
+    int move_steps[3] = { 0, 0, 0 };
+    for (LinearSegmentSteps &s : result) {
+      assert(move < moves_.size());
+      const Move &m = moves_[move];
+      s.v0 *= m.len / m.defining_steps;
+      s.v1 *= m.len / m.defining_steps;
+      bool move_done = true;
+      for (int i = 0; i < 3; ++i) {
+        move_steps[i] += s.steps[i];  // Axis i is mapped to motor i+1
+        move_done &= (move_steps[i] == m.steps[i]);
+      }
+      if (move_done) {
+        ++move;
+        bzero(move_steps, sizeof(move_steps));
+      }
+    }
+    return result;
+  }
+
 private:
+  struct Move {
+    int steps[3];         // Steps in X, Y, Z.
+    int defining_steps;
+    double len;           // Euclidian length in mm.
+  };
+
+  void RememberMove(const AxesRegister &target) {
+    Move m;
+    double len_sq = 0;
+    m.defining_steps = 0;
+    for (int i = 0; i < 3; ++i) {
+      const GCodeParserAxis axis = (GCodeParserAxis) i;
+      const int pos = lround(target[axis] * config_->steps_per_mm[axis]);
+      m.steps[i] = pos - last_steps_[i];
+      last_steps_[i] = pos;
+      const double mm = m.steps[i] / config_->steps_per_mm[axis];
+      len_sq += mm * mm;
+      if (abs(m.steps[i]) > m.defining_steps)
+        m.defining_steps = abs(m.steps[i]);
+    }
+    if (m.defining_steps == 0) return;
+    m.len = sqrt(len_sq);
+    moves_.push_back(m);
+  }
+
   MachineControlConfig *config_;
   FakeMotorOperations motor_ops_;
   HardwareMapping simulated_hardware_;
   bool finished_;
   Planner *planner_;
+  int last_steps_[3] = { 0, 0, 0 };
+  std::vector<Move> moves_;
 };
 
 // Conditions that we expect in all moves.
+// Speeds of segments from euclid_segments() are converted back to mm/s with
+// the factor of the move they belong to, so the joining speeds between moves
+// only match up to rounding there; set "euclid_space" for these.
 static void VerifyCommonExpectations(
-      const std::vector<LinearSegmentSteps> &segments) {
+      const std::vector<LinearSegmentSteps> &segments,
+      bool euclid_space = false) {
   ASSERT_GT((int)segments.size(), 1) << "Expected more than one segment";
 
   // Some basic assumption: something is moving.
@@ -186,11 +285,13 @@ static void VerifyCommonExpectations(
 
   // The joining speeds between segments match.
   for (size_t i = 0; i < segments.size()-1; ++i) {
-    // Let's determine the speed in euclidian space.
-#if 1
-    EXPECT_EQ(segments[i].v1, segments[i+1].v0)
-      << "Joining speed between " << i << " and " << (i+1);
-#endif
+    if (euclid_space) {
+      EXPECT_NEAR(segments[i].v1, segments[i+1].v0, 1e-4 * segments[i].v1)
+        << "Joining speed between " << i << " and " << (i+1);
+    } else {
+      EXPECT_EQ(segments[i].v1, segments[i+1].v0)
+        << "Joining speed between " << i << " and " << (i+1);
+    }
   }
 }
 
@@ -316,6 +417,39 @@ TEST(PlannerTest, SimpleMove_AxisSpeedLimitClampsOverallSpeed_YY) {
   parametrizedAxisClamping(AXIS_Y, AXIS_Y);
 }
 
+// On a diagonal move, the acceleration is projected on each axis. The axis
+// with the lowest acceleration limits the overall acceleration, and that axis
+// is accelerating exactly with its limit.
+TEST(PlannerTest, SimpleMove_AxisAccelerationLimitsOverallAcceleration) {
+  const float kSlowAccel = 25;
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->acceleration[AXIS_X] = kSlowAccel;
+  PlannerHarness plantest(0, 0, config);
+
+  // Y has more steps/mm, so is the defining axis, but X is slow to accelerate.
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  pos[AXIS_Y] = 50;
+  plantest.Enqueue(pos, 10);
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_EQ(3, (int)segments.size());
+
+  // Acceleration in mm/s^2 of each axis in the acceleration segment.
+  const LinearSegmentSteps &accel = segments[0];
+  int defining_steps = 0;
+  for (int i = 0; i < 3; ++i)
+    defining_steps = std::max(defining_steps, abs(accel.steps[i]));
+  const float a = (accel.v1*accel.v1 - accel.v0*accel.v0) / (2 * defining_steps);
+  const float accel_x = a * abs(accel.steps[0]) / defining_steps
+    / config->steps_per_mm[AXIS_X];
+  const float accel_y = a * abs(accel.steps[1]) / defining_steps
+    / config->steps_per_mm[AXIS_Y];
+  EXPECT_NEAR(kSlowAccel, accel_x, 0.01 * kSlowAccel);
+  EXPECT_NEAR(kSlowAccel / 2, accel_y, 0.01 * kSlowAccel);  // Y moves half
+}
+
 static std::vector<LinearSegmentSteps> DoAngleMove(float threshold_angle,
                                                    float speed_tune_angle,
                                                    float start_angle,
@@ -339,7 +473,8 @@ static std::vector<LinearSegmentSteps> DoAngleMove(float threshold_angle,
   pos[AXIS_Y] = kSegmentLen * sin(radangle) + pos[AXIS_Y];
   plantest.Enqueue(pos, kFeedrate);
   std::vector<LinearSegmentSteps> segments = plantest.segments();
-  VerifyCommonExpectations(segments);
+  // Joining speeds between the moves are only comparable in euclidian space.
+  VerifyCommonExpectations(plantest.euclid_segments(), true);
   return segments;
 }
 
@@ -356,6 +491,55 @@ TEST(PlannerTest, CornerMove_90Degrees) {
   EXPECT_EQ(segments[1].v1, segments[2].v0);
 }
 
+// With junction deviation, we don't need to stop in a 90 degree corner, but
+// go around it with the speed given by the centripetal acceleration.
+TEST(PlannerTest, CornerMove_90Degrees_JunctionDeviation) {
+  const float kDeviation = 0.05;
+  const float kAccel = 100;
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->junction_deviation = kDeviation;
+  PlannerHarness plantest(0, 0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  plantest.Enqueue(pos, 1000);
+  pos[AXIS_Y] = 100;
+  plantest.Enqueue(pos, 1000);
+
+  const std::vector<LinearSegmentSteps> segments = plantest.euclid_segments();
+  VerifyCommonExpectations(segments);
+  ASSERT_EQ(4, (int)segments.size());
+
+  // Radius of the circle touching both segments with given deviation.
+  const float sin_half = sqrtf(0.5);
+  const float radius = kDeviation * sin_half / (1 - sin_half);
+  EXPECT_NEAR(sqrtf(kAccel * radius), segments[1].v1, 1e-3);
+}
+
+// Going straight does not slow down, turning around comes to a full stop.
+TEST(PlannerTest, JunctionDeviation_StraightAndReverse) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->junction_deviation = 0.05;
+  PlannerHarness plantest(0, 0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 10;
+  plantest.Enqueue(pos, 10);
+  pos[AXIS_X] = 20;
+  plantest.Enqueue(pos, 10);
+  pos[AXIS_X] = 10;
+  plantest.Enqueue(pos, 10);
+
+  const std::vector<LinearSegmentSteps> segments = plantest.euclid_segments();
+  VerifyCommonExpectations(segments);
+  // accel, travel; travel, decel; accel, travel, decel.
+  ASSERT_EQ(7, (int)segments.size());
+  EXPECT_FLOAT_EQ(10, segments[1].v1);
+  EXPECT_EQ(0, segments[3].v1);
+}
+
 void testShallowAngleAllStartingPoints(float threshold, float testing_angle) {
   const float kSpeedTuneAngle = 0.0f;
   // Essentially, we go around the circle as starting segments.
@@ -406,6 +590,443 @@ TEST(PlannerTest, CornerMove_Shallow_NegativeAngle) {
   testShallowAngleAllStartingPoints(kThresholdAngle, kTestingAngle);
 }
 
+// Run a long path of many tiny collinear segments with the given lookahead
+// and return the highest speed reached in steps/s.
+static float PeakSpeedForLookahead(int lookahead) {
+  const int kSegments = 200;
+  const float kSegmentLen = 0.1;
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = lookahead;
+  PlannerHarness plantest(0, 0, config);
+  AxesRegister pos;
+  for (int i = 1; i <= kSegments; ++i) {
+    pos[AXIS_X] = i * kSegmentLen;
+    plantest.Enqueue(pos, 1000);
+  }
+  VerifyCommonExpectations(plantest.segments());
+  float peak = 0;
+  for (const LinearSegmentSteps &s : plantest.segments()) {
+    peak = std::max(peak, std::max(s.v0, s.v1));
+  }
+  return peak;
+}
+
+// A move of a single step from standstill can't be split into acceleration
+// and deceleration, but still needs to move.
+TEST(PlannerTest, SingleStepMoveFromStandstill) {
+  PlannerHarness plantest;
+  AxesRegister pos;
+  pos[AXIS_X] = 0.001;   // 1 step
+  plantest.Enqueue(pos, 100);
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_EQ(1u, segments.size());
+  EXPECT_EQ(1, segments[0].steps[0]);
+  EXPECT_GT(segments[0].v1, 0);
+}
+
+// With deep lookahead, the planner knows that it has enough distance to
+// come to a stop, so it can accelerate further on short segments.
+TEST(PlannerTest, DeepLookaheadReachesHigherSpeed) {
+  const float kStepsPerMM = 1000;
+  const float kAccel = 100;
+  const float shallow = PeakSpeedForLookahead(4);
+  const float deep = PeakSpeedForLookahead(128);
+
+  // With only a few segments of lookahead, we always need to be able to
+  // stop within that distance. A segment is emitted once four segments
+  // after it are known, so its exit speed allows to stop within these; in
+  // the middle of the segment, it can go faster by half a segment.
+  EXPECT_NEAR(sqrtf(2 * kAccel * 4.5 * 0.1) * kStepsPerMM, shallow,
+              0.01 * shallow);
+
+  // Deep lookahead: accelerating for the first half, then slowing down.
+  EXPECT_NEAR(sqrtf(2 * kAccel * 10) * kStepsPerMM, deep, 0.01 * deep);
+  EXPECT_GT(deep, 4 * shallow);
+}
+
+// Acceleration of a segment in steps/s^2
+static float SegmentAcceleration(const LinearSegmentSteps &s) {
+  return (s.v1*s.v1 - s.v0*s.v0) / (2.0f * abs(s.steps[0]));
+}
+
+// Duration of a segment in seconds.
+static double SegmentTime(const LinearSegmentSteps &s) {
+  return 2.0 * abs(s.steps[0]) / (s.v0 + s.v1);
+}
+
+// Verify that the acceleration of all segments and, if "max_jerk" is given,
+// the jerk between them stays within the limits (steps/s^2, steps/s^3).
+// The acceleration of a segment is constant, so we take the jerk as the
+// change of acceleration over the time between the middles of the segments.
+static void VerifyAccelerationAndJerk(
+  const std::vector<LinearSegmentSteps> &segments,
+  double max_accel, double max_jerk) {
+  const double kRoundingTolerance = 1.01;  // Steps are integers.
+  for (size_t i = 0; i < segments.size(); ++i) {
+    const double accel = SegmentAcceleration(segments[i]);
+    EXPECT_LE(fabs(accel), max_accel * kRoundingTolerance) << "Segment " << i;
+    if (i == 0 || max_jerk <= 0) continue;
+    const double dt
+      = (SegmentTime(segments[i-1]) + SegmentTime(segments[i])) / 2;
+    const double jerk = (accel - SegmentAcceleration(segments[i-1])) / dt;
+    EXPECT_LE(fabs(jerk), max_jerk * kRoundingTolerance) << "Segment " << i;
+  }
+}
+
+// With jerk limitation, the speed changes are broken into several
+// segments of increasing, then decreasing acceleration.
+TEST(PlannerTest, JerkLimitedMoveHasSCurveSpeedChange) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->jerk[AXIS_X] = 10000;  // mm/s^3
+  PlannerHarness plantest(0, 0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 100;
+  plantest.Enqueue(pos, 10);  // Reaches full speed after 0.5mm
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments);
+  ASSERT_GT((int)segments.size(), 3);
+
+  int total_steps = 0;
+  for (const LinearSegmentSteps &s : segments) total_steps += s.steps[0];
+  EXPECT_EQ(100000, total_steps);
+
+  // Find the accelerating part.
+  size_t accel_end = 0;
+  while (accel_end < segments.size() && segments[accel_end].v1 > segments[accel_end].v0)
+    ++accel_end;
+  ASSERT_GE((int)accel_end, 3);
+  EXPECT_FLOAT_EQ(10 * 1000, segments[accel_end-1].v1);
+
+  // Acceleration is slowly ramping up and down again.
+  float peak = 0;
+  for (size_t i = 0; i < accel_end; ++i)
+    peak = std::max(peak, SegmentAcceleration(segments[i]));
+  EXPECT_LT(SegmentAcceleration(segments[0]), peak);
+  EXPECT_LT(SegmentAcceleration(segments[accel_end - 1]), peak);
+
+  // The acceleration limit is reached, but neither it nor the jerk limit
+  // are exceeded anywhere.
+  EXPECT_NEAR(100 * 1000, peak, 0.01 * 100 * 1000);
+  VerifyAccelerationAndJerk(segments, 100 * 1000, 10000 * 1000);
+}
+
+// Jerk limited speed changes need more distance than planned with constant
+// acceleration. Moves that are too short for that are done with constant
+// acceleration, but still don't exceed the acceleration limit.
+TEST(PlannerTest, JerkLimitedShortMovesStayWithinAcceleration) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->jerk[AXIS_X] = 10000;  // mm/s^3
+  PlannerHarness plantest(0, 0, config);
+
+  AxesRegister pos;
+  for (float x : { 10.0f, 10.05f, 10.1f, 12.0f, 12.02f }) {
+    pos[AXIS_X] = x;
+    plantest.Enqueue(pos, 10);
+  }
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments);
+  int total_steps = 0;
+  for (const LinearSegmentSteps &s : segments) total_steps += s.steps[0];
+  EXPECT_EQ(12020, total_steps);
+  VerifyAccelerationAndJerk(segments, 100 * 1000, 0);
+}
+
+// Collinear segments are merged into one with chord tolerance.
+TEST(PlannerTest, ChordTolerance_MergesCollinearSegments) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->chord_tolerance = 0.01;
+  PlannerHarness plantest(0, 0, config);
+
+  AxesRegister pos;
+  for (int i = 1; i <= 100; ++i) {
+    pos[AXIS_X] = i * 0.1;
+    pos[AXIS_Y] = i * 0.05;
+    plantest.Enqueue(pos, 10);
+  }
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  VerifyCommonExpectations(segments);
+  EXPECT_EQ(3, (int)segments.size());  // accel, travel, decel.
+
+  int total_x = 0, total_y = 0;
+  for (const LinearSegmentSteps &s : segments) {
+    total_x += s.steps[0];
+    total_y += s.steps[1];
+  }
+  EXPECT_EQ(10 * 1000, total_x);
+  EXPECT_EQ(5 * 4000, total_y);
+}
+
+// Corners deviating more than the tolerance are kept.
+TEST(PlannerTest, ChordTolerance_KeepsCorners) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->chord_tolerance = 0.01;
+  config->threshold_angle = 5;
+  PlannerHarness plantest(0, 0, config);
+
+  AxesRegister pos;
+  pos[AXIS_X] = 10;
+  plantest.Enqueue(pos, 10);
+  pos[AXIS_Y] = 10;
+  plantest.Enqueue(pos, 10);
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_EQ(6, (int)segments.size());
+  EXPECT_EQ(0, segments[2].v1);   // Full stop in the corner.
+}
+
+// Segments of an arc are merged as long as the chord stays within tolerance.
+TEST(PlannerTest, ChordTolerance_MergesArcSegments) {
+  const float kRadius = 10;
+  const int kArcSegments = 90;   // Quarter circle in 1 degree steps
+  int emitted[2];
+  for (int merge = 0; merge < 2; ++merge) {
+    MachineControlConfig *config = new MachineControlConfig();
+    InitTestConfig(config);
+    config->chord_tolerance = merge ? 0.01 : 0;
+    config->threshold_angle = 5;
+    PlannerHarness plantest(0, 0, config);
+    AxesRegister pos;
+    for (int i = 1; i <= kArcSegments; ++i) {
+      const float angle = i * M_PI / 180;
+      pos[AXIS_X] = kRadius * sinf(angle);
+      pos[AXIS_Y] = kRadius - kRadius * cosf(angle);
+      plantest.Enqueue(pos, 10);
+    }
+    // We end up at the same position.
+    int total_x = 0, total_y = 0;
+    for (const LinearSegmentSteps &s : plantest.segments()) {
+      total_x += s.steps[0];
+      total_y += s.steps[1];
+    }
+    EXPECT_EQ(kRadius * 1000, total_x);
+    EXPECT_EQ(kRadius * 4000, total_y);
+    emitted[merge] = plantest.segments().size();
+  }
+  EXPECT_LT(2 * emitted[1], emitted[0]);
+}
+
+// Planning in a separate thread results in the same segments.
+TEST(PlannerTest, ThreadedPlanningSameResult) {
+  std::vector<LinearSegmentSteps> result[2];
+  for (int threaded = 0; threaded < 2; ++threaded) {
+    MachineControlConfig *config = new MachineControlConfig();
+    InitTestConfig(config);
+    config->threaded_planning = threaded;
+    PlannerHarness plantest(5, 0, config);
+    AxesRegister pos;
+    for (int i = 1; i <= 1000; ++i) {   // More than fits in the thread queue.
+      pos[AXIS_X] = i * 0.1;
+      pos[AXIS_Y] = (i % 10 < 5) ? 0 : 0.5;
+      plantest.Enqueue(pos, 100);
+    }
+    result[threaded] = plantest.segments();
+  }
+  ASSERT_EQ(result[0].size(), result[1].size());
+  for (size_t i = 0; i < result[0].size(); ++i) {
+    EXPECT_EQ(0, memcmp(&result[0][i], &result[1][i],
+                        sizeof(LinearSegmentSteps))) << "segment " << i;
+  }
+}
+
+// Motor operations with a queue that is full after the first segment until
+// released.
+class FullQueueMotorOperations : public MotorOperations {
+public:
+  bool Enqueue(const LinearSegmentSteps &segment) final {
+    std::unique_lock<std::mutex> l(mutex_);
+    if (enqueued_ > 0) {
+      blocked_ = true;
+      cond_.notify_all();
+      cond_.wait(l, [this]() { return released_; });
+    }
+    enqueued_++;
+    return true;
+  }
+  void MotorEnable(bool on) final {}
+  void WaitQueueEmpty() final {}
+  bool GetPhysicalStatus(PhysicalStatus *status) final {
+    std::lock_guard<std::mutex> l(mutex_);
+    bzero(status, sizeof(*status));
+    status->pos_steps[0] = 1000 * enqueued_;
+    return true;
+  }
+  void SetExternalPosition(int axis, int steps) final {}
+  bool GetQueueStats(MotionQueueStats *stats) final {
+    std::lock_guard<std::mutex> l(mutex_);
+    bzero(stats, sizeof(*stats));
+    stats->capacity = 1;
+    stats->pending = enqueued_;
+    return true;
+  }
+
+  void WaitBlocked() {
+    std::unique_lock<std::mutex> l(mutex_);
+    cond_.wait(l, [this]() { return blocked_; });
+  }
+  void Release() {
+    std::lock_guard<std::mutex> l(mutex_);
+    released_ = true;
+    cond_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  int enqueued_ = 0;
+  bool blocked_ = false;
+  bool released_ = false;
+};
+
+// Position and queue stats don't wait for the planner thread blocked in a
+// full motion queue.
+TEST(PlannerTest, ThreadedPlanningStatusWhileQueueFull) {
+  MachineControlConfig config;
+  InitTestConfig(&config);
+  config.threaded_planning = true;
+  HardwareMapping hardware;
+  hardware.AddMotorMapping(AXIS_X, 1, false);
+  FullQueueMotorOperations motor_ops;
+  Planner *planner = new Planner(&config, &hardware, &motor_ops);
+  AxesRegister pos;
+  for (int i = 1; i <= 10; ++i) {
+    pos[AXIS_X] = i * 10;
+    planner->Enqueue(pos, 50);
+  }
+  motor_ops.WaitBlocked();
+
+  std::future<MotionQueueStats> stats = std::async(std::launch::async, [&]() {
+      MotionQueueStats result = {};
+      EXPECT_TRUE(planner->GetQueueStats(&result));
+      return result;
+    });
+  std::future<AxesRegister> position = std::async(std::launch::async, [&]() {
+      AxesRegister result;
+      planner->GetCurrentPosition(&result);
+      return result;
+    });
+  const std::chrono::seconds kTimeout(10);
+  const bool stats_done = stats.wait_for(kTimeout) == std::future_status::ready;
+  const bool position_done
+    = position.wait_for(kTimeout) == std::future_status::ready;
+  motor_ops.Release();
+  ASSERT_TRUE(stats_done);
+  ASSERT_TRUE(position_done);
+  // The last published status, before the segment that is blocking.
+  EXPECT_EQ(1, stats.get().pending);
+  EXPECT_EQ(1.0, position.get()[AXIS_X]);
+
+  delete planner;
+}
+
+// Changing the speed factor applies to segments already planned and scales
+// the speed of the ones waiting in the motion queue.
+TEST(PlannerTest, SpeedFactorAppliesToPlannedSegments) {
+  const float kStepsPerMM = 1000;   // X axis
+  PlannerHarness plantest;
+  AxesRegister pos;
+  for (int i = 1; i <= 10; ++i) {
+    pos[AXIS_X] = i * 10;
+    plantest.Enqueue(pos, 50);
+  }
+  const size_t emitted = plantest.SetSpeedFactor(0.5);
+  ASSERT_GT(emitted, 0u);
+  EXPECT_EQ(std::vector<float>(1, 0.5f), plantest.queue_scale_factors());
+  for (int i = 11; i <= 20; ++i) {
+    pos[AXIS_X] = i * 10;
+    plantest.Enqueue(pos, 50);
+  }
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_GT(segments.size(), emitted);
+  // Continuing where the scaled motion queue leaves off.
+  VerifyCommonExpectations(segments);
+  VerifyAccelerationAndJerk(segments, 100 * kStepsPerMM, 0);
+  float max_speed = 0;
+  for (size_t i = emitted; i < segments.size(); ++i) {
+    max_speed = std::max(max_speed, std::max(segments[i].v0, segments[i].v1));
+  }
+  EXPECT_NEAR(25 * kStepsPerMM, max_speed, 1.0);
+
+  // Speeding up again does not touch the motion queue.
+  plantest.SetSpeedFactor(1.0);
+  EXPECT_EQ(1u, plantest.queue_scale_factors().size());
+}
+
+// If the motion queue can't scale what is already enqueued, the planned
+// segments continue with its speed and slow down within the acceleration.
+TEST(PlannerTest, SpeedFactorWithoutQueueScalingDeceleratesSmoothly) {
+  const float kStepsPerMM = 1000;   // X axis
+  PlannerHarness plantest;
+  plantest.SetQueueScaling(false);
+  AxesRegister pos;
+  for (int i = 1; i <= 10; ++i) {
+    pos[AXIS_X] = i;
+    plantest.Enqueue(pos, 20);
+  }
+  const size_t emitted = plantest.SetSpeedFactor(0.1);
+  ASSERT_GT(emitted, 0u);
+  EXPECT_EQ(std::vector<float>(1, 0.1f), plantest.queue_scale_factors());
+  for (int i = 11; i <= 20; ++i) {
+    pos[AXIS_X] = i;
+    plantest.Enqueue(pos, 20);
+  }
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_GT(segments.size(), emitted);
+  EXPECT_GT(segments[emitted].v0, 2 * kStepsPerMM);   // Was still faster.
+  VerifyCommonExpectations(segments);
+  VerifyAccelerationAndJerk(segments, 100 * kStepsPerMM, 0);
+  EXPECT_NEAR(2 * kStepsPerMM, segments[segments.size() - 2].v0, 1.0);
+}
+
+// Incremental re-planning stops at the watermark of segments that can't
+// change anymore. It needs to result in exactly the same motor segments as
+// re-planning everything with each new segment, also after a speed factor
+// change re-calculated the speed limits of the planned segments.
+TEST(PlannerTest, IncrementalPlanningSameAsFullReplanning) {
+  const int kSegments = 3000;
+  std::vector<LinearSegmentSteps> result[2];
+  for (int incremental = 0; incremental < 2; ++incremental) {
+    MachineControlConfig *config = new MachineControlConfig();
+    InitTestConfig(config);
+    config->lookahead_segments = 200;
+    config->junction_deviation = 0.05;
+    PlannerHarness plantest(0, 0, config);
+    plantest.SetIncrementalPlanning(incremental);
+    // A random path of short segments with gentle turns, so that the
+    // distance to slow down spans many segments.
+    std::mt19937 rnd(42);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    AxesRegister pos;
+    float heading = 0;
+    float feedrate = 100;
+    for (int i = 1; i <= kSegments; ++i) {
+      heading += (uniform(rnd) - 0.5) * (i % 50 == 0 ? 3.0 : 0.3);
+      if (uniform(rnd) < 0.02) feedrate = 20 + 280 * uniform(rnd);
+      const float len = 0.05 + 0.5 * uniform(rnd);
+      pos[AXIS_X] += len * cosf(heading);
+      pos[AXIS_Y] += len * sinf(heading);
+      pos[AXIS_Z] += 0.01 * (uniform(rnd) - 0.5);
+      plantest.Enqueue(pos, feedrate);
+      if (i == kSegments / 2) plantest.SetSpeedFactor(0.5);
+      if (i == 3 * kSegments / 4) plantest.SetSpeedFactor(1.5);
+    }
+    result[incremental] = plantest.segments();
+  }
+  ASSERT_EQ(result[0].size(), result[1].size());
+  for (size_t i = 0; i < result[0].size(); ++i) {
+    EXPECT_EQ(0, memcmp(&result[0][i], &result[1][i],
+                        sizeof(LinearSegmentSteps))) << "segment " << i;
+  }
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
@@ -38,7 +38,14 @@ public:
   virtual bool StartExecution() = 0;
 
   // Wait for a beagleg-mapped event. Return number of events that have occured.
-  virtual unsigned WaitEvent() = 0;
+  // Waits at most "timeout_ms" milliseconds, or without limit if negative.
+  // Returns 0 if the timeout passed without an event.
+  virtual unsigned WaitEvent(int timeout_ms) = 0;
+
+  // File descriptor that becomes readable when an event occured, so that it
+  // can be watched in an event loop. WaitEvent() consumes the event.
+  // Returns -1 if not available.
+  virtual int EventFd() { return -1; }
 
   // Halt the PRU
   virtual bool Shutdown() = 0;
@@ -49,7 +56,8 @@ public:
   bool Init();
   bool AllocateSharedMem(void **pru_mmap, const size_t size);
   bool StartExecution();
-  unsigned WaitEvent();
+  unsigned WaitEvent(int timeout_ms);
+  int EventFd();
   bool Shutdown();
 };
 
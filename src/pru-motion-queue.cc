@@ -24,17 +24,22 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "common/logging.h"
 
 #include "generic-gpio.h"
 #include "pwm-timer.h"
 #include "hardware-mapping.h"
+#include "motor-interface-constants.h"
 #include "pru-hardware-interface.h"
 
+
 using internal::QueueStatus;
 
 //#define DEBUG_QUEUE
@@ -43,21 +48,72 @@ using internal::QueueStatus;
 // and write stuff into it from here. Mostly this is a ring-buffer with
 // commands to execute, but also configuration data, such as what to do when
 // an endswitch fires.
+// All members are naturally aligned words, so there is no padding; we don't
+// pack it to be able to take the address of ring buffer elements.
 struct PRUCommunication {
   volatile QueueStatus status;
-  volatile MotionSegment ring_buffer[QUEUE_LEN];
-} __attribute__((packed));
+  volatile uint32_t hold;   // Status of an element the PRU must not start.
+  volatile uint32_t ring_buffer[QUEUE_SIZE / 4];
+};
+static_assert(sizeof(QueueStatus) == 4, "Status is one 32 bit register.");
+static_assert(offsetof(PRUCommunication, ring_buffer) == 8,
+              "Ring buffer needs to follow status and hold without padding.");
+static_assert(sizeof(PRUCommunication) == 8 + QUEUE_SIZE,
+              "PRUCommunication layout does not match the PRU.");
+static_assert(QUEUE_SIZE % 4 == 0, "Queue needs to be whole 32 bit words.");
+static_assert(sizeof(PRUCommunication) <= PRU_DATA_RAM_SIZE,
+              "QUEUE_LEN too large: motion queue does not fit into PRU RAM.");
+static_assert(QUEUE_STATUS_INDEX_SHIFT == 24,
+              "QueueStatus layout does not match the PRU status register.");
+static_assert(QUEUE_LEN <= (1 << (32 - QUEUE_STATUS_INDEX_SHIFT)),
+              "QUEUE_LEN too large for the index in the status register.");
+
+static_assert(QUEUE_ELEMENT_MAX_SIZE == sizeof(MotionSegment),
+              "Slot size does not match MotionSegment.");
+
+// Value of the hold word that holds no element: the status the PRU compares
+// it with has no loops left.
+static const uint32_t kNoHold = 0xffffffff;
+
+int internal::EncodeMotionSegment(const MotionSegment &segment,
+                                  uint32_t *out) {
+  MotionSegment slot = segment;
+  slot.ends_in_motion = 0;  // Not sent to the hardware.
+  memcpy(out, &slot, sizeof(slot));
+  return sizeof(slot);
+}
+
+int internal::DecodeMotionSegment(const volatile uint32_t *in,
+                                  MotionSegment *segment) {
+  uint32_t words[sizeof(MotionSegment) / 4];
+  for (size_t i = 0; i < sizeof(words) / 4; ++i) {
+    words[i] = in[i];
+  }
+  memcpy(segment, words, sizeof(*segment));
+  return sizeof(*segment);
+}
+
+int internal::EncodedSegmentSize(uint32_t header_word) {
+  return QUEUE_ELEMENT_MAX_SIZE;
+}
+
+unsigned int internal::NextElementPosition(unsigned int pos, int size) {
+  // Same as in motor-interface-pru.p
+  const unsigned int next = pos + size;
+  return next > QUEUE_SIZE - QUEUE_ELEMENT_MAX_SIZE ? 0 : next;
+}
 
 #ifdef DEBUG_QUEUE
-static void DumpMotionSegment(volatile const struct MotionSegment *e,
+static void DumpMotionSegment(unsigned int pos,
                               volatile struct PRUCommunication *pru_data) {
-  if (e->state == STATE_EXIT) {
-    Log_debug("enqueue[%02td]: EXIT", e - pru_data->ring_buffer);
+  MotionSegment copy;
+  internal::DecodeMotionSegment(&pru_data->ring_buffer[pos / 4], &copy);
+  if (copy.state == STATE_EXIT) {
+    Log_debug("enqueue[%04u]: EXIT", pos);
   } else {
-    MotionSegment copy = (MotionSegment&) *e;
     std::string line;
-    line = StringPrintf("enqueue[%02td]: dir:0x%02x s:(%5d + %5d + %5d) = %5d ",
-                        e - pru_data->ring_buffer, copy.direction_bits,
+    line = StringPrintf("enqueue[%04u]: dir:0x%02x s:(%5d + %5d + %5d) = %5d ",
+                        pos, copy.direction_bits,
                         copy.loops_accel, copy.loops_travel, copy.loops_decel,
                         copy.loops_accel + copy.loops_travel + copy.loops_decel);
 
@@ -84,82 +140,281 @@ static void DumpMotionSegment(volatile const struct MotionSegment *e,
 }
 #endif
 
-// Calculate offset into ring-buffer.
-static inline unsigned int RingbufferOffset(unsigned int current, int offset) {
-  // Make sure to keep unsigned operations within reach in case QUEUE_LEN is
-  // not a clean 2^n
-  return (QUEUE_LEN + current + offset) % QUEUE_LEN;
+// Every element takes at least QUEUE_ELEMENT_MIN_SIZE bytes, so that is the
+// maximum number of elements we can have in the queue.
+static const int kMaxQueueElements = QUEUE_SIZE / QUEUE_ELEMENT_MIN_SIZE;
+
+class PRUMotionQueue::InFlightElements
+  : public RingDeque<unsigned int, kMaxQueueElements + 1> {
+};
+
+uint8_t PRUMotionQueue::ElementState(unsigned int pos) {
+  // The state is the first byte of the header.
+  return *(volatile uint8_t*) &pru_data_->ring_buffer[pos / 4];
+}
+
+void PRUMotionQueue::ClearPRUAbort(unsigned int pos) {
+  volatile uint8_t *state = (volatile uint8_t*) &pru_data_->ring_buffer[pos / 4];
+  *state = STATE_EMPTY;
 }
 
-void PRUMotionQueue::ClearPRUAbort(unsigned int idx) {
-  volatile MotionSegment *e = &pru_data_->ring_buffer[idx];
-  e->state = STATE_EMPTY;
+static int64_t GetMonotonicUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Forget about the elements the PRU is done with.
+void PRUMotionQueue::ReleaseFinishedElements() {
+  while (in_flight_->size() > 0
+         && ElementState(*(*in_flight_)[0]) == STATE_EMPTY) {
+    in_flight_->pop_front();
+  }
+  if (in_flight_->size() > 0) {
+    last_busy_usec_ = GetMonotonicUsec();
+  }
+}
+
+// Called right before new elements are handed to the PRU. If it ran out of
+// elements while the motors were still supposed to move, that was an
+// underrun: either the host did not get to run in time, or the planner did
+// not have the next segments yet.
+void PRUMotionQueue::CheckUnderrun() {
+  ReleaseFinishedElements();
+  if (!last_ends_in_motion_ || in_flight_->size() > 0)
+    return;
+  const int64_t duration = GetMonotonicUsec() - last_busy_usec_;
+  ++underruns_;
+  underrun_total_usec_ += duration;
+  if (duration > underrun_max_usec_) underrun_max_usec_ = duration;
+  last_ends_in_motion_ = false;
+  Log_info("Motion queue underrun #%d: motors stopped for up to %.1fms",
+           underruns_, duration / 1000.0);
 }
 
 int PRUMotionQueue::GetPendingElements(uint32_t *head_item_progress) {
   // Get data from the PRU
   const struct QueueStatus status = *(struct QueueStatus*) &pru_data_->status;
-  const unsigned int last_insert_index = RingbufferOffset(queue_pos_, -1);
   if (head_item_progress) {
     *head_item_progress = status.counter;
   }
+  ReleaseFinishedElements();
+  return in_flight_->size();
+}
+
+void PRUMotionQueue::GetQueueStats(MotionQueueStats *stats) {
+  stats->capacity = kMaxQueueElements;
+  stats->pending = GetPendingElements(NULL);
+  stats->underruns = underruns_;
+  stats->underrun_max_usec = underrun_max_usec_;
+  stats->underrun_total_usec = underrun_total_usec_;
+}
+
+// The PRU announces the element it is about to pick up in the status
+// register (its index, no loops left) before it checks the hold word, and
+// does not start the element the hold word points to. So once the hold is
+// visible to the PRU, a status that points elsewhere and a still filled
+// element mean that the PRU has not started it and won't until released.
+bool PRUMotionQueue::HoldElement(unsigned int pos) {
+  const uint32_t index = pos / QUEUE_ELEMENT_MAX_SIZE;
+  __sync_synchronize();  // Previous writes are done before moving the hold.
+  pru_data_->hold = index << QUEUE_STATUS_INDEX_SHIFT;
+  __sync_synchronize();
+  (void) pru_data_->hold;  // Reading it back, the write reached the PRU RAM.
+  __sync_synchronize();
+  const struct QueueStatus status = *(struct QueueStatus*) &pru_data_->status;
+  return status.index != index && ElementState(pos) == STATE_FILLED;
+}
+
+void PRUMotionQueue::ReleaseHold() {
+  __sync_synchronize();
+  pru_data_->hold = kNoHold;
+}
+
+bool PRUMotionQueue::ScaleQueuedSpeed(QueuedSpeedScaler *scaler) {
+  if (scaler->factor() <= 0) return false;
+  ReleaseFinishedElements();
+
+  // Start with the first element the PRU has not picked up yet.
+  size_t first = 0;
+  while (first < in_flight_->size() && !HoldElement(*(*in_flight_)[first])) {
+    ++first;
+  }
+  if (first >= in_flight_->size()) {
+    ReleaseHold();
+    return false;
+  }
 
-  if (pru_data_->ring_buffer[last_insert_index].state == STATE_EMPTY) {
-    return 0;
+  MotionSegment segments[kMaxQueueElements];
+  const size_t count = in_flight_->size() - first;
+  for (size_t i = 0; i < count; ++i) {
+    const unsigned int pos = *(*in_flight_)[first + i];
+    internal::DecodeMotionSegment(&pru_data_->ring_buffer[pos / 4],
+                                  &segments[i]);
+    scaler->Add(segments[i]);
   }
 
-  unsigned int queue_len = RingbufferOffset(queue_pos_, -status.index);
-  queue_len += queue_len ? 0 : QUEUE_LEN;
-  return queue_len;
+  // We only hold the element we're rewriting, so that the PRU has to wait
+  // at most for one element if it catches up with us.
+  bool scaled = false;
+  for (size_t i = 0; i < count; ++i) {
+    const unsigned int pos = *(*in_flight_)[first + i];
+    scaled = (i == 0 || HoldElement(pos));
+    scaler->Scale(&segments[i]);
+    if (!scaled) continue;   // The PRU got to it before us.
+
+    // The encoded size does not change. The header with the state stays as
+    // it is.
+    volatile uint32_t *e = &pru_data_->ring_buffer[pos / 4];
+    uint32_t encoded[QUEUE_ELEMENT_MAX_SIZE / 4];
+    const int size = internal::EncodeMotionSegment(segments[i], encoded);
+    for (int w = 1; w < size / 4; ++w) {
+      e[w] = encoded[w];
+    }
+  }
+  ReleaseHold();
+  return scaled;
 }
 
-// Stop gap for compiler attempting to be overly clever when copying between
-// host and PRU memory.
-static void unaligned_memcpy(volatile void *dest, const void *src, size_t size) {
-  volatile char *d = (volatile char*) dest;
-  const char *s = (char*) src;
-  const volatile char *end = d + size;
-  while (d < end) {
-    *d++ = *s++;
+// Returns true if an element of "size" bytes can be written at queue_pos_.
+bool PRUMotionQueue::HasSpaceFor(int size) {
+  ReleaseFinishedElements();
+  if (in_flight_->size() == 0)
+    return true;
+  const unsigned int oldest = *(*in_flight_)[0];
+  if (oldest == queue_pos_)
+    return false;   // Full.
+  if (oldest < queue_pos_)
+    return true;    // Everything up to the end of the ring buffer is free.
+  return queue_pos_ + size <= oldest;
+}
+
+// If the PRU aborted the oldest element, clear the abort and return true.
+bool PRUMotionQueue::CheckPRUAbort() {
+  if (in_flight_->size() == 0)
+    return false;
+  const unsigned int oldest = *(*in_flight_)[0];
+  if (ElementState(oldest) != STATE_ABORT)
+    return false;
+  ClearPRUAbort(oldest);
+  in_flight_->pop_front();
+  last_ends_in_motion_ = false;  // Stopped on purpose.
+  return true;
+}
+
+// We wait for PRU events with a timeout and then look at the queue again, so
+// that we don't hang if we ever miss an event.
+static const int kEventTimeoutMs = 100;
+
+// Wait until there is space for an element of "size" bytes. Returns false if
+// the PRU signaled an abort instead.
+bool PRUMotionQueue::WaitForSpace(int size) {
+  while (!HasSpaceFor(size)) {
+    if (CheckPRUAbort())
+      return false;
+    pru_interface_->WaitEvent(kEventTimeoutMs);
   }
+  return true;
 }
 
 bool PRUMotionQueue::Enqueue(MotionSegment *element) {
-  const uint8_t state_to_send = element->state;
-  assert(state_to_send != STATE_EMPTY);  // forgot to set proper state ?
-  // Initially, we copy everything with 'STATE_EMPTY', then flip the state
-  // to avoid a race condition while copying.
-  element->state = STATE_EMPTY;
-
-  queue_pos_ %= QUEUE_LEN;
-  while (pru_data_->ring_buffer[queue_pos_].state != STATE_EMPTY) {
-    if (pru_data_->ring_buffer[queue_pos_].state == STATE_ABORT) {
-      ClearPRUAbort(queue_pos_);
-      return false;
+  return EnqueueBatch(element, 1);
+}
+
+bool PRUMotionQueue::EnqueueBatch(MotionSegment *segments, int count) {
+  return EnqueueSegments(segments, count, true) == count;
+}
+
+int PRUMotionQueue::TryEnqueueBatch(MotionSegment *segments, int count) {
+  // Acknowledge the events that made the caller come back, so that the
+  // event file descriptor is not readable anymore.
+  pru_interface_->WaitEvent(0);
+  return EnqueueSegments(segments, count, false);
+}
+
+int PRUMotionQueue::EventFd() {
+  return pru_interface_->EventFd();
+}
+
+// Copying to PRU memory goes over the interconnect, so we want as few
+// accesses as possible: elements are 32 bit aligned and copied with word
+// stores. The first word containing the state is written last, once all
+// elements of a batch are in place.
+// Returns the number of segments enqueued; if "may_block" is false, this
+// can be less than "count". Returns -1 if the PRU signaled an abort.
+int PRUMotionQueue::EnqueueSegments(MotionSegment *segments, int count,
+                                    bool may_block) {
+  // Elements written, but not yet visible to the PRU. With short queues, at
+  // most half of them, so that the PRU does not wait for a whole batch.
+  static const int kMaxUnpublished = (QUEUE_LEN + 1) / 2 < 16
+    ? (QUEUE_LEN + 1) / 2 : 16;
+  unsigned int positions[kMaxUnpublished];
+  uint32_t headers[kMaxUnpublished];
+
+  int enqueued = 0;
+  while (enqueued < count) {
+    MotionSegment *const batch = segments + enqueued;
+    int unpublished = 0;
+    while (enqueued + unpublished < count && unpublished < kMaxUnpublished) {
+      const MotionSegment &segment = batch[unpublished];
+      assert(segment.state != STATE_EMPTY);  // forgot to set proper state ?
+      uint32_t encoded[QUEUE_ELEMENT_MAX_SIZE / 4];
+      const int size = internal::EncodeMotionSegment(segment, encoded);
+      if (!HasSpaceFor(size)) {
+        if (unpublished > 0)
+          break;   // Let the PRU have what we have so far before waiting.
+        if (!may_block)
+          return CheckPRUAbort() ? -1 : enqueued;
+        if (!WaitForSpace(size))
+          return -1;
+      }
+
+      volatile uint32_t *dest = &pru_data_->ring_buffer[queue_pos_ / 4];
+      for (int i = 1; i < size / 4; ++i) {
+        dest[i] = encoded[i];
+      }
+      positions[unpublished] = queue_pos_;
+      headers[unpublished] = encoded[0];
+      ++unpublished;
+
+      queue_pos_ = internal::NextElementPosition(queue_pos_, size);
     }
-    pru_interface_->WaitEvent();
-  }
 
-  volatile MotionSegment *queue_element = &pru_data_->ring_buffer[queue_pos_++];
-  unaligned_memcpy(queue_element, element, sizeof(*queue_element));
+    CheckUnderrun();
 
-  // Fully initialized. Tell busy-waiting PRU by flipping the state.
-  queue_element->state = state_to_send;
+    // All initialized. Tell the busy-waiting PRU by flipping the states in
+    // execution order; it might already start with the first ones while
+    // we're at it. The memory barrier makes sure that the PRU sees the rest
+    // of the element before it sees a non-empty state.
+    for (int i = 0; i < unpublished; ++i) {
+      __sync_synchronize();
+      pru_data_->ring_buffer[positions[i] / 4] = headers[i];
+      *in_flight_->append() = positions[i];
 
+      // Segments without loops, e.g. only setting aux bits, don't change
+      // whether the motors are moving.
+      const MotionSegment &segment = batch[i];
+      if (segment.loops_accel || segment.loops_travel || segment.loops_decel)
+        last_ends_in_motion_ = segment.ends_in_motion;
 #ifdef DEBUG_QUEUE
-  DumpMotionSegment(queue_element, pru_data_);
+      DumpMotionSegment(positions[i], pru_data_);
 #endif
-  return true;
+    }
+    enqueued += unpublished;
+  }
+  return enqueued;
 }
 
 void PRUMotionQueue::WaitQueueEmpty() {
-  const unsigned int last_insert_index = RingbufferOffset(queue_pos_, -1);
-  while (pru_data_->ring_buffer[last_insert_index].state != STATE_EMPTY) {
-    if (pru_data_->ring_buffer[last_insert_index].state == STATE_ABORT) {
+  while (in_flight_->size() > 0) {
+    const uint8_t state = ElementState(*in_flight_->back());
+    if (state == STATE_EMPTY || state == STATE_ABORT) {
       break;
     }
-    pru_interface_->WaitEvent();
+    pru_interface_->WaitEvent(kEventTimeoutMs);
   }
+  ReleaseFinishedElements();
+  last_ends_in_motion_ = false;  // Running empty now is intended.
 }
 
 void PRUMotionQueue::MotorEnable(bool on) {
@@ -173,15 +428,25 @@ void PRUMotionQueue::Shutdown(bool flush_queue) {
     Enqueue(&end_element);
     WaitQueueEmpty();
   }
+  if (underruns_ > 0) {
+    Log_info("Motion queue had %d underruns; longest %.1fms, total %.1fms",
+             underruns_, underrun_max_usec_ / 1000.0,
+             underrun_total_usec_ / 1000.0);
+  }
   pru_interface_->Shutdown();
   MotorEnable(false);
 }
 
-PRUMotionQueue::~PRUMotionQueue() {}
+PRUMotionQueue::~PRUMotionQueue() {
+  delete in_flight_;
+}
 
 PRUMotionQueue::PRUMotionQueue(HardwareMapping *hw, PruHardwareInterface *pru)
   : hardware_mapping_(hw),
-    pru_interface_(pru) {
+    pru_interface_(pru),
+    in_flight_(new InFlightElements()),
+    last_ends_in_motion_(false), last_busy_usec_(0), underruns_(0),
+    underrun_max_usec_(0), underrun_total_usec_(0) {
   const bool success = Init();
   // For now, we just assert-fail here, if things fail.
   // Typically hardware-doomed event anyway.
@@ -197,8 +462,9 @@ bool PRUMotionQueue::Init() {
                                          sizeof(*pru_data_)))
     return false;
 
-  for (int i = 0; i < QUEUE_LEN; ++i) {
-    pru_data_->ring_buffer[i].state = STATE_EMPTY;
+  pru_data_->hold = kNoHold;
+  for (int i = 0; i < QUEUE_SIZE / 4; ++i) {
+    pru_data_->ring_buffer[i] = 0;  // All elements STATE_EMPTY.
   }
   queue_pos_ = 0;
 
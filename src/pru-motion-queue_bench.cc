@@ -0,0 +1,168 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Micro-benchmark of the PRUMotionQueue: measures the host side cost of
+// enqueuing motion segments into the ring buffer in the shared memory.
+// The PRU is replaced by a mock that, whenever the host waits for a free
+// space, consumes all segments at once. Note that the mock shared memory is
+// regular RAM; on the BeagleBone, the accesses go over the interconnect to
+// the PRU RAM and are considerably more expensive.
+//
+// Output is one tab-separated line per mode, with a header line starting
+// with '#', to be easily compared between builds.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include <chrono>
+#include <vector>
+
+#include "common/logging.h"
+
+#include "hardware-mapping.h"
+#include "motion-queue.h"
+#include "motor-interface-constants.h"
+#include "pru-hardware-interface.h"
+
+namespace {
+// Same layout as the PRUCommunication the PRUMotionQueue uses.
+struct MockPRUCommunication {
+  internal::QueueStatus status;
+  uint32_t hold;
+  uint32_t ring_buffer[QUEUE_SIZE / 4];
+};
+static_assert(sizeof(MockPRUCommunication) == 8 + QUEUE_SIZE,
+              "Same layout as the PRU communication.");
+
+// A PRU that executes everything in the queue as soon as we wait for it.
+class ImmediatePRUInterface : public PruHardwareInterface {
+public:
+  ImmediatePRUInterface() : mmap_(NULL), execution_pos_(0) {}
+  ~ImmediatePRUInterface() { free(mmap_); }
+
+  bool Init() final { return true; }
+  bool StartExecution() final { return true; }
+  bool Shutdown() final { return true; }
+
+  bool AllocateSharedMem(void **pru_mmap, const size_t size) final {
+    mmap_ = (struct MockPRUCommunication *) malloc(size);
+    bzero(mmap_, size);
+    *pru_mmap = (void *) mmap_;
+    return true;
+  }
+
+  unsigned WaitEvent(int timeout_ms) final {
+    volatile uint32_t *const ring = mmap_->ring_buffer;
+    while ((ring[execution_pos_ / 4] & 0xff) == STATE_FILLED) {
+      const uint32_t header = ring[execution_pos_ / 4];
+      ring[execution_pos_ / 4] = header & ~0xff;  // STATE_EMPTY
+      execution_pos_ = internal::NextElementPosition(
+        execution_pos_, internal::EncodedSegmentSize(header));
+    }
+    mmap_->status.index = execution_pos_ / QUEUE_ELEMENT_MAX_SIZE;
+    return 1;
+  }
+
+private:
+  struct MockPRUCommunication *mmap_;
+  unsigned int execution_pos_;
+};
+}  // namespace
+
+// Enqueue "count" segments, "batch" at a time (batch == 0: plain
+// Enqueue()). Returns the best time per segment in nanoseconds.
+static double RunBenchmark(int count, int batch, int repeat) {
+  std::vector<MotionSegment> segments(batch > 0 ? batch : 1);
+  for (size_t i = 0; i < segments.size(); ++i) {
+    MotionSegment &s = segments[i];
+    s = {};
+    s.state = STATE_FILLED;
+    s.direction_bits = i;
+    s.loops_travel = 1000;
+    s.travel_delay_cycles = 12345;
+    for (int m = 0; m < MOTION_MOTOR_COUNT; ++m)
+      s.fractions[m] = 0x10000 * (m + 1);
+  }
+
+  double best_ns = -1;
+  for (int r = 0; r < repeat; ++r) {
+    HardwareMapping hardware;  // Not initialized: no GPIO access.
+    ImmediatePRUInterface pru;
+    PRUMotionQueue queue(&hardware, &pru);
+
+    const auto start = std::chrono::steady_clock::now();
+    if (batch > 0) {
+      for (int i = 0; i < count; i += batch) {
+        queue.EnqueueBatch(segments.data(), batch);
+      }
+    } else {
+      for (int i = 0; i < count; ++i) {
+        queue.Enqueue(&segments[0]);
+      }
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    if (best_ns < 0 || ns < best_ns)
+      best_ns = ns;
+  }
+  return best_ns / count;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options]\n"
+          "Options:\n"
+          "\t-n <segments>     : Segments to enqueue per run (default 1000000).\n"
+          "\t-r <repeat>       : Runs per mode; best is reported (default 5).\n",
+          prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  int count = 1000000;
+  int repeat = 5;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+    case 'n': count = atoi(optarg); break;
+    case 'r': repeat = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (count < 1 || repeat < 1)
+    return usage(argv[0]);
+
+  Log_init("/dev/null");
+
+  printf("#mode\tsegments\tns_per_segment\tsegments_per_sec\n");
+  for (int batch : { 0, 1, 4, QUEUE_LEN }) {
+    const double ns = RunBenchmark(count, batch, repeat);
+    char name[32];
+    if (batch > 0)
+      snprintf(name, sizeof(name), "batch-%d", batch);
+    else
+      snprintf(name, sizeof(name), "single");
+    printf("%s\t%d\t%.1f\t%.0f\n", name, count, ns, ns > 0 ? 1e9 / ns : 0);
+  }
+  return 0;
+}
@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <functional>
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
@@ -24,17 +26,28 @@
 // PRU-side mock implementation of the ring buffer.
 struct MockPRUCommunication {
   internal::QueueStatus status;
-  MotionSegment ring_buffer[QUEUE_LEN];
-} __attribute__((packed));
+  uint32_t hold;
+  uint32_t ring_buffer[QUEUE_SIZE / 4];
+};
+static_assert(sizeof(MockPRUCommunication) == 8 + QUEUE_SIZE,
+              "Same layout as the PRU communication.");
 
 class MockPRUInterface : public PruHardwareInterface {
 public:
-  MockPRUInterface() : execution_index_(QUEUE_LEN - 1) { mmap = NULL; }
+  MockPRUInterface()
+    : wait_count(0), last_wait_timeout_ms(0), execution_pos_(0),
+      next_pos_(0) { mmap = NULL; }
   ~MockPRUInterface() { free(mmap); }
 
   bool Init() { return true; }
   bool StartExecution() { return true; }
-  unsigned WaitEvent() { return 1; }
+  unsigned WaitEvent(int timeout_ms) {
+    ++wait_count;
+    last_wait_timeout_ms = timeout_ms;
+    if (on_wait) on_wait();
+    return 1;
+  }
+  int EventFd() { return 42; }
   bool Shutdown() { return true; }
 
   bool AllocateSharedMem(void **pru_mmap, const size_t size) {
@@ -48,20 +61,60 @@ public:
               bool last_not_executed = true) {
     // Simulate the execution of num_exec motion segments
     for (int i=0; i < num_exec; ++i) {
-      execution_index_ = (execution_index_ + 1) % QUEUE_LEN;
-      assert(mmap->ring_buffer[execution_index_].state != STATE_EMPTY);
-      mmap->ring_buffer[execution_index_].state = STATE_EMPTY;
+      execution_pos_ = next_pos_;
+      uint8_t *state = (uint8_t*) &mmap->ring_buffer[execution_pos_ / 4];
+      assert(*state != STATE_EMPTY);
+      *state = STATE_EMPTY;
+      next_pos_ = internal::NextElementPosition(
+        execution_pos_,
+        internal::EncodedSegmentSize(mmap->ring_buffer[execution_pos_ / 4]));
     }
     if (last_not_executed || loops_left ) {
-      mmap->ring_buffer[execution_index_].state = STATE_FILLED;
+      *(uint8_t*) &mmap->ring_buffer[execution_pos_ / 4] = STATE_FILLED;
     }
-    mmap->status.index = execution_index_;
+    mmap->status.index = execution_pos_ / QUEUE_ELEMENT_MAX_SIZE;
     mmap->status.counter = loops_left;
   }
 
+  // The PRU is done with the current element and about to pick up the next.
+  void SimPickUpNext() {
+    mmap->status.index = next_pos_ / QUEUE_ELEMENT_MAX_SIZE;
+    mmap->status.counter = 0;
+  }
+
+  uint32_t hold() const { return mmap->hold; }
+
+  // The PRU detected an E-Stop while executing the current element.
+  void SimAbort() {
+    *(uint8_t*) &mmap->ring_buffer[execution_pos_ / 4] = STATE_ABORT;
+  }
+
+  // Decode the element at byte offset "pos" in the ring buffer.
+  MotionSegment segment_at(unsigned int pos) {
+    MotionSegment result;
+    internal::DecodeMotionSegment(&mmap->ring_buffer[pos / 4], &result);
+    return result;
+  }
+
+  // Decode the i-th element in the first round through the ring buffer.
+  MotionSegment segment(int i) {
+    unsigned int pos = 0;
+    for (/**/; i > 0; --i) {
+      pos = internal::NextElementPosition(
+        pos, internal::EncodedSegmentSize(mmap->ring_buffer[pos / 4]));
+    }
+    return segment_at(pos);
+  }
+
+  // Called in WaitEvent(), e.g. to let the PRU make progress.
+  std::function<void()> on_wait;
+  int wait_count;
+  int last_wait_timeout_ms;
+
 private:
   struct MockPRUCommunication *mmap;
-  unsigned int execution_index_;
+  unsigned int execution_pos_;
+  unsigned int next_pos_;
 };
 
 TEST(PruMotionQueue, status_init) {
@@ -73,6 +126,26 @@ TEST(PruMotionQueue, status_init) {
   EXPECT_EQ(motion_backend.GetPendingElements(NULL), 0);
 }
 
+TEST(PruMotionQueue, queue_stats) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  MotionQueueStats stats;
+  motion_backend.GetQueueStats(&stats);
+  EXPECT_EQ(QUEUE_SIZE / QUEUE_ELEMENT_MIN_SIZE, stats.capacity);
+  EXPECT_EQ(0, stats.pending);
+
+  struct MotionSegment segment = {};
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  pru_interface.SimRun(1, 0);
+  motion_backend.GetQueueStats(&stats);
+  EXPECT_EQ(2, stats.pending);
+}
+
 TEST(PruMotionQueue, single_exec) {
   MotorsRegister absolute_pos_loops;
   MockPRUInterface pru_interface = MockPRUInterface();
@@ -158,6 +231,259 @@ TEST(PruMotionQueue, exec_index_lt_queue_pos) {
   EXPECT_EQ(motion_backend.GetPendingElements(NULL), 2);
 }
 
+TEST(PruMotionQueue, enqueue_batch_wraps_around) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  // Acceleration segments with all motors moving have the maximum encoded
+  // size, so QUEUE_LEN of them fill the ring buffer.
+  struct MotionSegment segment = {};
+  segment.loops_accel = 100;
+  for (int m = 0; m < MOTION_MOTOR_COUNT; ++m)
+    segment.fractions[m] = 0x1000 * (m + 1);
+  for (int i = 0; i < 3; ++i) {
+    segment.state = STATE_FILLED;
+    motion_backend.Enqueue(&segment);
+  }
+  pru_interface.SimRun(3, 10);  // Executing the last one.
+  EXPECT_EQ(motion_backend.GetPendingElements(NULL), 1);
+
+  // Fill up the queue, wrapping around the end of the buffer.
+  const int kBatchSize = QUEUE_LEN - 2;
+  struct MotionSegment batch[kBatchSize];
+  for (int i = 0; i < kBatchSize; ++i) {
+    batch[i] = segment;
+    batch[i].hires_accel_cycles = 100 + i;
+  }
+  EXPECT_TRUE(motion_backend.EnqueueBatch(batch, kBatchSize));
+  EXPECT_EQ(motion_backend.GetPendingElements(NULL), kBatchSize + 1);
+
+  for (int i = 0; i < kBatchSize; ++i) {
+    const MotionSegment s = pru_interface.segment_at(
+      (3 + i) % QUEUE_LEN * QUEUE_ELEMENT_MAX_SIZE);
+    EXPECT_EQ(STATE_FILLED, s.state);
+    EXPECT_EQ(100u + i, s.hires_accel_cycles);
+    EXPECT_EQ(0x1000u * MOTION_MOTOR_COUNT,
+              s.fractions[MOTION_MOTOR_COUNT - 1]);
+  }
+}
+
+TEST(PruMotionQueue, try_enqueue_does_not_block) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+  EXPECT_EQ(42, motion_backend.EventFd());
+
+  const int kSegments = QUEUE_LEN + 10;
+  struct MotionSegment segments[kSegments] = {};
+  for (int i = 0; i < kSegments; ++i) {
+    segments[i].state = STATE_FILLED;
+    segments[i].loops_accel = 100;
+  }
+  EXPECT_EQ(QUEUE_LEN, motion_backend.TryEnqueueBatch(segments, kSegments));
+  EXPECT_EQ(0, motion_backend.TryEnqueueBatch(segments, kSegments));
+  EXPECT_EQ(QUEUE_LEN, motion_backend.GetPendingElements(NULL));
+
+  // Only acknowledging events, never waiting for them.
+  EXPECT_EQ(0, pru_interface.last_wait_timeout_ms);
+
+  // Two elements done, the third executing.
+  pru_interface.SimRun(3, 10);
+  EXPECT_EQ(2, motion_backend.TryEnqueueBatch(segments, kSegments));
+
+  // An abort is reported right away.
+  pru_interface.SimAbort();
+  EXPECT_EQ(-1, motion_backend.TryEnqueueBatch(segments, kSegments));
+}
+
+TEST(PruMotionQueue, waits_for_space_with_timeout) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  struct MotionSegment segment = {};
+  segment.loops_accel = 100;
+  for (int i = 0; i < QUEUE_LEN; ++i) {
+    segment.state = STATE_FILLED;
+    EXPECT_TRUE(motion_backend.Enqueue(&segment));
+  }
+  EXPECT_EQ(0, pru_interface.wait_count);
+
+  // The queue is full. The first events time out before the PRU is done with
+  // an element; we keep waiting, but never without a limit.
+  pru_interface.on_wait = [&pru_interface]() {
+    if (pru_interface.wait_count == 3) pru_interface.SimRun(2, 10);
+  };
+  segment.state = STATE_FILLED;
+  EXPECT_TRUE(motion_backend.Enqueue(&segment));
+  EXPECT_EQ(3, pru_interface.wait_count);
+  EXPECT_GT(pru_interface.last_wait_timeout_ms, 0);
+  EXPECT_EQ(QUEUE_LEN, motion_backend.GetPendingElements(NULL));
+}
+
+TEST(PruMotionQueue, encode_decode_roundtrip) {
+  uint32_t encoded[QUEUE_ELEMENT_MAX_SIZE / 4];
+  MotionSegment decoded;
+
+  // Travel, only the second motor moves.
+  MotionSegment travel = {};
+  travel.state = STATE_FILLED;
+  travel.direction_bits = 0x05;
+  travel.aux = 0xabcd;
+  travel.loops_travel = 1234;
+  travel.travel_delay_cycles = 56789;
+  travel.fractions[1] = 0x7fffffff;
+  const int kTravelSize = QUEUE_ELEMENT_MAX_SIZE;
+  EXPECT_EQ(kTravelSize, internal::EncodeMotionSegment(travel, encoded));
+  EXPECT_EQ(kTravelSize, internal::EncodedSegmentSize(encoded[0]));
+  EXPECT_EQ(kTravelSize, internal::DecodeMotionSegment(encoded, &decoded));
+  EXPECT_EQ(0, memcmp(&travel, &decoded, sizeof(decoded)));
+
+  // Acceleration and deceleration, all motors moving.
+  for (bool is_accel : { true, false }) {
+    MotionSegment accel = {};
+    accel.state = STATE_FILLED;
+    accel.direction_bits = 0xff;
+    accel.aux = 0x0001;
+    if (is_accel)
+      accel.loops_accel = 65535;
+    else
+      accel.loops_decel = 65535;
+    accel.accel_series_index = 42;
+    accel.hires_accel_cycles = 0x12345678;
+    for (int m = 0; m < MOTION_MOTOR_COUNT; ++m)
+      accel.fractions[m] = 0x10000 * (m + 1);
+    EXPECT_EQ(QUEUE_ELEMENT_MAX_SIZE,
+              internal::EncodeMotionSegment(accel, encoded));
+    EXPECT_EQ(QUEUE_ELEMENT_MAX_SIZE,
+              internal::DecodeMotionSegment(encoded, &decoded));
+    EXPECT_EQ(0, memcmp(&accel, &decoded, sizeof(decoded)));
+  }
+
+  // The exit element has no parameters.
+  MotionSegment exit_element = {};
+  exit_element.state = STATE_EXIT;
+  EXPECT_EQ(QUEUE_ELEMENT_MIN_SIZE,
+            internal::EncodeMotionSegment(exit_element, encoded));
+}
+
+
+TEST(PruMotionQueue, underrun_detection) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+  MotionQueueStats stats;
+
+  struct MotionSegment segment = {};
+  segment.loops_travel = 100;
+
+  // Running empty after a segment that comes to a stop is fine.
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  pru_interface.SimRun(1, 0, false);
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  motion_backend.GetQueueStats(&stats);
+  EXPECT_EQ(0, stats.underruns);
+
+  // Not so while the motors are still supposed to move.
+  segment.state = STATE_FILLED;
+  segment.ends_in_motion = 1;
+  motion_backend.Enqueue(&segment);
+  pru_interface.SimRun(2, 0, false);
+  segment.state = STATE_FILLED;
+  segment.ends_in_motion = 0;
+  motion_backend.Enqueue(&segment);
+  motion_backend.GetQueueStats(&stats);
+  EXPECT_EQ(1, stats.underruns);
+  EXPECT_GE(stats.underrun_total_usec, stats.underrun_max_usec);
+
+  // If the queue is still busy, the next segment is in time.
+  segment.state = STATE_FILLED;
+  segment.ends_in_motion = 1;
+  motion_backend.Enqueue(&segment);
+  pru_interface.SimRun(1, 0, false);  // The previous one.
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  motion_backend.GetQueueStats(&stats);
+  EXPECT_EQ(1, stats.underruns);
+
+  // Waiting for the queue to run empty is intended.
+  pru_interface.SimRun(2, 0, false);
+  motion_backend.WaitQueueEmpty();
+  segment.state = STATE_FILLED;
+  motion_backend.Enqueue(&segment);
+  motion_backend.GetQueueStats(&stats);
+  EXPECT_EQ(1, stats.underruns);
+}
+
+// Travel segments of 0.6s each.
+static void EnqueueLongTravel(PRUMotionQueue *motion_backend, int count) {
+  for (int i = 0; i < count; ++i) {
+    struct MotionSegment segment = {};
+    segment.state = STATE_FILLED;
+    segment.loops_travel = 60000;
+    segment.travel_delay_cycles = 1000;
+    segment.fractions[0] = 0x7fffffff;
+    motion_backend->Enqueue(&segment);
+  }
+}
+
+TEST(PruMotionQueue, scale_queued_speed) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  EnqueueLongTravel(&motion_backend, 8);
+  pru_interface.SimRun(1, 10);
+  QueuedSpeedScaler scaler(0.5);
+  EXPECT_TRUE(motion_backend.ScaleQueuedSpeed(&scaler));
+
+  // The executing segment is not touched. The next one decelerates to the
+  // new speed, all following ones travel with it.
+  EXPECT_EQ(1000u, pru_interface.segment(0).travel_delay_cycles);
+  EXPECT_EQ(60000, pru_interface.segment(1).loops_decel);
+  for (int i = 2; i < 8; ++i) {
+    EXPECT_EQ(60000, pru_interface.segment(i).loops_travel);
+    EXPECT_EQ(2000u, pru_interface.segment(i).travel_delay_cycles);
+    EXPECT_EQ(0x7fffffffu, pru_interface.segment(i).fractions[0]);
+    EXPECT_EQ(STATE_FILLED, pru_interface.segment(i).state);
+  }
+  EXPECT_EQ(0xffffffffu, pru_interface.hold());  // Released again.
+}
+
+// Once the PRU announced that it picks up an element, it is not changed
+// anymore.
+TEST(PruMotionQueue, scale_queued_speed_skips_picked_up) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  EnqueueLongTravel(&motion_backend, 4);
+  pru_interface.SimRun(1, 0, false);
+  pru_interface.SimPickUpNext();
+  QueuedSpeedScaler scaler(0.5);
+  EXPECT_TRUE(motion_backend.ScaleQueuedSpeed(&scaler));
+
+  EXPECT_EQ(1000u, pru_interface.segment(1).travel_delay_cycles);
+  EXPECT_EQ(60000, pru_interface.segment(2).loops_decel);
+  EXPECT_EQ(2000u, pru_interface.segment(3).travel_delay_cycles);
+}
+
+TEST(PruMotionQueue, scale_queued_speed_nothing_waiting) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  EnqueueLongTravel(&motion_backend, 1);
+  pru_interface.SimRun(1, 10);
+  QueuedSpeedScaler scaler(0.5);
+  EXPECT_FALSE(motion_backend.ScaleQueuedSpeed(&scaler));
+  EXPECT_EQ(1000u, pru_interface.segment(0).travel_delay_cycles);
+  EXPECT_EQ(0xffffffffu, pru_interface.hold());
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
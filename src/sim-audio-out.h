@@ -37,6 +37,11 @@ public:
       *head_item_progress = 0;
     return 1;
   }
+  void GetQueueStats(MotionQueueStats *stats) final {
+    *stats = {};
+    stats->capacity = 1;
+    stats->pending = 1;
+  }
 
 private:
   class AudioWriter;
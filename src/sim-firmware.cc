@@ -179,9 +179,6 @@ bool SimFirmwareQueue::Enqueue(MotionSegment *segment) {
                                       motor_speeds[Y_MOTOR],
                                       motor_speeds[Z_MOTOR]);
 
-#if JERK_EXPERIMENT
-  uint32_t jerk_index = 1;
-#endif
   bool is_first = true;
   uint32_t remainder = 0;
   const char *msg = "";
@@ -207,35 +204,7 @@ bool SimFirmwareQueue::Enqueue(MotionSegment *segment) {
     // for display purposes.
     double hires_delay = 0;
 
-#if JERK_EXPERIMENT
-    if (segment->jerk_start > 0) {
-      if (is_first) {
-        msg = "# jerk";
-        fprintf(stderr, "jerk start: jerk-timer-cycles=%.3f\n",
-                segment->jerk_motion);
-        is_first = false;
-      }
-      // TODO: index 0 ?
-      // TODO: is it 2* ?
-      segment->jerk_motion -= 2*segment->jerk_motion / ((3 * jerk_index) + 1);
-      --segment->jerk_start;
-      ++jerk_index;
-      delay_loops = segment->jerk_motion;
-      hires_delay = segment->jerk_motion;
-      if (hires_delay < 0) {
-        fprintf(stderr, "Got less than 0 at index %d\n", jerk_index);
-        segment->jerk_start = 0;
-        hires_delay = delay_loops = 30000;
-      }
-      if (segment->jerk_start == 0) {
-        fprintf(stderr, "jerk end  : jerk-timer-cycles=%.3f\n",
-                segment->jerk_motion);
-        is_first = true;
-      }
-    }
-    else
-#endif
-      if (segment->loops_accel > 0) {
+    if (segment->loops_accel > 0) {
       if (is_first) {
         msg = "# accel.";
         fprintf(stderr, "SIM: Accel start _/ : accel-series-idx=%5u, "
@@ -0,0 +1,323 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Implementation of the MotionQueue generating steps in a userspace thread.
+
+#include "threaded-step-motion-queue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/container.h"
+#include "common/logging.h"
+
+#include "motor-interface-constants.h"
+
+// Same capacity as the PRU queue with elements of the largest size.
+class ThreadedStepMotionQueue::SegmentQueue
+  : public RingDeque<MotionSegment, QUEUE_LEN + 1> {
+};
+
+static int64_t GetMonotonicNsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void StepEdgeRecorder::Step(const StepEdge &edge) {
+  std::lock_guard<std::mutex> l(mutex_);
+  edges_.push_back(edge);
+}
+
+std::vector<StepEdge> StepEdgeRecorder::TakeEdges() {
+  std::vector<StepEdge> result;
+  std::lock_guard<std::mutex> l(mutex_);
+  result.swap(edges_);
+  return result;
+}
+
+// Same as the CalculateDelay macro in motor-interface-pru.p: modifies the
+// parameters in "p" and stores the delay until the next loop in "delay".
+// Returns false if all loops are done. Unlike the PRU, we don't need to
+// correct the delay by the cycles spent in the calculation.
+static bool CalculateDelay(MotionSegment *p, uint32_t *remainder,
+                           uint32_t *delay) {
+  if (p->loops_accel > 0) {
+    if (p->accel_series_index != 0) {
+      const uint32_t divident = (p->hires_accel_cycles << 1) + *remainder;
+      const uint32_t divisor = (p->accel_series_index << 2) + 1;
+      p->hires_accel_cycles -= divident / divisor;
+      *remainder = divident % divisor;
+    }
+    ++p->accel_series_index;
+    --p->loops_accel;
+    *delay = p->hires_accel_cycles >> DELAY_CYCLE_SHIFT;
+    return true;
+  }
+  if (p->loops_travel > 0) {
+    --p->loops_travel;
+    *delay = p->travel_delay_cycles;
+    return true;
+  }
+  if (p->loops_decel > 0) {
+    const uint32_t divident = (p->hires_accel_cycles << 1) + *remainder;
+    const uint32_t divisor = (p->accel_series_index << 2) - 1;
+    p->hires_accel_cycles += divident / divisor;
+    *remainder = divident % divisor;
+    --p->accel_series_index;
+    --p->loops_decel;
+    *delay = p->hires_accel_cycles >> DELAY_CYCLE_SHIFT;
+    return true;
+  }
+  return false;
+}
+
+static void SleepUntil(int64_t time_ns) {
+  struct timespec ts;
+  ts.tv_sec = time_ns / 1000000000;
+  ts.tv_nsec = time_ns % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+// Generate the steps of one segment, starting at "*step_time_ns", which is
+// updated to the time the next segment starts. Returns false if aborted.
+bool ThreadedStepMotionQueue::ExecuteSegment(const MotionSegment &segment,
+                                             int64_t *step_time_ns) {
+  MotionSegment params = segment;
+  uint32_t motor_state[MOTION_MOTOR_COUNT] = {};
+  uint32_t remainder = 0;
+  remaining_loops_ = (segment.loops_accel + segment.loops_travel
+                      + segment.loops_decel);
+  for (;;) {
+    if (estop_ || !running_) {
+      remaining_loops_ = 0;
+      return false;
+    }
+
+    // The top bit of the 1.31 fixed point state is the step output, so a
+    // step happens when it goes from 0 to 1.
+    uint8_t step_bits = 0;
+    for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+      const uint32_t before = motor_state[i];
+      motor_state[i] += params.fractions[i];
+      if (~before & motor_state[i] & 0x80000000) step_bits |= (1 << i);
+    }
+    if (step_bits && receiver_) {
+      const StepEdge edge = { *step_time_ns - start_ns_,
+                              segment.direction_bits, step_bits,
+                              segment.aux };
+      receiver_->Step(edge);
+    }
+
+    uint32_t delay;
+    if (!CalculateDelay(&params, &remainder, &delay))
+      return true;
+    --remaining_loops_;
+
+    *step_time_ns += (int64_t) delay * 1000000000 / TIMER_FREQUENCY;
+    SleepUntil(*step_time_ns);
+  }
+}
+
+void ThreadedStepMotionQueue::Run() {
+  // Best effort: without the privileges, we just get a less precise timing.
+  struct sched_param p;
+  p.sched_priority = sched_get_priority_max(SCHED_FIFO);
+  if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &p) != 0) {
+    Log_debug("Step thread running without realtime priority.");
+  }
+
+  int64_t step_time_ns = GetMonotonicNsec();
+  MotionSegment segment;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> l(mutex_);
+      if (queue_->size() == 0) {
+        const int64_t idle_start_ns = GetMonotonicNsec();
+        changed_.wait(l, [this]() { return !running_ || queue_->size() > 0; });
+        step_time_ns = GetMonotonicNsec();
+        if (last_ends_in_motion_ && running_) {
+          // Ran empty while the motors should still be moving.
+          const int64_t duration = (step_time_ns - idle_start_ns) / 1000;
+          ++underruns_;
+          underrun_total_usec_ += duration;
+          if (duration > underrun_max_usec_) underrun_max_usec_ = duration;
+          Log_info("Motion queue underrun #%d: motors stopped for %.1fms",
+                   underruns_, duration / 1000.0);
+        }
+      }
+      if (!running_)
+        break;
+      segment = *(*queue_)[0];
+    }
+
+    const bool completed = (segment.state == STATE_EXIT
+                            || ExecuteSegment(segment, &step_time_ns));
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      queue_->pop_front();
+      if (segment.state == STATE_EXIT) {
+        running_ = false;
+      } else if (!completed) {
+        abort_seen_ = true;
+        last_ends_in_motion_ = false;  // Stopped on purpose.
+      } else if (segment.loops_accel || segment.loops_travel
+                 || segment.loops_decel) {
+        last_ends_in_motion_ = segment.ends_in_motion;
+      }
+    }
+    changed_.notify_all();
+    const uint64_t one = 1;
+    write(event_fd_, &one, sizeof(one));
+  }
+}
+
+// Returns the number of segments enqueued; if "may_block" is false, this can
+// be less than "count". Returns -1 if an abort happened or the queue is shut
+// down.
+int ThreadedStepMotionQueue::EnqueueSegments(MotionSegment *segments,
+                                             int count, bool may_block) {
+  std::unique_lock<std::mutex> l(mutex_);
+  int enqueued = 0;
+  for (/**/; enqueued < count; ++enqueued) {
+    assert(segments[enqueued].state != STATE_EMPTY);
+    if (may_block) {
+      changed_.wait(l, [this]() {
+          return queue_->size() < QUEUE_LEN || abort_seen_ || !running_;
+        });
+    }
+    if (abort_seen_) {
+      abort_seen_ = false;
+      return -1;
+    }
+    if (!running_)
+      return -1;
+    if (queue_->size() == QUEUE_LEN)
+      break;   // Full, and we are not allowed to wait.
+    *queue_->append() = segments[enqueued];
+    changed_.notify_all();
+  }
+  return enqueued;
+}
+
+bool ThreadedStepMotionQueue::Enqueue(MotionSegment *segment) {
+  return EnqueueBatch(segment, 1);
+}
+
+bool ThreadedStepMotionQueue::EnqueueBatch(MotionSegment *segments,
+                                           int count) {
+  return EnqueueSegments(segments, count, true) == count;
+}
+
+int ThreadedStepMotionQueue::TryEnqueueBatch(MotionSegment *segments,
+                                             int count) {
+  // Acknowledge the events that made the caller come back, so that the
+  // event file descriptor is not readable anymore.
+  uint64_t events;
+  read(event_fd_, &events, sizeof(events));
+  return EnqueueSegments(segments, count, false);
+}
+
+void ThreadedStepMotionQueue::WaitQueueEmpty() {
+  std::unique_lock<std::mutex> l(mutex_);
+  changed_.wait(l, [this]() { return queue_->size() == 0 || !running_; });
+  last_ends_in_motion_ = false;  // Running empty now is intended.
+}
+
+int ThreadedStepMotionQueue::GetPendingElements(uint32_t *head_item_progress) {
+  std::lock_guard<std::mutex> l(mutex_);
+  if (head_item_progress) {
+    *head_item_progress = queue_->size() > 0 ? remaining_loops_.load() : 0;
+  }
+  return queue_->size();
+}
+
+void ThreadedStepMotionQueue::GetQueueStats(MotionQueueStats *stats) {
+  *stats = {};
+  std::lock_guard<std::mutex> l(mutex_);
+  stats->capacity = QUEUE_LEN;
+  stats->pending = queue_->size();
+  stats->underruns = underruns_;
+  stats->underrun_max_usec = underrun_max_usec_;
+  stats->underrun_total_usec = underrun_total_usec_;
+}
+
+bool ThreadedStepMotionQueue::ScaleQueuedSpeed(QueuedSpeedScaler *scaler) {
+  if (scaler->factor() <= 0) return false;
+  std::lock_guard<std::mutex> l(mutex_);
+  // The first one is executing already.
+  if (queue_->size() < 2) return false;
+  for (size_t i = 1; i < queue_->size(); ++i) {
+    scaler->Add(*(*queue_)[i]);
+  }
+  for (size_t i = 1; i < queue_->size(); ++i) {
+    scaler->Scale((*queue_)[i]);
+  }
+  return true;
+}
+
+void ThreadedStepMotionQueue::StopThread() {
+  if (!thread_) return;
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    running_ = false;
+  }
+  changed_.notify_all();
+  thread_->join();
+  delete thread_;
+  thread_ = NULL;
+}
+
+void ThreadedStepMotionQueue::Shutdown(bool flush_queue) {
+  if (flush_queue) {
+    struct MotionSegment end_element = {};
+    end_element.state = STATE_EXIT;
+    Enqueue(&end_element);
+    WaitQueueEmpty();
+  }
+  StopThread();
+  if (underruns_ > 0) {
+    Log_info("Motion queue had %d underruns; longest %.1fms, total %.1fms",
+             underruns_, underrun_max_usec_ / 1000.0,
+             underrun_total_usec_ / 1000.0);
+  }
+}
+
+ThreadedStepMotionQueue::ThreadedStepMotionQueue(StepEdgeReceiver *receiver)
+  : receiver_(receiver), start_ns_(GetMonotonicNsec()),
+    event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    queue_(new SegmentQueue()), abort_seen_(false),
+    last_ends_in_motion_(false), underruns_(0), underrun_max_usec_(0),
+    underrun_total_usec_(0), running_(true), estop_(false), remaining_loops_(0),
+    thread_(NULL) {
+  thread_ = new std::thread([this]() { Run(); });
+}
+
+ThreadedStepMotionQueue::~ThreadedStepMotionQueue() {
+  StopThread();
+  delete queue_;
+  close(event_fd_);
+}
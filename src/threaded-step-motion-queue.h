@@ -0,0 +1,117 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_THREADED_STEP_MOTION_QUEUE_H_
+#define _BEAGLEG_THREADED_STEP_MOTION_QUEUE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "motion-queue.h"
+
+// Steps happening at the same time, as created by the step generator.
+struct StepEdge {
+  int64_t time_ns;         // Time since the queue was started.
+  uint8_t direction_bits;  // Directions of all motors at that time.
+  uint8_t step_bits;       // Motors that do a step (0->1 edge) now.
+  uint16_t aux;            // Aux bits of the segment.
+};
+
+// Receives the steps of the ThreadedStepMotionQueue. Called from the step
+// generator thread, so implementations need to be quick to not disturb the
+// timing.
+class StepEdgeReceiver {
+public:
+  virtual ~StepEdgeReceiver() {}
+  virtual void Step(const StepEdge &edge) = 0;
+};
+
+// Collects all steps in memory.
+class StepEdgeRecorder : public StepEdgeReceiver {
+public:
+  void Step(const StepEdge &edge) final;
+
+  // Returns the steps recorded so far and forgets about them.
+  std::vector<StepEdge> TakeEdges();
+
+private:
+  std::mutex mutex_;
+  std::vector<StepEdge> edges_;
+};
+
+// A MotionQueue that generates steps in userspace: a thread does the same as
+// the PRU in motor-interface-pru.p, waiting for the time of each step with
+// clock_nanosleep(). Steps are handed to a StepEdgeReceiver.
+//
+// Good for realistic timing and queue behavior on any Linux machine, e.g. for
+// soak tests. Like the PRU, the queue holds QUEUE_LEN segments. SetEStop()
+// simulates the emergency stop input the PRU checks before every step.
+class ThreadedStepMotionQueue : public MotionQueue {
+public:
+  // If "receiver" is NULL, the steps are only timed, but not passed on.
+  explicit ThreadedStepMotionQueue(StepEdgeReceiver *receiver);
+  ~ThreadedStepMotionQueue() override;
+
+  bool Enqueue(MotionSegment *segment) final;
+  bool EnqueueBatch(MotionSegment *segments, int count) final;
+  int TryEnqueueBatch(MotionSegment *segments, int count) final;
+  int EventFd() final { return event_fd_; }
+  void WaitQueueEmpty() final;
+  void MotorEnable(bool on) final {}
+  void Shutdown(bool flush_queue) final;
+  int GetPendingElements(uint32_t *head_item_progress) final;
+  void GetQueueStats(MotionQueueStats *stats) final;
+  bool ScaleQueuedSpeed(QueuedSpeedScaler *scaler) final;
+
+  // While the emergency stop is active, the segments are aborted when their
+  // execution starts.
+  void SetEStop(bool active) { estop_ = active; }
+
+private:
+  class SegmentQueue;
+
+  void Run();
+  bool ExecuteSegment(const MotionSegment &segment, int64_t *step_time_ns);
+  int EnqueueSegments(MotionSegment *segments, int count, bool may_block);
+  void StopThread();
+
+  StepEdgeReceiver *const receiver_;
+  const int64_t start_ns_;
+  const int event_fd_;                // Signaled when a segment is done.
+
+  std::mutex mutex_;                  // Guards the members up to the atomics.
+  std::condition_variable changed_;   // Queue or state changed.
+  SegmentQueue *const queue_;         // The first is executing.
+  bool abort_seen_;                   // Abort the host did not notice yet.
+  bool last_ends_in_motion_;          // Last executed segment still moving.
+  int underruns_;
+  int64_t underrun_max_usec_;
+  int64_t underrun_total_usec_;
+
+  std::atomic<bool> running_;         // Only changed with mutex_ held.
+  std::atomic<bool> estop_;
+  std::atomic<uint32_t> remaining_loops_;  // ... in the executing segment.
+  std::thread *thread_;
+};
+
+#endif  // _BEAGLEG_THREADED_STEP_MOTION_QUEUE_H_
@@ -0,0 +1,194 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Test for the threaded step generator.
+ *
+ * Steps are created in real time, so the segments here are short.
+ */
+#include "threaded-step-motion-queue.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+
+#include "motor-interface-constants.h"
+
+// Travel of "loops" loops, with the given delay cycles between them. Like the
+// motor operations, the first motor is the defining axis with two loops per
+// step.
+static MotionSegment TravelSegment(int loops, uint32_t delay_cycles) {
+  MotionSegment segment = {};
+  segment.state = STATE_FILLED;
+  segment.loops_travel = loops;
+  segment.travel_delay_cycles = delay_cycles;
+  segment.fractions[0] = 0xFFFFFFFF / 2;
+  segment.fractions[1] = 0xFFFFFFFF / 4;
+  return segment;
+}
+
+static int CountSteps(const std::vector<StepEdge> &edges, int motor) {
+  int result = 0;
+  for (const StepEdge &edge : edges) {
+    if (edge.step_bits & (1 << motor)) ++result;
+  }
+  return result;
+}
+
+TEST(ThreadedStepMotionQueue, steps_and_timing) {
+  StepEdgeRecorder recorder;
+  ThreadedStepMotionQueue queue(&recorder);
+
+  // 10us per loop.
+  MotionSegment segment = TravelSegment(200, TIMER_FREQUENCY / 100000);
+  segment.direction_bits = 0x02;
+  segment.aux = 0x42;
+  EXPECT_TRUE(queue.Enqueue(&segment));
+  queue.WaitQueueEmpty();
+
+  const std::vector<StepEdge> edges = recorder.TakeEdges();
+  EXPECT_EQ(100, CountSteps(edges, 0));
+  EXPECT_EQ(50, CountSteps(edges, 1));
+  EXPECT_EQ(0, CountSteps(edges, 2));
+  ASSERT_GT(edges.size(), 1u);
+  EXPECT_EQ(0x02, edges[0].direction_bits);
+  EXPECT_EQ(0x42, edges[0].aux);
+
+  // The defining axis steps every other loop; the time of the steps is
+  // exactly from the timing parameters.
+  EXPECT_EQ(99 * 20000, edges.back().time_ns - edges.front().time_ns);
+  queue.Shutdown(true);
+}
+
+TEST(ThreadedStepMotionQueue, acceleration_gets_faster) {
+  StepEdgeRecorder recorder;
+  ThreadedStepMotionQueue queue(&recorder);
+
+  MotionSegment segment = {};
+  segment.state = STATE_FILLED;
+  segment.loops_accel = 100;
+  segment.accel_series_index = 0;
+  segment.hires_accel_cycles = (TIMER_FREQUENCY / 1000) << DELAY_CYCLE_SHIFT;
+  segment.fractions[0] = 0xFFFFFFFF / 2;
+  EXPECT_TRUE(queue.Enqueue(&segment));
+  queue.WaitQueueEmpty();
+
+  const std::vector<StepEdge> edges = recorder.TakeEdges();
+  ASSERT_EQ(50u, edges.size());
+  for (size_t i = 2; i < edges.size(); ++i) {
+    EXPECT_LT(edges[i].time_ns - edges[i-1].time_ns,
+              edges[i-1].time_ns - edges[i-2].time_ns);
+  }
+  queue.Shutdown(true);
+}
+
+TEST(ThreadedStepMotionQueue, pending_elements) {
+  ThreadedStepMotionQueue queue(NULL);
+  MotionQueueStats stats;
+  queue.GetQueueStats(&stats);
+  EXPECT_EQ(QUEUE_LEN, stats.capacity);
+  EXPECT_EQ(0, stats.pending);
+
+  // 1ms per loop; the first one is still executing when we look.
+  MotionSegment segment = TravelSegment(100, TIMER_FREQUENCY / 1000);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(queue.Enqueue(&segment));
+  }
+  uint32_t head_progress;
+  EXPECT_EQ(3, queue.GetPendingElements(&head_progress));
+  EXPECT_LE(head_progress, 100u);
+
+  queue.Shutdown(false);  // Don't wait for it.
+}
+
+TEST(ThreadedStepMotionQueue, try_enqueue_does_not_block) {
+  ThreadedStepMotionQueue queue(NULL);
+
+  // Long enough to be still busy with the first when the queue is full.
+  std::vector<MotionSegment> segments(QUEUE_LEN + 5,
+                                      TravelSegment(65535, 1000));
+  EXPECT_EQ(QUEUE_LEN, queue.TryEnqueueBatch(segments.data(),
+                                             segments.size()));
+  EXPECT_EQ(0, queue.TryEnqueueBatch(segments.data(), 1));
+  queue.Shutdown(false);
+  EXPECT_EQ(-1, queue.TryEnqueueBatch(segments.data(), 1));
+}
+
+TEST(ThreadedStepMotionQueue, event_fd_signals_progress) {
+  ThreadedStepMotionQueue queue(NULL);
+  ASSERT_GE(queue.EventFd(), 0);
+  struct pollfd event_poll = { queue.EventFd(), POLLIN, 0 };
+  EXPECT_EQ(0, poll(&event_poll, 1, 0));
+
+  // 10us per loop; done well within the poll timeout.
+  std::vector<MotionSegment> segments(2, TravelSegment(10, 1000));
+  EXPECT_EQ(2, queue.TryEnqueueBatch(segments.data(), segments.size()));
+  EXPECT_EQ(1, poll(&event_poll, 1, 1000));
+
+  // The next enqueue acknowledges the event.
+  queue.WaitQueueEmpty();
+  EXPECT_EQ(1, queue.TryEnqueueBatch(segments.data(), 1));
+  queue.WaitQueueEmpty();
+  EXPECT_EQ(1, poll(&event_poll, 1, 0));
+  EXPECT_EQ(0, queue.TryEnqueueBatch(segments.data(), 0));
+  EXPECT_EQ(0, poll(&event_poll, 1, 0));
+  queue.Shutdown(true);
+}
+
+TEST(ThreadedStepMotionQueue, estop_aborts_segments) {
+  StepEdgeRecorder recorder;
+  ThreadedStepMotionQueue queue(&recorder);
+
+  MotionSegment segment = TravelSegment(100, 1000);
+  queue.SetEStop(true);
+  EXPECT_TRUE(queue.Enqueue(&segment));
+  queue.WaitQueueEmpty();
+  EXPECT_EQ(0u, recorder.TakeEdges().size());
+
+  // Next time we enqueue, we learn about the abort.
+  EXPECT_FALSE(queue.Enqueue(&segment));
+
+  queue.SetEStop(false);
+  EXPECT_TRUE(queue.Enqueue(&segment));
+  queue.WaitQueueEmpty();
+  EXPECT_EQ(50, CountSteps(recorder.TakeEdges(), 0));
+  queue.Shutdown(true);
+}
+
+TEST(ThreadedStepMotionQueue, underrun_detection) {
+  ThreadedStepMotionQueue queue(NULL);
+  MotionQueueStats stats;
+
+  MotionSegment segment = TravelSegment(10, 1000);
+  segment.ends_in_motion = 1;
+  EXPECT_TRUE(queue.Enqueue(&segment));
+  while (queue.GetPendingElements(NULL) > 0)
+    usleep(1000);
+  usleep(5000);  // The motors are supposed to move, but nothing comes.
+
+  segment.ends_in_motion = 0;
+  EXPECT_TRUE(queue.Enqueue(&segment));
+  queue.Shutdown(true);
+  queue.GetQueueStats(&stats);
+  EXPECT_EQ(1, stats.underruns);
+  EXPECT_GE(stats.underrun_max_usec, 5000);
+
+  // Waiting for the queue to run empty is intended.
+  ThreadedStepMotionQueue other_queue(NULL);
+  segment.ends_in_motion = 1;
+  EXPECT_TRUE(other_queue.Enqueue(&segment));
+  other_queue.WaitQueueEmpty();
+  segment.ends_in_motion = 0;
+  EXPECT_TRUE(other_queue.Enqueue(&segment));
+  other_queue.Shutdown(true);
+  other_queue.GetQueueStats(&stats);
+  EXPECT_EQ(0, stats.underruns);
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -25,6 +25,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <pruss_intc_mapping.h>
 #include <prussdrv.h>
 #include <stdio.h>
@@ -79,12 +80,21 @@ bool UioPrussInterface::StartExecution() {
   return true;
 }
 
-unsigned UioPrussInterface::WaitEvent() {
+unsigned UioPrussInterface::WaitEvent(int timeout_ms) {
+  if (timeout_ms >= 0) {
+    struct pollfd event_poll = { EventFd(), POLLIN, 0 };
+    if (poll(&event_poll, 1, timeout_ms) <= 0)
+      return 0;   // Timeout; reading the event would block.
+  }
   const unsigned num_events = prussdrv_pru_wait_event(PRU_EVTOUT_0);
   prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU_ARM_INTERRUPT);
   return num_events;
 }
 
+int UioPrussInterface::EventFd() {
+  return prussdrv_pru_event_fd(PRU_EVTOUT_0);
+}
+
 bool UioPrussInterface::Shutdown() {
   prussdrv_pru_disable(PRU_NUM);
   prussdrv_exit();